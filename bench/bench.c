@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Build against the engine the way the tests do: include it, with the REPL's
+// main() renamed out of the way.
+#define main oursql_main
+#include "../main.c"
+#undef main
+
+/*
+ * Micro-benchmarks for the engine. Each one times single operations into a
+ * histogram and reports throughput and p50/p99/p999 latencies as one JSON
+ * document on stdout, so runs against different versions can be diffed.
+ *
+ *   bench [--rows N] [--db FILE]
+ */
+
+#define BENCH_DEFAULT_ROWS 100000
+#define BENCH_DEFAULT_DB "bench.db"
+#define BENCH_LOOKUPS 100000
+#define BENCH_SCANS 20
+// serialize_row takes nanoseconds, below what a clock read resolves, so it
+// is timed in batches and each sample is a batch's average.
+#define BENCH_ROW_BATCH 1000
+#define BENCH_ROW_BATCHES 10000
+
+typedef struct {
+  uint64_t *samples; // nanoseconds per operation
+  uint64_t num_samples;
+  uint64_t capacity;
+  uint64_t total_ns; // wall time of the whole run, for throughput
+} Histogram;
+
+Histogram *histogram_new(uint64_t capacity) {
+  Histogram *histogram = malloc(sizeof(Histogram));
+  histogram->samples = malloc(capacity * sizeof(uint64_t));
+  histogram->num_samples = 0;
+  histogram->capacity = capacity;
+  histogram->total_ns = 0;
+  return histogram;
+}
+
+void histogram_free(Histogram *histogram) {
+  free(histogram->samples);
+  free(histogram);
+}
+
+void histogram_add(Histogram *histogram, uint64_t nanoseconds) {
+  if (histogram->num_samples < histogram->capacity) {
+    histogram->samples[histogram->num_samples++] = nanoseconds;
+  }
+}
+
+int compare_uint64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+void histogram_sort(Histogram *histogram) {
+  qsort(histogram->samples, histogram->num_samples, sizeof(uint64_t),
+        compare_uint64);
+}
+
+// The sample below which the given fraction of them fall, once sorted.
+uint64_t histogram_percentile(Histogram *histogram, double fraction) {
+  if (histogram->num_samples == 0) {
+    return 0;
+  }
+  uint64_t i = fraction * histogram->num_samples;
+  if (i >= histogram->num_samples) {
+    i = histogram->num_samples - 1;
+  }
+  return histogram->samples[i];
+}
+
+uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Results
+ *
+ * Written as the benchmarks finish: one object per benchmark in the
+ * "benchmarks" array, with extra fields a benchmark adds after the standard
+ * ones.
+ */
+uint32_t num_reported = 0;
+
+void report_begin(uint32_t rows) {
+  time_t now = time(NULL);
+  char date[32];
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  printf("{\n  \"db_file_version\": %d,\n  \"page_size\": %d,\n",
+         DB_FILE_VERSION, PAGE_SIZE);
+  printf("  \"rows\": %d,\n  \"date\": \"%s\",\n  \"benchmarks\": [", rows,
+         date);
+}
+
+// Open a benchmark's object; the caller may add fields, then report_close.
+void report(const char *name, Histogram *histogram, uint64_t ops) {
+  double seconds = histogram->total_ns / 1e9;
+  histogram_sort(histogram);
+
+  printf("%s\n    {\"name\": \"%s\", \"ops\": %lu, \"seconds\": %.6f, "
+         "\"ops_per_second\": %.1f,\n     \"p50_ns\": %lu, \"p99_ns\": %lu, "
+         "\"p999_ns\": %lu, \"max_ns\": %lu",
+         num_reported++ > 0 ? "," : "", name, (unsigned long)ops, seconds,
+         seconds > 0 ? ops / seconds : 0,
+         (unsigned long)histogram_percentile(histogram, 0.5),
+         (unsigned long)histogram_percentile(histogram, 0.99),
+         (unsigned long)histogram_percentile(histogram, 0.999),
+         (unsigned long)histogram_percentile(histogram, 1));
+}
+
+void report_close() { printf("}"); }
+
+void report_end() { printf("\n  ]\n}\n"); }
+
+/*
+ * Benchmarks
+ */
+void make_row(Row *row, uint32_t id) {
+  row->id = id;
+  sprintf(row->username, "user%d", id);
+  sprintf(row->email, "user%d@example.com", id);
+}
+
+void remove_db(const char *filename) {
+  char wal_filename[PATH_MAX];
+  snprintf(wal_filename, sizeof(wal_filename), "%s-wal", filename);
+  unlink(filename);
+  unlink(wal_filename);
+}
+
+// Insert ids in order, into a fresh file, one statement each.
+void bench_insert(const char *name, char *filename, uint32_t *ids,
+                  uint32_t num_rows) {
+  Histogram *histogram = histogram_new(num_rows);
+  Statement statement;
+  statement.type = STATEMENT_INSERT;
+
+  remove_db(filename);
+  Table *table = db_open(filename);
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < num_rows; i++) {
+    make_row(&statement.row_to_insert, ids[i]);
+    uint64_t begin = now_ns();
+    if (execute_insert(&statement, table) != EXECUTE_SUCCESS) {
+      fprintf(stderr, "Insert of %d failed.\n", ids[i]);
+      exit(EXIT_FAILURE);
+    }
+    histogram_add(histogram, now_ns() - begin);
+  }
+  db_close(table);
+  histogram->total_ns = now_ns() - start;
+
+  report(name, histogram, num_rows);
+  report_close();
+  histogram_free(histogram);
+}
+
+void bench_point_lookup(char *filename, uint32_t num_rows) {
+  Histogram *histogram = histogram_new(BENCH_LOOKUPS);
+  Table *table = db_open(filename);
+  Row row;
+
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < BENCH_LOOKUPS; i++) {
+    uint32_t key = 1 + rand() % num_rows;
+    uint64_t begin = now_ns();
+    Cursor *cursor = table_find(table, key);
+    deserialize_row(cursor_value(cursor), &row);
+    cursor_close(cursor);
+    histogram_add(histogram, now_ns() - begin);
+    if (row.id != key) {
+      fprintf(stderr, "Looked up %d, found %d.\n", key, row.id);
+      exit(EXIT_FAILURE);
+    }
+  }
+  histogram->total_ns = now_ns() - start;
+  db_close(table);
+
+  report("point_lookup", histogram, BENCH_LOOKUPS);
+  report_close();
+  histogram_free(histogram);
+}
+
+// Walk every row with a cursor, reading each out; a sample is one scan.
+void bench_full_scan(char *filename, uint32_t num_rows) {
+  Histogram *histogram = histogram_new(BENCH_SCANS);
+  Table *table = db_open(filename);
+  Row row;
+
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < BENCH_SCANS; i++) {
+    uint64_t begin = now_ns();
+    uint32_t count = 0;
+    Cursor *cursor = table_start(table);
+    while (!cursor->end_of_table) {
+      deserialize_row(cursor_value(cursor), &row);
+      count++;
+      cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    histogram_add(histogram, now_ns() - begin);
+    if (count != num_rows) {
+      fprintf(stderr, "Scanned %d rows of %d.\n", count, num_rows);
+      exit(EXIT_FAILURE);
+    }
+  }
+  histogram->total_ns = now_ns() - start;
+  db_close(table);
+
+  report("full_scan", histogram, BENCH_SCANS);
+  printf(", \"rows_per_second\": %.1f",
+         (double)num_rows * BENCH_SCANS / (histogram->total_ns / 1e9));
+  report_close();
+  histogram_free(histogram);
+}
+
+void bench_row_codec() {
+  Histogram *serialize = histogram_new(BENCH_ROW_BATCHES);
+  Histogram *deserialize = histogram_new(BENCH_ROW_BATCHES);
+  Row rows[BENCH_ROW_BATCH];
+  uint8_t buffers[BENCH_ROW_BATCH][ROW_MAX_SIZE];
+  Row row;
+
+  for (uint32_t i = 0; i < BENCH_ROW_BATCH; i++) {
+    make_row(&rows[i], i);
+  }
+  for (uint32_t batch = 0; batch < BENCH_ROW_BATCHES; batch++) {
+    uint64_t begin = now_ns();
+    for (uint32_t i = 0; i < BENCH_ROW_BATCH; i++) {
+      serialize_row(&rows[i], buffers[i]);
+    }
+    uint64_t middle = now_ns();
+    for (uint32_t i = 0; i < BENCH_ROW_BATCH; i++) {
+      deserialize_row(buffers[i], &row);
+      // Keep the compiler from dropping all but the last row.
+      __asm__ volatile("" : : "r"(&row) : "memory");
+    }
+    uint64_t end = now_ns();
+    histogram_add(serialize, (middle - begin) / BENCH_ROW_BATCH);
+    histogram_add(deserialize, (end - middle) / BENCH_ROW_BATCH);
+    serialize->total_ns += middle - begin;
+    deserialize->total_ns += end - middle;
+  }
+
+  uint64_t ops = (uint64_t)BENCH_ROW_BATCH * BENCH_ROW_BATCHES;
+  report("serialize_row", serialize, ops);
+  report_close();
+  report("deserialize_row", deserialize, ops);
+  report_close();
+  histogram_free(serialize);
+  histogram_free(deserialize);
+}
+
+/*
+ * What it costs to touch a page for the first time: a fault on a fresh
+ * mapping of the file in mmap mode, and a read into a buffer pool too small
+ * to hold the table. The file is dropped from the page cache first, where
+ * the kernel allows it, so faults are major ones; the fault counts are
+ * reported alongside to tell.
+ */
+void bench_page_faults(char *filename) {
+  DbOptions options = default_db_options();
+  struct rusage before, after;
+
+  int fd = open(filename, O_RDONLY);
+  uint32_t num_pages = lseek(fd, 0, SEEK_END) / PAGE_SIZE;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+
+  Histogram *histogram = histogram_new(num_pages);
+  options.pager_mode = PAGER_MODE_MMAP;
+  Table *table = db_open_with_options(filename, &options);
+  Pager *pager = table->pager;
+  getrusage(RUSAGE_SELF, &before);
+  uint64_t start = now_ns();
+  // The header and root were read opening the file; the rest are untouched.
+  for (uint32_t i = 0; i < num_pages; i++) {
+    uint64_t begin = now_ns();
+    volatile uint8_t *page = get_page(pager, i);
+    (void)page[PAGE_SIZE / 2];
+    histogram_add(histogram, now_ns() - begin);
+    pager_unpin(pager, i);
+  }
+  histogram->total_ns = now_ns() - start;
+  getrusage(RUSAGE_SELF, &after);
+  db_close(table);
+
+  report("page_fault_mmap", histogram, num_pages);
+  printf(", \"major_faults\": %ld, \"minor_faults\": %ld",
+         after.ru_majflt - before.ru_majflt,
+         after.ru_minflt - before.ru_minflt);
+  report_close();
+  histogram_free(histogram);
+
+  fd = open(filename, O_RDONLY);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+
+  histogram = histogram_new(num_pages);
+  options = default_db_options();
+  options.cache_pages = POOL_MIN_PAGES;
+  table = db_open_with_options(filename, &options);
+  pager = table->pager;
+  start = now_ns();
+  for (uint32_t i = 0; i < num_pages; i++) {
+    uint64_t begin = now_ns();
+    get_page(pager, i);
+    histogram_add(histogram, now_ns() - begin);
+    pager_unpin(pager, i);
+  }
+  histogram->total_ns = now_ns() - start;
+  db_close(table);
+
+  report("page_miss_buffer_pool", histogram, num_pages);
+  report_close();
+  histogram_free(histogram);
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t num_rows = BENCH_DEFAULT_ROWS;
+  char *filename = BENCH_DEFAULT_DB;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+      num_rows = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--db") == 0 && i + 1 < argc) {
+      filename = argv[++i];
+    } else {
+      fprintf(stderr, "Usage: %s [--rows N] [--db FILE]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (num_rows == 0) {
+    fprintf(stderr, "Need at least one row.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t *ids = malloc(num_rows * sizeof(uint32_t));
+  for (uint32_t i = 0; i < num_rows; i++) {
+    ids[i] = i + 1;
+  }
+
+  srand(1);
+  report_begin(num_rows);
+  bench_insert("insert_sequential", filename, ids, num_rows);
+  for (uint32_t i = num_rows - 1; i > 0; i--) {
+    uint32_t j = rand() % (i + 1);
+    uint32_t id = ids[i];
+    ids[i] = ids[j];
+    ids[j] = id;
+  }
+  bench_insert("insert_random", filename, ids, num_rows);
+  bench_point_lookup(filename, num_rows);
+  bench_full_scan(filename, num_rows);
+  bench_row_codec();
+  bench_page_faults(filename);
+  report_end();
+
+  remove_db(filename);
+  free(ids);
+  return 0;
+}
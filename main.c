@@ -1,20 +1,99 @@
+// O_DIRECT, fdatasync and IOV_MAX are GNU/XSI extensions on glibc.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
-#define TABLE_MAX_PAGES 100
+#define DEFAULT_CACHE_PAGES 1024
+// A split pins a handful of pages at once, whatever the height of the tree.
+#define POOL_MIN_PAGES 16
+// Address space set aside up front for the mmap pager, so the mapping can
+// grow in place and page pointers never move.
+#define MMAP_RESERVE_BYTES (1ULL << 40)
+#define MMAP_MIN_GROWTH_BYTES (1 << 20)
+// Group commit: the WAL is synced once this many statements are pending, or
+// once this long has passed since the last sync.
+#define DEFAULT_WAL_SYNC_STATEMENTS 64
+#define DEFAULT_WAL_SYNC_INTERVAL_MS 10
+// Page frames are carved out of chunks this size, backed by huge pages when
+// the system has them.
+#define FRAME_SLAB_CHUNK_BYTES (2 * 1024 * 1024)
+// Bulk loads sort inputs of up to this many rows in memory; larger inputs
+// are sorted in runs of this size and merged.
+#define IMPORT_RUN_ROWS (64 * 1024 * 1024 / sizeof(Row))
+#define IMPORT_MERGE_BUFFER_ROWS 1024
+#define IMPORT_DEFAULT_FILL_PERCENT 100
+#define STATEMENT_MAX_PREDICATES 8
+#define STATEMENT_MAX_AGGREGATES 8
+#define PREDICATE_MAX_IDS 64
+#define RESULT_WRITER_BUFFER_SIZE (64 * 1024)
+#define STATEMENT_MAX_TOKENS 192
+#define PROGRAM_MAX_INSTRUCTIONS 96
+#define STATEMENT_CACHE_ENTRIES 64
+#define STATEMENT_CACHE_KEY_SIZE 256
+#define MAX_INDEXES 2 // one per string column
+#define INDEX_MAX_DEPTH 16
+#define TREE_MAX_DEPTH 32
+// A scan asks for the next READ_AHEAD_PAGES leaves to be read in ahead of
+// it, out of the up to CURSOR_MAX_AHEAD that follow its leaf in the parent.
+#define READ_AHEAD_PAGES 8
+#define CURSOR_MAX_AHEAD 64
+#define WAL_BUFFER_SIZE (64 * 1024)
+#define WAL_CHECKPOINT_BYTES (16 * 1024 * 1024)
+#define SCAN_MORSEL_PAGES 16
+#define SCAN_MAX_THREADS 64
+#define SERVER_MAX_WORKERS 64
+#define SERVER_MAX_EVENTS 64
+#define SERVER_LISTEN_BACKLOG 128
+// POSIX guarantees only 16, and glibc hides the real limit (1024) unless
+// _XOPEN_SOURCE is defined.
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)
 
-typedef enum { EXECUTE_SUCCESS, EXECUTE_TABLE_FULL } ExecuteResult;
-typedef enum { STATEMENT_INSERT, STATMENT_SELECT } StatementType;
+typedef enum {
+  EXECUTE_SUCCESS,
+  EXECUTE_TABLE_FULL,
+  EXECUTE_DUPLICATE_KEY,
+  EXECUTE_INDEX_EXISTS,
+  EXECUTE_TRANSACTION_OPEN,
+  EXECUTE_NO_TRANSACTION,
+  EXECUTE_TRANSACTIONS_UNSUPPORTED
+} ExecuteResult;
+typedef enum {
+  STATEMENT_INSERT,
+  STATMENT_SELECT,
+  STATEMENT_CREATE_INDEX,
+  STATEMENT_TRANSACTION
+} StatementType;
 
 typedef enum {
   META_COMMAND_SUCCESS,
@@ -26,37 +105,268 @@ typedef enum {
   PREPARE_UNRECOGNISED_STATEMENT,
   PREPARE_SYNTAX_ERROR,
   PREPARE_STRING_TOO_LONG,
+  PREPARE_NEGATIVE_ID,
 } PrepareResult;
 
-typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+typedef enum {
+  NODE_INTERNAL,
+  NODE_LEAF,
+  NODE_INDEX_INTERNAL,
+  NODE_INDEX_LEAF
+} NodeType;
+
+typedef enum { LEAF_LAYOUT_SLOTTED, LEAF_LAYOUT_PAX } LeafLayout;
+
+// Columns a scan reads, as a mask.
+typedef enum {
+  COLUMN_ID = 1,
+  COLUMN_USERNAME = 2,
+  COLUMN_EMAIL = 4,
+  COLUMN_ALL = COLUMN_ID | COLUMN_USERNAME | COLUMN_EMAIL
+} ColumnMask;
+
+typedef enum {
+  PREDICATE_ID_RANGE, // min_id <= id <= max_id
+  PREDICATE_ID_IN,    // id is one of ids
+  PREDICATE_EQUALS,   // column is text
+  PREDICATE_PREFIX    // column starts with text
+} PredicateType;
+
+// Functions of the ids a select matches, in place of its rows.
+typedef enum {
+  AGGREGATE_COUNT,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX,
+  AGGREGATE_SUM
+} Aggregate;
+
+typedef enum {
+  OUTPUT_TUPLE,
+  OUTPUT_CSV,
+  OUTPUT_TSV,
+  OUTPUT_JSON,
+  OUTPUT_BINARY
+} OutputFormat;
+
+typedef enum { PAGER_MODE_BUFFER_POOL, PAGER_MODE_MMAP } PagerMode;
+
+typedef enum {
+  WAL_RECORD_INSERT = 1,
+  WAL_RECORD_UNDO = 2,
+  WAL_RECORD_BEGIN = 3,
+  WAL_RECORD_COMMIT = 4
+} WalRecordType;
+
+typedef enum {
+  TOKEN_END,
+  TOKEN_KEYWORD,
+  TOKEN_SYMBOL,
+  TOKEN_NUMBER, // a decimal that fits an id
+  TOKEN_STRING  // any other word
+} TokenType;
+
+typedef enum {
+  KEYWORD_INSERT,
+  KEYWORD_SELECT,
+  KEYWORD_WHERE,
+  KEYWORD_AND,
+  KEYWORD_IN,
+  KEYWORD_LIKE,
+  KEYWORD_ID,
+  KEYWORD_USERNAME,
+  KEYWORD_EMAIL,
+  KEYWORD_CREATE,
+  KEYWORD_INDEX,
+  KEYWORD_ON,
+  KEYWORD_BEGIN,
+  KEYWORD_COMMIT,
+  KEYWORD_ROLLBACK,
+  KEYWORD_BETWEEN,
+  // The aggregates, in Aggregate order.
+  KEYWORD_COUNT,
+  KEYWORD_MIN,
+  KEYWORD_MAX,
+  KEYWORD_SUM
+} Keyword;
+
+typedef enum {
+  SYMBOL_COMMA,
+  SYMBOL_LEFT_PAREN,
+  SYMBOL_RIGHT_PAREN,
+  SYMBOL_STAR,
+  SYMBOL_EQUALS,
+  SYMBOL_LESS,
+  SYMBOL_LESS_EQUAL,
+  SYMBOL_GREATER,
+  SYMBOL_GREATER_EQUAL
+} Symbol;
+
+/*
+ * Bytecode operations. The bind operations copy literals out of the
+ * statement's tokens when it is prepared; the rest run when it executes.
+ */
+typedef enum {
+  OP_HALT,
+  OP_BIND_ROW_ID,       // token: the id to insert
+  OP_BIND_ROW_USERNAME, // token: the username to insert
+  OP_BIND_ROW_EMAIL,    // token: the email to insert
+  OP_BIND_ID_COMPARE,   // arg: Symbol, token: the id compared with
+  OP_BIND_ID_IN,        // a new, empty "id in" predicate
+  OP_BIND_IN_ID,        // token: an id for the last "id in" predicate
+  OP_BIND_EQUALS,       // arg: column, token: the string it equals
+  OP_BIND_LIKE,         // arg: column, token: the pattern
+  OP_INSERT,
+  OP_CREATE_INDEX,      // arg: column
+  OP_BEGIN,
+  OP_COMMIT,
+  OP_ROLLBACK,
+  OP_OPEN_INDEX,        // operand: where to jump when no index applies
+  OP_EMIT_INDEXED,
+  OP_PARALLEL_SCAN,     // operand: where to jump when it ran the scan
+  OP_OPEN_SCAN,         // operand: where to jump when no id can match
+  OP_FILTER_LEAF,
+  OP_EMIT_SELECTED,
+  OP_NEXT_LEAF,         // operand: where to jump when there is another leaf
+  OP_CLOSE_SCAN,
+  OP_AGGREGATE          // computes and writes the program's aggregates
+} Opcode;
+
+typedef struct {
+  uint8_t opcode;
+  uint8_t arg;
+  uint16_t operand; // a token index or a jump target
+} Instruction;
+
+typedef struct {
+  StatementType type;
+  uint32_t columns; // ColumnMask of the columns a select prints
+  uint32_t num_aggregates; // a select of aggregates prints these instead
+  uint8_t aggregates[STATEMENT_MAX_AGGREGATES];
+  uint32_t num_bind;
+  Instruction bind[PROGRAM_MAX_INSTRUCTIONS];
+  uint32_t num_code;
+  Instruction code[PROGRAM_MAX_INSTRUCTIONS];
+} Program;
+
+typedef struct {
+  TokenType type;
+  uint32_t kind;  // the Keyword or Symbol
+  uint32_t value; // the value of a number
+  const char *start;
+  uint32_t length;
+} Token;
 
 typedef struct {
   uint32_t id;
-  char username[COLUMN_USERNAME_SIZE];
-  char email[COLUMN_EMAIL_SIZE];
+  char username[COLUMN_USERNAME_SIZE + 1];
+  char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+typedef struct {
+  PredicateType type;
+  uint32_t column; // COLUMN_USERNAME or COLUMN_EMAIL, for string predicates
+  uint32_t min_id;
+  uint32_t max_id;
+  uint32_t num_ids;
+  uint32_t ids[PREDICATE_MAX_IDS];
+  uint32_t length;
+  char text[COLUMN_EMAIL_SIZE + 1];
+} Predicate;
+
 typedef struct {
   StatementType type;
   Row row_to_insert;
+  uint32_t columns; // ColumnMask of the columns a select prints
+  uint32_t num_predicates;
+  Predicate predicates[STATEMENT_MAX_PREDICATES]; // all must hold
+  Program program;
+  // Point into the input the statement was prepared from.
+  uint32_t num_tokens;
+  Token tokens[STATEMENT_MAX_TOKENS];
 } Statement;
 
+// Compiled programs by the statement's text with its literals blanked out.
+typedef struct {
+  char key[STATEMENT_CACHE_KEY_SIZE]; // empty for an unused entry
+  Program program;
+} StatementCacheEntry;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  StatementCacheEntry entries[STATEMENT_CACHE_ENTRIES];
+} StatementCache;
+
 typedef struct {
   char *buffer;
   size_t buffer_length;
   size_t input_length;
 } InputBuffer;
 
+/*
+ * Serialized Row Layout
+ *
+ * The id, one length byte each for username and email, then the two strings
+ * back to back without terminators.
+ */
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
 const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+const uint32_t USERNAME_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t USERNAME_LENGTH_OFFSET = ID_OFFSET + ID_SIZE;
+const uint32_t EMAIL_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t EMAIL_LENGTH_OFFSET =
+    USERNAME_LENGTH_OFFSET + USERNAME_LENGTH_SIZE;
+const uint32_t ROW_STRINGS_OFFSET = EMAIL_LENGTH_OFFSET + EMAIL_LENGTH_SIZE;
+// Everything after the id; leaves with compressed keys store only this.
+const uint32_t ROW_BODY_OFFSET = ID_OFFSET + ID_SIZE;
+const uint32_t ROW_MIN_SIZE = ROW_STRINGS_OFFSET;
+const uint32_t ROW_MAX_SIZE =
+    ROW_STRINGS_OFFSET + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
 
 const uint32_t PAGE_SIZE = 4096;
 
+/*
+ * Page Trailer Layout
+ *
+ * Every page ends in a CRC32C of the bytes before it, stamped as the page
+ * is written to the db file and checked as it is read back. Nodes lay out
+ * their contents in the PAGE_CONTENT_SIZE bytes ahead of it.
+ */
+const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t PAGE_CHECKSUM_OFFSET = PAGE_SIZE - PAGE_CHECKSUM_SIZE;
+const uint32_t PAGE_CONTENT_SIZE = PAGE_CHECKSUM_OFFSET;
+
+/*
+ * File Header Layout
+ *
+ * Page 0 identifies the file and records where the table's root lives.
+ */
+const uint32_t DB_FILE_MAGIC = 0x4c51534e; // "NSQL"
+// Version 1 was the headerless file of fixed-width leaf cells; version 2
+// had no key width byte in the node header, version 3 no leaf layout byte,
+// version 4 no index catalog, version 5 no next leaf pointer, version 6 no
+// row count, version 7 no page checksums.
+const uint32_t DB_FILE_VERSION = 8;
+const uint32_t DB_HEADER_PAGE_NUM = 0;
+const uint32_t DB_HEADER_MAGIC_OFFSET = 0;
+const uint32_t DB_HEADER_VERSION_OFFSET =
+    DB_HEADER_MAGIC_OFFSET + sizeof(uint32_t);
+const uint32_t DB_HEADER_ROOT_PAGE_NUM_OFFSET =
+    DB_HEADER_VERSION_OFFSET + sizeof(uint32_t);
+// The index catalog: a count, then the column and root page of each index.
+const uint32_t DB_HEADER_NUM_INDEXES_OFFSET =
+    DB_HEADER_ROOT_PAGE_NUM_OFFSET + sizeof(uint32_t);
+const uint32_t DB_HEADER_INDEXES_OFFSET =
+    DB_HEADER_NUM_INDEXES_OFFSET + sizeof(uint32_t);
+const uint32_t DB_HEADER_INDEX_SIZE = 2 * sizeof(uint32_t);
+// Rows in the table, so counting them needs no scan.
+const uint32_t DB_HEADER_NUM_ROWS_OFFSET =
+    DB_HEADER_INDEXES_OFFSET + MAX_INDEXES * DB_HEADER_INDEX_SIZE;
+// Set while the mmap pager has the file open: its pages change in the
+// mapping and are only stamped with their checksums again at close.
+const uint32_t DB_HEADER_CHECKSUMS_STALE_OFFSET =
+    DB_HEADER_NUM_ROWS_OFFSET + sizeof(uint64_t);
+
 /*
  * Shared Node Header Layout
  */
@@ -65,293 +375,6902 @@ const uint32_t NODE_TYPE_OFFSET = 0;
 const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
+const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+// 0 for a node with plain keys, else the delta width of its key block.
+const uint32_t KEY_WIDTH_SIZE = sizeof(uint8_t);
+const uint32_t KEY_WIDTH_OFFSET = PARENT_POINTER_OFFSET + PARENT_POINTER_SIZE;
 const uint8_t COMMON_NODE_HEADER_SIZE =
-    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE + KEY_WIDTH_SIZE;
+
+/*
+ * Key Block Layout
+ *
+ * Nodes created with compressed keys keep their sorted keys in a key block
+ * rather than one full key per cell. The keys are split into runs of
+ * KEY_BLOCK_RUN_LENGTH; each run's first key is stored in full as an anchor,
+ * and every key as its difference from its run's anchor, in a width of 1, 2
+ * or 4 bytes shared by the whole block. The anchors come first, so a search
+ * binary-searches them and then the fixed-width deltas of a single run.
+ */
+const uint32_t KEY_BLOCK_RUN_LENGTH = 16;
+const uint32_t KEY_BLOCK_ANCHOR_SIZE = sizeof(uint32_t);
+const uint32_t KEY_BLOCK_MIN_WIDTH = 1;
 
 /*
  * Leaf Header Layout
  */
 const uint32_t LEAF_NODE_NUM_CELL_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELL_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET =
+    LEAF_NODE_NUM_CELL_OFFSET + LEAF_NODE_NUM_CELL_SIZE;
+const uint32_t LEAF_NODE_FRAGMENTED_BYTES_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_FRAGMENTED_BYTES_OFFSET =
+    LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE;
+const uint32_t LEAF_NODE_LAYOUT_SIZE = sizeof(uint8_t);
+const uint32_t LEAF_NODE_LAYOUT_OFFSET =
+    LEAF_NODE_FRAGMENTED_BYTES_OFFSET + LEAF_NODE_FRAGMENTED_BYTES_SIZE;
+// The page of the leaf to the right, or 0 for the last leaf.
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
+    LEAF_NODE_LAYOUT_OFFSET + LEAF_NODE_LAYOUT_SIZE;
 const uint32_t LEAF_NODE_HEADER_SIZE =
-    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELL_SIZE;
+    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELL_SIZE +
+    LEAF_NODE_CONTENT_START_SIZE + LEAF_NODE_FRAGMENTED_BYTES_SIZE +
+    LEAF_NODE_LAYOUT_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
 
 /*
- * Leaf Node Layout
+ * Leaf Node Body Layout
+ *
+ * A slotted page. An array of 2-byte cell offsets, in key order, grows up
+ * from the header while cells are packed down from the page trailer;
+ * content_start is the lowest cell byte. Each cell is a serialized row, so
+ * its first four bytes are the key. Bytes freed inside the cell area are
+ * counted as fragmented until the page is compacted.
+ *
+ * With compressed keys, the key block sits between the header and the slot
+ * array, and each cell holds only the row's body.
  */
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET =
-    LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_SPACE_FOR_CELLS =
+    PAGE_CONTENT_SIZE - LEAF_NODE_HEADER_SIZE;
+// Only reached with empty usernames and emails.
 const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+    LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_SLOT_SIZE + ROW_MIN_SIZE);
+const uint32_t LEAF_NODE_COMPRESSED_MAX_CELLS =
+    LEAF_NODE_SPACE_FOR_CELLS /
+    (LEAF_NODE_SLOT_SIZE + ROW_MIN_SIZE - ROW_BODY_OFFSET + KEY_BLOCK_MIN_WIDTH);
+// Words in a bitmap with a bit for every cell of the fullest leaf.
+const uint32_t LEAF_NODE_SELECTION_WORDS =
+    (LEAF_NODE_COMPRESSED_MAX_CELLS + 63) / 64;
+
+/*
+ * PAX Leaf Body Layout
+ *
+ * Leaves created with --pax keep each column in its own minipage, packed one
+ * after another from the header: the ids (a key block when keys are
+ * compressed), the end offset of every username within the username bytes,
+ * the same for the emails, then the username bytes and the email bytes. All
+ * free space is at the end of the page, and the content_start and
+ * fragmented_bytes fields are unused. A scan reads only the minipages of
+ * the columns it needs.
+ */
+const uint32_t PAX_END_OFFSET_SIZE = sizeof(uint16_t);
+
+/*
+ * Internal Node Header Layout
+ */
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
+    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                           INTERNAL_NODE_NUM_KEYS_SIZE +
+                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
+
+/*
+ * Internal Node Body Layout
+ *
+ * Each cell holds a child page number and the largest key stored in that
+ * child's subtree. The right child has no key of its own.
+ *
+ * With compressed keys, the child page numbers come first as a plain array
+ * and the key block follows them.
+ */
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_CELL_SIZE =
+    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS =
+    PAGE_CONTENT_SIZE - INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_MAX_KEYS =
+    INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+const uint32_t INTERNAL_NODE_COMPRESSED_MAX_KEYS =
+    INTERNAL_NODE_SPACE_FOR_CELLS /
+    (INTERNAL_NODE_CHILD_SIZE + KEY_BLOCK_MIN_WIDTH);
+const uint32_t INVALID_PAGE_NUM = UINT32_MAX;
+
+/*
+ * Index Node Layout
+ *
+ * A secondary index is a B-tree of its own in the db file, with one
+ * fixed-size entry per row: the first INDEX_KEY_SIZE bytes of the column
+ * value, zero-padded, then the row's id stored big-endian, so entries sort
+ * by (value, id) under memcmp. A username always fits; emails longer than
+ * the key share it, so lookups re-check every row they find.
+ *
+ * An index leaf holds a sorted array of entries and the page number of the
+ * next leaf, 0 for the last. An index internal node has the internal node
+ * header, then (child, max entry) cells; the right child has no entry.
+ * Splits work from the path taken down the tree, so parent pointers are
+ * not kept.
+ */
+const uint32_t INDEX_KEY_SIZE = 32;
+const uint32_t INDEX_ENTRY_SIZE = INDEX_KEY_SIZE + sizeof(uint32_t);
+const uint32_t INDEX_LEAF_NUM_ENTRIES_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INDEX_LEAF_NEXT_LEAF_OFFSET =
+    INDEX_LEAF_NUM_ENTRIES_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_LEAF_HEADER_SIZE =
+    INDEX_LEAF_NEXT_LEAF_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_LEAF_MAX_ENTRIES =
+    (PAGE_CONTENT_SIZE - INDEX_LEAF_HEADER_SIZE) / INDEX_ENTRY_SIZE;
+const uint32_t INDEX_INTERNAL_CELL_SIZE =
+    INTERNAL_NODE_CHILD_SIZE + INDEX_ENTRY_SIZE;
+const uint32_t INDEX_INTERNAL_MAX_KEYS =
+    INTERNAL_NODE_SPACE_FOR_CELLS / INDEX_INTERNAL_CELL_SIZE;
+
+/*
+ * WAL Header Layout
+ *
+ * The header names the checkpoint the log follows: the page count of the db
+ * file at that point, and an epoch that seeds every record checksum so that
+ * records left over from an earlier checkpoint never validate.
+ */
+const uint32_t WAL_MAGIC = 0x57414c31; // "WAL1"
+const uint32_t WAL_MAGIC_OFFSET = 0;
+const uint32_t WAL_EPOCH_OFFSET = WAL_MAGIC_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_CHECKPOINT_PAGES_OFFSET = WAL_EPOCH_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_HEADER_CHECKSUM_OFFSET =
+    WAL_CHECKPOINT_PAGES_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_HEADER_SIZE = WAL_HEADER_CHECKSUM_OFFSET + sizeof(uint32_t);
+
+/*
+ * WAL Record Layout
+ *
+ * INSERT records carry a serialized row and are replayed on open. UNDO
+ * records carry a page number and the page as of the checkpoint; they are
+ * logged before that page is first overwritten in the db file, so recovery
+ * can roll the file back to the checkpoint before replaying inserts.
+ *
+ * A transaction's inserts sit between an empty BEGIN record and a COMMIT
+ * record carrying their count. Recovery replays them only once it reaches
+ * the COMMIT, so a commit torn part way through is dropped whole.
+ */
+const uint32_t WAL_RECORD_TYPE_OFFSET = 0;
+const uint32_t WAL_RECORD_LENGTH_OFFSET =
+    WAL_RECORD_TYPE_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_RECORD_CHECKSUM_OFFSET =
+    WAL_RECORD_LENGTH_OFFSET + sizeof(uint32_t);
+const uint32_t WAL_RECORD_HEADER_SIZE =
+    WAL_RECORD_CHECKSUM_OFFSET + sizeof(uint32_t);
+
+typedef struct {
+  int file_descriptor;
+  uint32_t epoch;
+  uint32_t checkpoint_pages;
+  off_t length; // bytes written to the file, not counting the buffer
+  void *buffer;
+  uint32_t buffer_used;
+  uint8_t *undo_logged; // one bit per page below checkpoint_pages
+  uint32_t pending_statements;
+  uint64_t last_sync_ms;
+  uint32_t sync_statements;
+  uint32_t sync_interval_ms;
+  // Rows recovered at open, replayed once the table is up.
+  void *replay;
+  uint32_t replay_length;
+  bool replaying;
+  // Inside a transaction, INSERT records wait here for its commit.
+  bool in_transaction;
+  void *transaction;
+  uint32_t transaction_used;
+  uint32_t transaction_capacity;
+  uint32_t transaction_rows;
+  // Syncs statements left pending once sync_interval_ms has passed, so a
+  // quiet connection does not wait for its next statement to make them
+  // durable.
+  pthread_mutex_t *latch; // the pager latch, which guards the log
+  pthread_t flusher;
+  pthread_cond_t wake; // signalled when statements become pending, or to stop
+  bool flusher_running;
+  bool stopping;
+} Wal;
+
+/*
+ * Allocator for page frames. Frames are PAGE_SIZE-aligned, as O_DIRECT needs,
+ * and come from large mmap'd chunks: first from the untouched tail of the
+ * newest chunk, then from frames handed back with slab_free.
+ */
+typedef struct {
+  void **chunks;
+  uint32_t num_chunks;
+  uint32_t chunk_size;
+  void *tail;
+  uint32_t tail_frames;
+  void *free_list; // freed frames, linked through their first word
+} FrameSlab;
+
+/*
+ * A slot in the buffer pool. Resident frames are chained into the pager's
+ * page table by next_in_bucket.
+ */
+typedef struct {
+  uint32_t page_num;
+  uint32_t pin_count;
+  int32_t next_in_bucket;
+  bool dirty;
+  bool referenced; // CLOCK second-chance bit
+  void *data;
+  // Shared by readers of the page, exclusive to the writer changing it.
+  // Only taken while the frame is pinned.
+  pthread_rwlock_t latch;
+} Frame;
+
+/*
+ * An open transaction. The pager starts it with every frame clean and keeps
+ * the pages it changes out of the db file until commit, so the file holds
+ * the state to roll back to. Should the pool fill up with such pages, they
+ * are written out anyway, after their images in the file are copied to undo.
+ */
+typedef struct {
+  uint32_t num_pages; // the pager's num_pages at begin
+  off_t file_length;
+  uint8_t *undo_saved; // one bit per page below num_pages
+  uint32_t num_undo;
+  uint32_t undo_capacity;
+  uint32_t *undo_page_nums;
+  void *undo_images;
+} Transaction;
 
 typedef struct {
   int file_descriptor;
-  uint32_t file_length;
+  off_t file_length;
   uint32_t num_pages;
-  void *pages[TABLE_MAX_PAGES];
+  PagerMode mode;
+  // PAGER_MODE_MMAP: the file is mapped at map, map_length bytes of it.
+  void *map;
+  off_t map_length;
+  // PAGER_MODE_BUFFER_POOL
+  Frame *frames;
+  uint32_t num_frames;
+  uint32_t num_frames_used;
+  uint32_t clock_hand;
+  int32_t *buckets;
+  uint32_t hash_shift;
+  FrameSlab slab;
+  void *scratch; // one aligned page for I/O outside the frames
+  Wal *wal;      // NULL when logging is off
+  Transaction *transaction; // NULL outside begin ... commit
+  // Guards the page table, pins, the clock, and the WAL, so any thread can
+  // fetch pages. Recursive, as eviction can lead back into the pager.
+  pthread_mutex_t latch;
+  bool read_ahead; // the file goes through the page cache
 } Pager;
 
+typedef struct {
+  uint32_t cache_pages; // buffer pool budget, in pages
+  PagerMode pager_mode;
+  bool direct_io;
+  bool wal_enabled;
+  uint32_t wal_sync_statements;
+  uint32_t wal_sync_interval_ms;
+  // Format of the root of a new database file.
+  bool compress_keys;
+  LeafLayout leaf_layout;
+  uint32_t scan_threads; // threads for parallel scans; 1 scans serially
+  uint32_t scrub_pages_per_second; // 0 runs no scrubber
+} DbOptions;
+
+typedef struct {
+  uint32_t column; // COLUMN_USERNAME or COLUMN_EMAIL
+  uint32_t root_page_num;
+} Index;
+
+#define PROFILE_ACCESS_PATH_SIZE 128
+
+/*
+ * What explain analyze reports on the statement it runs: the access path
+ * the VM took and how many pages each level of the tree handed out, with
+ * the root at level 0. Scan threads add to the counts too.
+ */
+typedef struct Profile {
+  char access_path[PROFILE_ACCESS_PATH_SIZE];
+  uint64_t pages_per_level[TREE_MAX_DEPTH];
+  uint64_t index_pages;
+} Profile;
+
 typedef struct {
   Pager *pager;
   uint32_t root_page_num;
+  OutputFormat output_format; // how selects write rows, set by .mode
+  bool timer;                 // time each statement, set by .timer
+  Profile *profile;           // set while explain analyze runs a statement
+  uint32_t num_indexes;       // a copy of the catalog in the file header
+  Index indexes[MAX_INDEXES];
+  pthread_mutex_t writer; // held by the one statement changing the table
+  // Shared by every cursor and index lookup; exclusive only while a
+  // rollback puts back many pages at once.
+  pthread_rwlock_t tree_latch;
+  struct ScanPool *scan_pool; // NULL when scans run on one thread
+  struct Scrubber *scrubber;  // NULL when no scrubber runs
 } Table;
 
+// Collects query output and hands it to stdio a buffer at a time.
+typedef struct {
+  FILE *output;
+  OutputFormat format;
+  uint32_t length;
+  char buffer[RESULT_WRITER_BUFFER_SIZE];
+} ResultWriter;
+
 typedef struct {
   Table *table;
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;
+  // cursor_value reassembles rows from leaves with compressed keys here.
+  uint8_t value[sizeof(uint32_t) + 2 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE];
+  // Pages the cursor holds latched, from the top down; the leaf is last.
+  uint32_t num_latched;
+  uint32_t latched[TREE_MAX_DEPTH];
+  // The leaves after the cursor's in its parent, as of the last descent:
+  // the next one the cursor steps onto, and how many were read ahead.
+  uint32_t num_ahead;
+  uint32_t next_ahead;
+  uint32_t num_hinted;
+  uint32_t ahead[CURSOR_MAX_AHEAD];
+  uint32_t level; // of the leaf, as of the last descent
 } Cursor;
 
 void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
+  printf("ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
   printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
   printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+  printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
   printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
   printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
 }
 
-void print_row(Row *row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
+/*
+ * Runtime Statistics
+ *
+ * Counters and latency histograms for the hot paths. Each thread bumps its
+ * own copy, which no other thread writes, so a bump is a plain add; reading
+ * sums every thread's copy along with what exited threads left behind.
+ * Resetting records the current totals as a baseline to subtract, rather
+ * than clearing counters other threads own.
+ */
+typedef enum {
+  STAT_PAGE_HITS,     // pins the buffer pool had the page for
+  STAT_PAGE_MISSES,   // pins that read the page in
+  STAT_BYTES_READ,    // from the db file, on misses
+  STAT_BYTES_WRITTEN, // to the db file, by flushes and write-back
+  STAT_ROWS_SCANNED,  // cells predicates were evaluated over
+  STAT_ROWS_RETURNED, // rows written out to results
+} Stat;
+#define STAT_COUNT (STAT_ROWS_RETURNED + 1)
+const char *STAT_NAMES[] = {"page_hits",     "page_misses",  "bytes_read",
+                            "bytes_written", "rows_scanned", "rows_returned"};
 
-void serialize_row(Row *source, void *destination) {
-  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-  memcpy(destination + EMAIL_OFFSET, (source->email), EMAIL_SIZE);
+#define STATEMENT_TYPE_COUNT (STATEMENT_TRANSACTION + 1)
+const char *STATEMENT_TYPE_NAMES[] = {"insert", "select", "create_index",
+                                      "transaction"};
+
+// Bucket b counts statements that took [2^b, 2^(b+1)) nanoseconds.
+#define STATS_LATENCY_BUCKETS 48
+
+typedef struct Stats {
+  uint64_t counters[STAT_COUNT];
+  uint64_t latency[STATEMENT_TYPE_COUNT][STATS_LATENCY_BUCKETS];
+  uint64_t latency_ns[STATEMENT_TYPE_COUNT]; // summed, for the mean
+  struct Stats *next;
+} Stats;
+
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+Stats *stats_threads;  // every live thread's, guarded by stats_lock
+Stats stats_exited;    // folded in from threads as they exit
+Stats stats_baseline;  // the totals at the last reset
+__thread Stats *thread_stats;
+pthread_key_t stats_key;
+pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+// Add every field of from into to. from's owner may be bumping it still.
+void stats_add_into(Stats *to, Stats *from) {
+  uint64_t *source = (uint64_t *)from;
+  uint64_t *destination = (uint64_t *)to;
+  for (uint32_t i = 0; i < offsetof(Stats, next) / sizeof(uint64_t); i++) {
+    destination[i] += __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+  }
 }
 
-void deserialize_row(void *source, Row *destination) {
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+void stats_thread_exit(void *argument) {
+  Stats *stats = argument;
+  pthread_mutex_lock(&stats_lock);
+  stats_add_into(&stats_exited, stats);
+  Stats **link = &stats_threads;
+  while (*link != stats) {
+    link = &(*link)->next;
+  }
+  *link = stats->next;
+  pthread_mutex_unlock(&stats_lock);
+  free(stats);
 }
 
-uint32_t *leaf_node_num_cells(void *node) {
-  return node + LEAF_NODE_NUM_CELL_OFFSET;
+void stats_make_key() { pthread_key_create(&stats_key, stats_thread_exit); }
+
+Stats *stats_local() {
+  if (thread_stats == NULL) {
+    pthread_once(&stats_key_once, stats_make_key);
+    thread_stats = calloc(1, sizeof(Stats));
+    pthread_mutex_lock(&stats_lock);
+    thread_stats->next = stats_threads;
+    stats_threads = thread_stats;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, thread_stats);
+  }
+  return thread_stats;
 }
 
-void *leaf_node_cell(void *node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+// Only the owning thread writes, so a relaxed load and store is enough.
+void stats_bump(uint64_t *counter, uint64_t amount) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount,
+                   __ATOMIC_RELAXED);
 }
 
-uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+void stats_add(Stat stat, uint64_t amount) {
+  stats_bump(&stats_local()->counters[stat], amount);
 }
 
-void *leaf_node_value(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+void stats_record_latency(StatementType type, uint64_t nanoseconds) {
+  Stats *stats = stats_local();
+  uint32_t bucket = nanoseconds == 0 ? 0 : 63 - __builtin_clzll(nanoseconds);
+  if (bucket >= STATS_LATENCY_BUCKETS) {
+    bucket = STATS_LATENCY_BUCKETS - 1;
+  }
+  stats_bump(&stats->latency[type][bucket], 1);
+  stats_bump(&stats->latency_ns[type], nanoseconds);
 }
 
-void initialize_leaf_node(void *node) { *leaf_node_num_cells(node) = 0; }
+// The totals since the last reset.
+void stats_collect(Stats *total) {
+  memset(total, 0, sizeof(Stats));
+  pthread_mutex_lock(&stats_lock);
+  stats_add_into(total, &stats_exited);
+  for (Stats *stats = stats_threads; stats != NULL; stats = stats->next) {
+    stats_add_into(total, stats);
+  }
+  uint64_t *values = (uint64_t *)total;
+  uint64_t *baseline = (uint64_t *)&stats_baseline;
+  for (uint32_t i = 0; i < offsetof(Stats, next) / sizeof(uint64_t); i++) {
+    values[i] -= baseline[i];
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
 
-Pager *pager_open(const char *filename) {
-  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+void stats_reset() {
+  Stats total;
+  stats_collect(&total);
+  pthread_mutex_lock(&stats_lock);
+  stats_add_into(&stats_baseline, &total);
+  pthread_mutex_unlock(&stats_lock);
+}
 
-  if (fd == -1) {
-    printf("Unable to open file \n");
-    exit(EXIT_FAILURE);
+uint64_t stats_latency_count(Stats *stats, StatementType type) {
+  uint64_t count = 0;
+  for (uint32_t b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+    count += stats->latency[type][b];
   }
+  return count;
+}
 
-  off_t file_length = lseek(fd, 0, SEEK_END);
-
-  Pager *pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = file_length / PAGE_SIZE;
+// An upper bound on the given fraction of a statement type's latencies: the
+// top of the bucket the percentile falls in.
+uint64_t stats_latency_percentile(Stats *stats, StatementType type,
+                                  double fraction) {
+  uint64_t count = stats_latency_count(stats, type);
+  uint64_t rank = fraction * count;
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+    seen += stats->latency[type][b];
+    if (seen > rank) {
+      return (2ULL << b) - 1;
+    }
+  }
+  return 0;
+}
 
-  if (file_length < pager->num_pages) {
-    printf("Db file is not whole, corrupted db file");
-    exit(EXIT_FAILURE);
+void profile_page(Table *table, uint32_t level) {
+  if (table->profile != NULL) {
+    __atomic_fetch_add(&table->profile->pages_per_level[level], 1,
+                       __ATOMIC_RELAXED);
   }
+}
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+void profile_index_page(Table *table) {
+  if (table->profile != NULL) {
+    __atomic_fetch_add(&table->profile->index_pages, 1, __ATOMIC_RELAXED);
   }
+}
 
-  return pager;
+void profile_access_path(Table *table, const char *format, ...) {
+  if (table->profile != NULL) {
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(table->profile->access_path, PROFILE_ACCESS_PATH_SIZE, format,
+              arguments);
+    va_end(arguments);
+  }
 }
 
-void *get_page(Pager *pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("%d\n", page_num);
-    printf("Page out of bound\n");
-    exit(EXIT_FAILURE);
+// Describe a scan of the leaves holding ids min_id to max_id.
+void profile_scan(Table *table, uint32_t min_id, uint32_t max_id) {
+  if (min_id == max_id) {
+    profile_access_path(table, "key lookup of id %u", min_id);
+  } else if (min_id == 0 && max_id == UINT32_MAX) {
+    profile_access_path(table, "full scan");
+  } else {
+    profile_access_path(table, "key range scan of ids %u..%u", min_id, max_id);
   }
+}
 
-  if (pager->pages[page_num] == NULL) {
-    void *page = malloc(sizeof(PAGE_SIZE));
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+// Bytes serialize_row writes for row.
+uint32_t row_size(Row *row) {
+  return ROW_STRINGS_OFFSET + strlen(row->username) + strlen(row->email);
+}
 
-    // save a partial page if at end of file
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
+// Bytes taken by the row body serialized at body.
+uint32_t serialized_row_body_size(void *body) {
+  return ROW_STRINGS_OFFSET - ROW_BODY_OFFSET +
+         *(uint8_t *)(body + USERNAME_LENGTH_OFFSET - ROW_BODY_OFFSET) +
+         *(uint8_t *)(body + EMAIL_LENGTH_OFFSET - ROW_BODY_OFFSET);
+}
 
-    if (page_num < num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      size_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+// Bytes taken by the row serialized at source.
+uint32_t serialized_row_size(void *source) {
+  return ROW_BODY_OFFSET + serialized_row_body_size(source + ROW_BODY_OFFSET);
+}
 
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
+// Write everything but the id; body is where ROW_BODY_OFFSET would be.
+void serialize_row_body(Row *source, void *body) {
+  void *destination = body - ROW_BODY_OFFSET;
+  uint8_t username_length = strlen(source->username);
+  uint8_t email_length = strlen(source->email);
+
+  *(uint8_t *)(destination + USERNAME_LENGTH_OFFSET) = username_length;
+  *(uint8_t *)(destination + EMAIL_LENGTH_OFFSET) = email_length;
+  memcpy(destination + ROW_STRINGS_OFFSET, source->username, username_length);
+  memcpy(destination + ROW_STRINGS_OFFSET + username_length, source->email,
+         email_length);
+}
 
-    pager->pages[page_num] = page;
+void serialize_row(Row *source, void *destination) {
+  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
+  serialize_row_body(source, destination + ROW_BODY_OFFSET);
+}
 
-    if (pager->num_pages < page_num) {
-      pager->num_pages = page_num + 1;
-    }
-  }
+void deserialize_row_body(void *body, Row *destination) {
+  void *source = body - ROW_BODY_OFFSET;
+  uint8_t username_length = *(uint8_t *)(source + USERNAME_LENGTH_OFFSET);
+  uint8_t email_length = *(uint8_t *)(source + EMAIL_LENGTH_OFFSET);
 
-  return pager->pages[page_num];
+  memcpy(destination->username, source + ROW_STRINGS_OFFSET, username_length);
+  destination->username[username_length] = '\0';
+  memcpy(destination->email, source + ROW_STRINGS_OFFSET + username_length,
+         email_length);
+  destination->email[email_length] = '\0';
 }
 
-void print_contants() {
-  printf("ROW SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+void deserialize_row(void *source, Row *destination) {
+  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+  deserialize_row_body(source + ROW_BODY_OFFSET, destination);
 }
 
-void print_leaf_node(void *node) {
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  printf("leaf (size %d)\n", num_cells);
-  for (uint32_t i = 0; i < num_cells; i++) {
-    uint32_t key = *leaf_node_key(node, i);
-    printf("  - %d : %d\n", i, key);
-  }
+NodeType get_node_type(void *node) {
+  uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
+  return (NodeType)value;
 }
 
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *row) {
-  void *node = get_page(cursor->table->pager, cursor->page_num);
+void set_node_type(void *node, NodeType type) {
+  uint8_t value = type;
+  *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
+}
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    for (uint32_t i = num_cells; i < cursor->cell_num; i--) {
-      memcpy(leaf_node_num_cells(node), leaf_node_num_cells(node),
-             LEAF_NODE_CELL_SIZE);
-    }
-  }
+bool is_node_root(void *node) {
+  uint8_t value = *((uint8_t *)(node + IS_ROOT_OFFSET));
+  return (bool)value;
+}
 
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(row, leaf_node_value(node, cursor->cell_num));
+void set_node_root(void *node, bool is_root) {
+  uint8_t value = is_root;
+  *((uint8_t *)(node + IS_ROOT_OFFSET)) = value;
 }
 
-Table *db_open(char *filename) {
-  Pager *pager = pager_open(filename);
-  uint32_t num_rows = pager->file_length / ROW_SIZE;
+uint32_t *node_parent(void *node) { return node + PARENT_POINTER_OFFSET; }
 
-  Table *table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
+uint8_t *node_key_width(void *node) { return node + KEY_WIDTH_OFFSET; }
 
-  if (pager->num_pages == 0) {
-    void *root_node = get_page(pager, table->root_page_num);
-    initialize_leaf_node(root_node);
-  }
+bool node_keys_compressed(void *node) { return *node_key_width(node) != 0; }
 
-  // TODO: STOPPED HERRE
-  return table;
+uint32_t key_block_num_anchors(uint32_t num_keys) {
+  return (num_keys + KEY_BLOCK_RUN_LENGTH - 1) / KEY_BLOCK_RUN_LENGTH;
 }
 
-// void *row_slot(Table *table, uint32_t row_num) {
-//   uint32_t page_num = row_num / ROWS_PER_PAGE;
-//   void *page = get_page(table->pager, page_num);
-//
-//   uint32_t row_offset = row_num % ROWS_PER_PAGE;
-//   uint32_t byte_offset = row_offset * ROW_SIZE;
-//   return page + byte_offset;
-// }
+uint32_t key_block_size(uint32_t num_keys, uint32_t width) {
+  return key_block_num_anchors(num_keys) * KEY_BLOCK_ANCHOR_SIZE +
+         num_keys * width;
+}
 
-void pager_flush(Pager *pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Error flushing db\n");
-    exit(EXIT_FAILURE);
+// Narrowest delta width that can encode the sorted keys.
+uint32_t key_block_width(uint32_t *keys, uint32_t num_keys) {
+  uint32_t max_delta = 0;
+
+  for (uint32_t i = 0; i < num_keys; i++) {
+    uint32_t delta = keys[i] - keys[i - i % KEY_BLOCK_RUN_LENGTH];
+    if (delta > max_delta) {
+      max_delta = delta;
+    }
   }
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+  if (max_delta <= UINT8_MAX) {
+    return 1;
+  } else if (max_delta <= UINT16_MAX) {
+    return 2;
+  }
+  return 4;
+}
 
-  if (offset == -1) {
-    printf("Error seeking during flush\n");
-    exit(EXIT_FAILURE);
+uint32_t key_block_delta(void *deltas, uint32_t width, uint32_t index) {
+  switch (width) {
+  case 1:
+    return *(uint8_t *)(deltas + index);
+  case 2:
+    return *(uint16_t *)(deltas + index * 2);
+  default:
+    return *(uint32_t *)(deltas + index * 4);
   }
+}
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+void key_block_encode(void *block, uint32_t *keys, uint32_t num_keys,
+                      uint32_t width) {
+  uint32_t *anchors = block;
+  void *deltas = block + key_block_num_anchors(num_keys) * KEY_BLOCK_ANCHOR_SIZE;
 
-  if (bytes_written == -1) {
-    printf("Error during db write \n");
-    exit(EXIT_FAILURE);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    uint32_t anchor = keys[i - i % KEY_BLOCK_RUN_LENGTH];
+    uint32_t delta = keys[i] - anchor;
+
+    if (i % KEY_BLOCK_RUN_LENGTH == 0) {
+      anchors[i / KEY_BLOCK_RUN_LENGTH] = anchor;
+    }
+    switch (width) {
+    case 1:
+      *(uint8_t *)(deltas + i) = delta;
+      break;
+    case 2:
+      *(uint16_t *)(deltas + i * 2) = delta;
+      break;
+    default:
+      *(uint32_t *)(deltas + i * 4) = delta;
+    }
   }
 }
 
-// void free_table(Table *table) {
-//   for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-//     free(table->pages[i]);
-//   }
-//
-//   free(table);
-// }
+uint32_t key_block_get(void *block, uint32_t num_keys, uint32_t width,
+                       uint32_t index) {
+  uint32_t *anchors = block;
+  void *deltas = block + key_block_num_anchors(num_keys) * KEY_BLOCK_ANCHOR_SIZE;
+  return anchors[index / KEY_BLOCK_RUN_LENGTH] +
+         key_block_delta(deltas, width, index);
+}
 
-void close_input_buffer(InputBuffer *input_buffer) {
-  free(input_buffer->buffer);
-  free(input_buffer);
-};
+void key_block_decode(void *block, uint32_t num_keys, uint32_t width,
+                      uint32_t *keys) {
+  for (uint32_t i = 0; i < num_keys; i++) {
+    keys[i] = key_block_get(block, num_keys, width, i);
+  }
+}
 
-void db_close(Table *table) {
-  Pager *pager = table->pager;
-  uint32_t num_full_pages = table->pager->num_pages / PAGE_SIZE;
+/*
+ * Index of the first key >= key, or num_keys if there is none. Only the
+ * anchors and the deltas of a single run are read.
+ */
+uint32_t key_block_lower_bound(void *block, uint32_t num_keys, uint32_t width,
+                               uint32_t key) {
+  uint32_t *anchors = block;
+  uint32_t num_anchors = key_block_num_anchors(num_keys);
+  void *deltas = block + num_anchors * KEY_BLOCK_ANCHOR_SIZE;
 
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
+  // The first run whose anchor is >= key. The answer is that anchor, or lies
+  // inside the run before it.
+  uint32_t min_run = 0;
+  uint32_t max_run = num_anchors;
+  while (min_run != max_run) {
+    uint32_t run = (min_run + max_run) / 2;
+    if (anchors[run] >= key) {
+      max_run = run;
+    } else {
+      min_run = run + 1;
     }
+  }
+  if (min_run == 0) {
+    return 0;
+  }
 
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+  uint32_t target = key - anchors[min_run - 1];
+  uint32_t min_index = (min_run - 1) * KEY_BLOCK_RUN_LENGTH + 1;
+  uint32_t max_index = min_run * KEY_BLOCK_RUN_LENGTH;
+  if (max_index > num_keys) {
+    max_index = num_keys;
+  }
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (key_block_delta(deltas, width, index) >= target) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
   }
+  return min_index;
+}
 
-  int result = close(pager->file_descriptor);
+uint32_t *internal_node_num_keys(void *node) {
+  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
 
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+uint32_t *internal_node_right_child(void *node) {
+  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+// The cell's child page number. With compressed keys a cell is only that.
+uint32_t *internal_node_cell(void *node, uint32_t cell_num) {
+  if (node_keys_compressed(node)) {
+    return node + INTERNAL_NODE_HEADER_SIZE +
+           cell_num * INTERNAL_NODE_CHILD_SIZE;
   }
+  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void *page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+uint32_t *internal_node_child(void *node, uint32_t child_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+
+  if (child_num > num_keys) {
+    printf("Tried to access child_num %d > num_keys %d\n", child_num,
+           num_keys);
+    exit(EXIT_FAILURE);
+  } else if (child_num == num_keys) {
+    return internal_node_right_child(node);
+  } else {
+    return internal_node_cell(node, child_num);
   }
+}
 
-  free(pager);
-  free(table);
+void *internal_node_key_block(void *node) {
+  return internal_node_cell(node, *internal_node_num_keys(node));
 }
 
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
-  if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  } else if (strcmp(input_buffer->buffer, ".help") == 0) {
-    printf("None Yet!\n");
+uint32_t internal_node_key(void *node, uint32_t key_num) {
+  if (node_keys_compressed(node)) {
+    return key_block_get(internal_node_key_block(node),
+                         *internal_node_num_keys(node), *node_key_width(node),
+                         key_num);
+  }
+  return *(uint32_t *)((void *)internal_node_cell(node, key_num) +
+                       INTERNAL_NODE_CHILD_SIZE);
+}
+
+// Copy out the children, right child last, and the keys. Returns the number
+// of keys.
+uint32_t internal_node_load(void *node, uint32_t *children, uint32_t *keys) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    children[i] = *internal_node_child(node, i);
+  }
+  if (node_keys_compressed(node)) {
+    key_block_decode(internal_node_key_block(node), num_keys,
+                     *node_key_width(node), keys);
+  } else {
+    for (uint32_t i = 0; i < num_keys; i++) {
+      keys[i] = internal_node_key(node, i);
+    }
+  }
+  return num_keys;
+}
+
+// Bytes past the header the node would use holding num_keys keys.
+uint32_t internal_node_body_size(void *node, uint32_t *keys,
+                                 uint32_t num_keys) {
+  if (!node_keys_compressed(node)) {
+    return num_keys * INTERNAL_NODE_CELL_SIZE;
+  }
+  return num_keys * INTERNAL_NODE_CHILD_SIZE +
+         key_block_size(num_keys, key_block_width(keys, num_keys));
+}
+
+bool internal_node_fits(void *node, uint32_t *keys, uint32_t num_keys) {
+  return internal_node_body_size(node, keys, num_keys) <=
+         INTERNAL_NODE_SPACE_FOR_CELLS;
+}
+
+// Rewrite the node's children and keys in its own format. The caller has
+// checked internal_node_fits.
+void internal_node_store(void *node, uint32_t *children, uint32_t *keys,
+                         uint32_t num_keys) {
+  *internal_node_num_keys(node) = num_keys;
+  for (uint32_t i = 0; i < num_keys; i++) {
+    *internal_node_cell(node, i) = children[i];
+  }
+  *internal_node_right_child(node) = children[num_keys];
+
+  if (node_keys_compressed(node)) {
+    *node_key_width(node) = key_block_width(keys, num_keys);
+    key_block_encode(internal_node_key_block(node), keys, num_keys,
+                     *node_key_width(node));
+  } else {
+    for (uint32_t i = 0; i < num_keys; i++) {
+      *(uint32_t *)((void *)internal_node_cell(node, i) +
+                    INTERNAL_NODE_CHILD_SIZE) = keys[i];
+    }
+  }
+}
+
+// Position of a child page within its parent. Splits use this rather than a
+// key search so the parent is patched at exactly the slot that was split.
+uint32_t internal_node_child_index(void *node, uint32_t child_page_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    if (*internal_node_child(node, i) == child_page_num) {
+      return i;
+    }
+  }
+
+  printf("Page %d is not a child of its parent\n", child_page_num);
+  exit(EXIT_FAILURE);
+}
+
+uint32_t *leaf_node_num_cells(void *node) {
+  return node + LEAF_NODE_NUM_CELL_OFFSET;
+}
+
+uint16_t *leaf_node_content_start(void *node) {
+  return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+uint16_t *leaf_node_fragmented_bytes(void *node) {
+  return node + LEAF_NODE_FRAGMENTED_BYTES_OFFSET;
+}
+
+uint8_t *leaf_node_layout(void *node) { return node + LEAF_NODE_LAYOUT_OFFSET; }
+
+uint32_t *leaf_node_next_leaf(void *node) {
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+bool leaf_node_is_pax(void *node) {
+  return *leaf_node_layout(node) == LEAF_LAYOUT_PAX;
+}
+
+// With compressed keys; in a PAX leaf this is also the id minipage.
+void *leaf_node_key_block(void *node) { return node + LEAF_NODE_HEADER_SIZE; }
+
+uint16_t *pax_username_ends(void *node) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t ids_size = node_keys_compressed(node)
+                          ? key_block_size(num_cells, *node_key_width(node))
+                          : num_cells * ID_SIZE;
+  return leaf_node_key_block(node) + ids_size;
+}
+
+uint16_t *pax_email_ends(void *node) {
+  return pax_username_ends(node) + *leaf_node_num_cells(node);
+}
+
+// Bytes in the data minipage of a column with the given end offsets.
+uint32_t pax_column_bytes(uint16_t *ends, uint32_t num_cells) {
+  return num_cells == 0 ? 0 : ends[num_cells - 1];
+}
+
+void *pax_usernames(void *node) {
+  return pax_email_ends(node) + *leaf_node_num_cells(node);
+}
+
+void *pax_emails(void *node) {
+  return pax_usernames(node) + pax_column_bytes(pax_username_ends(node),
+                                                *leaf_node_num_cells(node));
+}
+
+void pax_read_string(uint16_t *ends, void *data, uint32_t cell_num,
+                     char *destination) {
+  uint32_t start = cell_num == 0 ? 0 : ends[cell_num - 1];
+  uint32_t length = ends[cell_num] - start;
+  memcpy(destination, data + start, length);
+  destination[length] = '\0';
+}
+
+uint16_t *leaf_node_slot(void *node, uint32_t cell_num) {
+  uint32_t slots_offset = LEAF_NODE_HEADER_SIZE;
+  if (node_keys_compressed(node)) {
+    slots_offset +=
+        key_block_size(*leaf_node_num_cells(node), *node_key_width(node));
+  }
+  return node + slots_offset + cell_num * LEAF_NODE_SLOT_SIZE;
+}
+
+void *leaf_node_cell(void *node, uint32_t cell_num) {
+  return node + *leaf_node_slot(node, cell_num);
+}
+
+uint32_t leaf_node_key(void *node, uint32_t cell_num) {
+  if (node_keys_compressed(node)) {
+    return key_block_get(leaf_node_key_block(node), *leaf_node_num_cells(node),
+                         *node_key_width(node), cell_num);
+  } else if (leaf_node_is_pax(node)) {
+    return ((uint32_t *)leaf_node_key_block(node))[cell_num];
+  }
+  return *(uint32_t *)(leaf_node_cell(node, cell_num) + ID_OFFSET);
+}
+
+/*
+ * Read the given ColumnMask of a row. A slotted leaf decodes the whole row
+ * whatever is asked for; a PAX leaf touches only the minipages asked for.
+ */
+void leaf_node_read_columns(void *node, uint32_t cell_num, uint32_t columns,
+                            Row *row) {
+  if (leaf_node_is_pax(node)) {
+    if (columns & COLUMN_ID) {
+      row->id = leaf_node_key(node, cell_num);
+    }
+    if (columns & COLUMN_USERNAME) {
+      pax_read_string(pax_username_ends(node), pax_usernames(node), cell_num,
+                      row->username);
+    }
+    if (columns & COLUMN_EMAIL) {
+      pax_read_string(pax_email_ends(node), pax_emails(node), cell_num,
+                      row->email);
+    }
+    return;
+  }
+
+  void *cell = leaf_node_cell(node, cell_num);
+  if (node_keys_compressed(node)) {
+    deserialize_row_body(cell, row);
+    row->id = leaf_node_key(node, cell_num);
+  } else {
+    deserialize_row(cell, row);
+  }
+}
+
+void leaf_node_read_row(void *node, uint32_t cell_num, Row *row) {
+  leaf_node_read_columns(node, cell_num, COLUMN_ALL, row);
+}
+
+// Where a cell's username or email lies in the page, without copying it.
+void *leaf_node_string(void *node, uint32_t cell_num, uint32_t column,
+                       uint32_t *length) {
+  bool username = column == COLUMN_USERNAME;
+
+  if (leaf_node_is_pax(node)) {
+    uint16_t *ends = username ? pax_username_ends(node) : pax_email_ends(node);
+    uint32_t start = cell_num == 0 ? 0 : ends[cell_num - 1];
+    *length = ends[cell_num] - start;
+    return (username ? pax_usernames(node) : pax_emails(node)) + start;
+  }
+
+  // Compressed cells start at the row body; index from the row.
+  void *row = leaf_node_cell(node, cell_num) -
+              (node_keys_compressed(node) ? ROW_BODY_OFFSET : 0);
+  uint8_t username_length = *(uint8_t *)(row + USERNAME_LENGTH_OFFSET);
+  *length = username ? username_length
+                     : *(uint8_t *)(row + EMAIL_LENGTH_OFFSET);
+  return row + ROW_STRINGS_OFFSET + (username ? 0 : username_length);
+}
+
+// Bytes taken by the cell at offset: a whole row, or its body when the keys
+// are compressed.
+uint32_t leaf_node_cell_size_at(void *node, uint32_t offset) {
+  if (node_keys_compressed(node)) {
+    return serialized_row_body_size(node + offset);
+  }
+  return serialized_row_size(node + offset);
+}
+
+uint32_t leaf_node_cell_size(void *node, uint32_t cell_num) {
+  return leaf_node_cell_size_at(node, *leaf_node_slot(node, cell_num));
+}
+
+// Bytes a cell holding row would take in this node.
+uint32_t leaf_node_row_cell_size(void *node, Row *row) {
+  return row_size(row) - (node_keys_compressed(node) ? ROW_BODY_OFFSET : 0);
+}
+
+// Bytes row would take in this node, counting its slot or end offsets but
+// not a compressed key.
+uint32_t leaf_node_row_bytes(void *node, Row *row) {
+  if (leaf_node_is_pax(node)) {
+    return row_size(row) - ROW_STRINGS_OFFSET + 2 * PAX_END_OFFSET_SIZE +
+           (node_keys_compressed(node) ? 0 : ID_SIZE);
+  }
+  return leaf_node_row_cell_size(node, row) + LEAF_NODE_SLOT_SIZE;
+}
+
+// Bytes a cell takes, counted the way leaf_node_row_bytes counts a row.
+uint32_t leaf_node_cell_bytes(void *node, uint32_t cell_num) {
+  if (leaf_node_is_pax(node)) {
+    uint16_t *username_ends = pax_username_ends(node);
+    uint16_t *email_ends = pax_email_ends(node);
+    uint32_t strings = username_ends[cell_num] + email_ends[cell_num];
+    if (cell_num > 0) {
+      strings -= username_ends[cell_num - 1] + email_ends[cell_num - 1];
+    }
+    return strings + 2 * PAX_END_OFFSET_SIZE +
+           (node_keys_compressed(node) ? 0 : ID_SIZE);
+  }
+  return leaf_node_cell_size(node, cell_num) + LEAF_NODE_SLOT_SIZE;
+}
+
+// Copy out the slots, and the keys when they are compressed.
+void leaf_node_load_index(void *node, uint32_t *keys, uint16_t *slots) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  if (node_keys_compressed(node)) {
+    key_block_decode(leaf_node_key_block(node), num_cells,
+                     *node_key_width(node), keys);
+  }
+  memcpy(slots, leaf_node_slot(node, 0), num_cells * LEAF_NODE_SLOT_SIZE);
+}
+
+// Bytes from the start of the page to the end of the slot array, for
+// num_cells cells with the given keys.
+uint32_t leaf_node_index_size(void *node, uint32_t *keys, uint32_t num_cells) {
+  uint32_t size = LEAF_NODE_HEADER_SIZE + num_cells * LEAF_NODE_SLOT_SIZE;
+  if (node_keys_compressed(node)) {
+    size += key_block_size(num_cells, key_block_width(keys, num_cells));
+  }
+  return size;
+}
+
+// Rewrite the key block, when keys are compressed, and the slot array.
+void leaf_node_store_index(void *node, uint32_t *keys, uint16_t *slots,
+                           uint32_t num_cells) {
+  *leaf_node_num_cells(node) = num_cells;
+  if (node_keys_compressed(node)) {
+    *node_key_width(node) = key_block_width(keys, num_cells);
+    key_block_encode(leaf_node_key_block(node), keys, num_cells,
+                     *node_key_width(node));
+  }
+  memcpy(leaf_node_slot(node, 0), slots, num_cells * LEAF_NODE_SLOT_SIZE);
+}
+
+// Bytes free between the index and the cells, once compacted.
+uint32_t leaf_node_free_space(void *node) {
+  if (leaf_node_is_pax(node)) {
+    void *end = pax_emails(node) + pax_column_bytes(pax_email_ends(node),
+                                                    *leaf_node_num_cells(node));
+    return node + PAGE_CONTENT_SIZE - end;
+  }
+
+  uint32_t index_end =
+      (void *)leaf_node_slot(node, *leaf_node_num_cells(node)) - node;
+  return *leaf_node_content_start(node) - index_end +
+         *leaf_node_fragmented_bytes(node);
+}
+
+/*
+ * Bytes past the header the leaf would use with row added, once compacted.
+ * With compressed keys this counts the key block as re-encoded, since one
+ * more key can widen every delta.
+ */
+uint32_t leaf_node_bytes_with(void *node, Row *row) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t keys[LEAF_NODE_COMPRESSED_MAX_CELLS + 1];
+  uint32_t cell_bytes = PAGE_CONTENT_SIZE - *leaf_node_content_start(node) -
+                        *leaf_node_fragmented_bytes(node);
+
+  if (node_keys_compressed(node)) {
+    uint32_t cell_num =
+        key_block_lower_bound(leaf_node_key_block(node), num_cells,
+                              *node_key_width(node), row->id);
+    key_block_decode(leaf_node_key_block(node), num_cells,
+                     *node_key_width(node), keys);
+    memmove(keys + cell_num + 1, keys + cell_num,
+            (num_cells - cell_num) * sizeof(uint32_t));
+    keys[cell_num] = row->id;
+  }
+
+  if (leaf_node_is_pax(node)) {
+    // leaf_node_row_bytes counts a plain id; a key block is re-encoded.
+    uint32_t ids_size =
+        (void *)pax_username_ends(node) - leaf_node_key_block(node);
+    uint32_t new_ids_size =
+        node_keys_compressed(node)
+            ? key_block_size(num_cells + 1,
+                             key_block_width(keys, num_cells + 1))
+            : ids_size;
+    return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node) - ids_size +
+           new_ids_size + leaf_node_row_bytes(node, row);
+  }
+  return leaf_node_index_size(node, keys, num_cells + 1) -
+         LEAF_NODE_HEADER_SIZE + cell_bytes + leaf_node_row_cell_size(node, row);
+}
+
+bool leaf_node_has_room(void *node, Row *row) {
+  return leaf_node_bytes_with(node, row) <= LEAF_NODE_SPACE_FOR_CELLS;
+}
+
+void initialize_leaf_node(void *node, LeafLayout layout, bool compress_keys) {
+  set_node_type(node, NODE_LEAF);
+  set_node_root(node, false);
+  *node_parent(node) = 0;
+  *node_key_width(node) = compress_keys ? KEY_BLOCK_MIN_WIDTH : 0;
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_content_start(node) = PAGE_CONTENT_SIZE;
+  *leaf_node_fragmented_bytes(node) = 0;
+  *leaf_node_layout(node) = layout;
+  *leaf_node_next_leaf(node) = 0;
+}
+
+/*
+ * Repack the cells that slots point to against the end of the page, in slot
+ * order, and rewrite slots to match; zero entries are skipped. The
+ * fragmented bytes join the free gap between the index and the cells.
+ */
+void leaf_node_compact(void *node, uint16_t *slots, uint32_t num_slots) {
+  void *copy = malloc(PAGE_SIZE);
+  uint32_t content_start = PAGE_CONTENT_SIZE;
+
+  memcpy(copy, node, PAGE_SIZE);
+  for (uint32_t i = 0; i < num_slots; i++) {
+    if (slots[i] == 0) {
+      continue;
+    }
+    uint32_t cell_size = leaf_node_cell_size_at(copy, slots[i]);
+    content_start -= cell_size;
+    memcpy(node + content_start, copy + slots[i], cell_size);
+    slots[i] = content_start;
+  }
+  *leaf_node_content_start(node) = content_start;
+  *leaf_node_fragmented_bytes(node) = 0;
+  free(copy);
+}
+
+/*
+ * Make room for a cell_size-byte cell holding key at cell_num, shifting
+ * later cells right, and return where to write it. The caller has checked
+ * leaf_node_has_room.
+ */
+void *leaf_node_allocate_cell(void *node, uint32_t cell_num, uint32_t key,
+                              uint32_t cell_size) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t keys[LEAF_NODE_COMPRESSED_MAX_CELLS + 1];
+  uint16_t slots[LEAF_NODE_COMPRESSED_MAX_CELLS + 1];
+
+  leaf_node_load_index(node, keys, slots);
+  memmove(keys + cell_num + 1, keys + cell_num,
+          (num_cells - cell_num) * sizeof(uint32_t));
+  memmove(slots + cell_num + 1, slots + cell_num,
+          (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+  keys[cell_num] = key;
+  slots[cell_num] = 0;
+
+  if (*leaf_node_content_start(node) <
+      leaf_node_index_size(node, keys, num_cells + 1) + cell_size) {
+    leaf_node_compact(node, slots, num_cells + 1);
+  }
+
+  *leaf_node_content_start(node) -= cell_size;
+  slots[cell_num] = *leaf_node_content_start(node);
+  leaf_node_store_index(node, keys, slots, num_cells + 1);
+  return node + slots[cell_num];
+}
+
+/*
+ * Rewrite a PAX leaf with row inserted at cell_num, or with cell_num removed
+ * when row is NULL. Every minipage after the ids moves, so the page is
+ * rebuilt column by column from a copy.
+ */
+void pax_leaf_rebuild(void *node, uint32_t cell_num, Row *row) {
+  void *copy = malloc(PAGE_SIZE);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t new_num_cells = row ? num_cells + 1 : num_cells - 1;
+  uint32_t keys[LEAF_NODE_COMPRESSED_MAX_CELLS + 1];
+
+  memcpy(copy, node, PAGE_SIZE);
+  for (uint32_t i = 0; i < num_cells; i++) {
+    keys[i] = leaf_node_key(copy, i);
+  }
+  if (row) {
+    memmove(keys + cell_num + 1, keys + cell_num,
+            (num_cells - cell_num) * sizeof(uint32_t));
+    keys[cell_num] = row->id;
+  } else {
+    memmove(keys + cell_num, keys + cell_num + 1,
+            (num_cells - cell_num - 1) * sizeof(uint32_t));
+  }
+
+  *leaf_node_num_cells(node) = new_num_cells;
+  if (node_keys_compressed(node)) {
+    *node_key_width(node) = key_block_width(keys, new_num_cells);
+    key_block_encode(leaf_node_key_block(node), keys, new_num_cells,
+                     *node_key_width(node));
+  } else {
+    memcpy(leaf_node_key_block(node), keys, new_num_cells * ID_SIZE);
+  }
+
+  // The username minipages are written first: the emails start after them.
+  for (uint32_t column = 0; column < 2; column++) {
+    uint16_t *old_ends = column == 0 ? pax_username_ends(copy)
+                                     : pax_email_ends(copy);
+    void *old_data = column == 0 ? pax_usernames(copy) : pax_emails(copy);
+    uint16_t *ends = column == 0 ? pax_username_ends(node)
+                                 : pax_email_ends(node);
+    void *data = column == 0 ? pax_usernames(node) : pax_emails(node);
+    char *value = row == NULL      ? NULL
+                  : column == 0 ? row->username
+                                : row->email;
+
+    uint32_t start = cell_num == 0 ? 0 : old_ends[cell_num - 1];
+    uint32_t old_bytes = pax_column_bytes(old_ends, num_cells);
+    uint32_t added = value ? strlen(value) : 0;
+    uint32_t removed = value ? 0 : old_ends[cell_num] - start;
+
+    memcpy(data, old_data, start);
+    if (value) {
+      memcpy(data + start, value, added);
+    }
+    memcpy(data + start + added, old_data + start + removed,
+           old_bytes - start - removed);
+
+    for (uint32_t i = 0; i < new_num_cells; i++) {
+      if (i < cell_num) {
+        ends[i] = old_ends[i];
+      } else if (value && i == cell_num) {
+        ends[i] = start + added;
+      } else {
+        ends[i] = old_ends[value ? i - 1 : i + 1] + added - removed;
+      }
+    }
+  }
+  free(copy);
+}
+
+void leaf_node_insert_row(void *node, uint32_t cell_num, Row *row) {
+  if (leaf_node_is_pax(node)) {
+    pax_leaf_rebuild(node, cell_num, row);
+    return;
+  }
+
+  void *cell = leaf_node_allocate_cell(node, cell_num, row->id,
+                                       leaf_node_row_cell_size(node, row));
+
+  if (node_keys_compressed(node)) {
+    serialize_row_body(row, cell);
+  } else {
+    serialize_row(row, cell);
+  }
+}
+
+void leaf_node_remove_cell(void *node, uint32_t cell_num) {
+  if (leaf_node_is_pax(node)) {
+    pax_leaf_rebuild(node, cell_num, NULL);
+    return;
+  }
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t cell_size = leaf_node_cell_size(node, cell_num);
+  uint32_t keys[LEAF_NODE_COMPRESSED_MAX_CELLS + 1];
+  uint16_t slots[LEAF_NODE_COMPRESSED_MAX_CELLS + 1];
+
+  leaf_node_load_index(node, keys, slots);
+  if (slots[cell_num] == *leaf_node_content_start(node)) {
+    *leaf_node_content_start(node) += cell_size;
+  } else {
+    *leaf_node_fragmented_bytes(node) += cell_size;
+  }
+  memmove(keys + cell_num, keys + cell_num + 1,
+          (num_cells - cell_num - 1) * sizeof(uint32_t));
+  memmove(slots + cell_num, slots + cell_num + 1,
+          (num_cells - cell_num - 1) * LEAF_NODE_SLOT_SIZE);
+
+  // Dropping a key moves the run boundaries after it, which can widen the
+  // deltas and so grow the key block.
+  if (*leaf_node_content_start(node) <
+      leaf_node_index_size(node, keys, num_cells - 1)) {
+    leaf_node_compact(node, slots, num_cells - 1);
+  }
+  leaf_node_store_index(node, keys, slots, num_cells - 1);
+}
+
+/*
+ * Selection Kernels
+ *
+ * A filtered scan evaluates its predicates a leaf at a time into a bitmap
+ * with bit i set for each cell i that still matches. The id kernels compare
+ * a whole array of keys against a range, eight keys per instruction with
+ * AVX2 or four with SSE2, and fall back to a scalar loop elsewhere.
+ */
+void id_range_mask_scalar(uint32_t *keys, uint32_t start, uint32_t num_keys,
+                          uint32_t min, uint32_t max, uint64_t *mask) {
+  uint32_t span = max - min;
+  for (uint32_t i = start; i < num_keys; i++) {
+    // Keys below min wrap around to more than span.
+    if (keys[i] - min <= span) {
+      mask[i / 64] |= 1ULL << (i % 64);
+    }
+  }
+}
+
+#if defined(__x86_64__)
+void id_range_mask_sse2(uint32_t *keys, uint32_t num_keys, uint32_t min,
+                        uint32_t max, uint64_t *mask) {
+  // SSE2 only compares signed lanes, so flip the sign bits of both sides.
+  __m128i bias = _mm_set1_epi32(INT32_MIN);
+  __m128i low = _mm_set1_epi32(min);
+  __m128i span = _mm_xor_si128(_mm_set1_epi32(max - min), bias);
+  uint32_t i = 0;
+
+  for (; i + 4 <= num_keys; i += 4) {
+    __m128i offset =
+        _mm_sub_epi32(_mm_loadu_si128((__m128i *)(keys + i)), low);
+    __m128i above = _mm_cmpgt_epi32(_mm_xor_si128(offset, bias), span);
+    uint64_t bits = ~_mm_movemask_ps(_mm_castsi128_ps(above)) & 0xf;
+    mask[i / 64] |= bits << (i % 64);
+  }
+  id_range_mask_scalar(keys, i, num_keys, min, max, mask);
+}
+
+__attribute__((target("avx2"))) void
+id_range_mask_avx2(uint32_t *keys, uint32_t num_keys, uint32_t min,
+                   uint32_t max, uint64_t *mask) {
+  __m256i low = _mm256_set1_epi32(min);
+  __m256i span = _mm256_set1_epi32(max - min);
+  uint32_t i = 0;
+
+  for (; i + 8 <= num_keys; i += 8) {
+    __m256i offset =
+        _mm256_sub_epi32(_mm256_loadu_si256((__m256i *)(keys + i)), low);
+    __m256i inside =
+        _mm256_cmpeq_epi32(_mm256_min_epu32(offset, span), offset);
+    uint64_t bits = (uint8_t)_mm256_movemask_ps(_mm256_castsi256_ps(inside));
+    mask[i / 64] |= bits << (i % 64);
+  }
+  id_range_mask_scalar(keys, i, num_keys, min, max, mask);
+}
+#endif
+
+// Set bit i of mask, and no other, for each keys[i] in [min, max].
+void id_range_mask(uint32_t *keys, uint32_t num_keys, uint32_t min,
+                   uint32_t max, uint64_t *mask) {
+  memset(mask, 0, LEAF_NODE_SELECTION_WORDS * sizeof(uint64_t));
+  if (min > max) {
+    return;
+  }
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    id_range_mask_avx2(keys, num_keys, min, max, mask);
+  } else {
+    id_range_mask_sse2(keys, num_keys, min, max, mask);
+  }
+#else
+  id_range_mask_scalar(keys, 0, num_keys, min, max, mask);
+#endif
+}
+
+// The leaf's keys as an array: the id minipage of a plain PAX leaf itself,
+// or else gathered into keys.
+uint32_t *leaf_node_keys(void *node, uint32_t *keys) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  if (node_keys_compressed(node)) {
+    key_block_decode(leaf_node_key_block(node), num_cells,
+                     *node_key_width(node), keys);
+  } else if (leaf_node_is_pax(node)) {
+    return leaf_node_key_block(node);
+  } else {
+    for (uint32_t i = 0; i < num_cells; i++) {
+      keys[i] = leaf_node_key(node, i);
+    }
+  }
+  return keys;
+}
+
+bool predicate_matches_string(Predicate *predicate, void *string,
+                              uint32_t length) {
+  bool matches = predicate->type == PREDICATE_PREFIX
+                     ? length >= predicate->length
+                     : length == predicate->length;
+  return matches && memcmp(string, predicate->text, predicate->length) == 0;
+}
+
+// Clear the bit of every selected cell whose string column fails the
+// predicate. Strings are compared where they lie in the page.
+void leaf_node_select_strings(void *node, Predicate *predicate,
+                              uint64_t *selection) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  for (uint32_t word = 0; word * 64 < num_cells; word++) {
+    for (uint64_t bits = selection[word]; bits != 0; bits &= bits - 1) {
+      uint32_t cell_num = word * 64 + __builtin_ctzll(bits);
+      uint32_t length;
+      void *string =
+          leaf_node_string(node, cell_num, predicate->column, &length);
+
+      if (!predicate_matches_string(predicate, string, length)) {
+        selection[word] &= ~(1ULL << (cell_num % 64));
+      }
+    }
+  }
+}
+
+/*
+ * Evaluate the predicates over every cell of a leaf, setting bit i of
+ * selection when cell i satisfies all of them. The id predicates run first,
+ * so the string ones only look at the cells those leave.
+ */
+void leaf_node_select(void *node, Predicate *predicates,
+                      uint32_t num_predicates, uint64_t *selection) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t key_buffer[LEAF_NODE_COMPRESSED_MAX_CELLS];
+  uint32_t *keys = NULL;
+  uint64_t mask[LEAF_NODE_SELECTION_WORDS];
+  uint64_t matches[LEAF_NODE_SELECTION_WORDS];
+
+  stats_add(STAT_ROWS_SCANNED, num_cells);
+  memset(selection, 0, LEAF_NODE_SELECTION_WORDS * sizeof(uint64_t));
+  for (uint32_t i = 0; i < num_cells; i += 64) {
+    selection[i / 64] = num_cells - i >= 64 ? UINT64_MAX
+                                            : (1ULL << (num_cells - i)) - 1;
+  }
+
+  for (uint32_t p = 0; p < num_predicates; p++) {
+    Predicate *predicate = &predicates[p];
+    if (predicate->type != PREDICATE_ID_RANGE &&
+        predicate->type != PREDICATE_ID_IN) {
+      continue;
+    }
+    if (keys == NULL) {
+      keys = leaf_node_keys(node, key_buffer);
+    }
+
+    if (predicate->type == PREDICATE_ID_RANGE) {
+      id_range_mask(keys, num_cells, predicate->min_id, predicate->max_id,
+                    matches);
+    } else {
+      memset(matches, 0, sizeof(matches));
+      for (uint32_t i = 0; i < predicate->num_ids; i++) {
+        uint32_t id = predicate->ids[i];
+        // The keys are sorted, so most ids fall outside a leaf entirely.
+        if (num_cells == 0 || id < keys[0] || id > keys[num_cells - 1]) {
+          continue;
+        }
+        id_range_mask(keys, num_cells, id, id, mask);
+        for (uint32_t word = 0; word < LEAF_NODE_SELECTION_WORDS; word++) {
+          matches[word] |= mask[word];
+        }
+      }
+    }
+    for (uint32_t word = 0; word < LEAF_NODE_SELECTION_WORDS; word++) {
+      selection[word] &= matches[word];
+    }
+  }
+
+  for (uint32_t p = 0; p < num_predicates; p++) {
+    if (predicates[p].type == PREDICATE_EQUALS ||
+        predicates[p].type == PREDICATE_PREFIX) {
+      leaf_node_select_strings(node, &predicates[p], selection);
+    }
+  }
+}
+
+// The narrowest id range the predicates allow; false when it is empty.
+bool predicates_id_bounds(Predicate *predicates, uint32_t num_predicates,
+                          uint32_t *min_id, uint32_t *max_id) {
+  *min_id = 0;
+  *max_id = UINT32_MAX;
+
+  for (uint32_t p = 0; p < num_predicates; p++) {
+    Predicate *predicate = &predicates[p];
+    uint32_t min = predicate->min_id;
+    uint32_t max = predicate->max_id;
+
+    if (predicate->type == PREDICATE_ID_IN) {
+      min = UINT32_MAX;
+      max = 0;
+      for (uint32_t i = 0; i < predicate->num_ids; i++) {
+        min = predicate->ids[i] < min ? predicate->ids[i] : min;
+        max = predicate->ids[i] > max ? predicate->ids[i] : max;
+      }
+    } else if (predicate->type != PREDICATE_ID_RANGE) {
+      continue;
+    }
+    *min_id = min > *min_id ? min : *min_id;
+    *max_id = max < *max_id ? max : *max_id;
+  }
+  return *min_id <= *max_id;
+}
+
+// Whether one cell satisfies all the predicates, for rows reached through
+// an index rather than a leaf scan.
+bool leaf_node_cell_matches(void *node, uint32_t cell_num,
+                            Predicate *predicates, uint32_t num_predicates) {
+  uint32_t id = leaf_node_key(node, cell_num);
+
+  for (uint32_t p = 0; p < num_predicates; p++) {
+    Predicate *predicate = &predicates[p];
+    bool matches = false;
+    uint32_t length;
+
+    switch (predicate->type) {
+    case PREDICATE_ID_RANGE:
+      matches = id >= predicate->min_id && id <= predicate->max_id;
+      break;
+    case PREDICATE_ID_IN:
+      for (uint32_t i = 0; i < predicate->num_ids && !matches; i++) {
+        matches = predicate->ids[i] == id;
+      }
+      break;
+    case PREDICATE_EQUALS:
+    case PREDICATE_PREFIX: {
+      void *string =
+          leaf_node_string(node, cell_num, predicate->column, &length);
+      matches = predicate_matches_string(predicate, string, length);
+      break;
+    }
+    }
+    if (!matches) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Binary Result Layout
+ *
+ * With .mode binary, each row is a 4-byte length followed by that many
+ * bytes: the id as 4 bytes, then each string as a 1-byte length and its
+ * bytes, for whichever columns were selected. A row of aggregates holds
+ * each as 8 bytes, with RESULT_NO_VALUE for the min or max of no rows.
+ * Integers are in host byte order, like the db file.
+ */
+const uint32_t RESULT_ROW_LENGTH_SIZE = sizeof(uint32_t);
+const uint32_t RESULT_STRING_LENGTH_SIZE = sizeof(uint8_t);
+const uint64_t RESULT_NO_VALUE = UINT64_MAX;
+// Most bytes one escaped string character can take: JSON's \u00XX.
+const uint32_t RESULT_MAX_ESCAPE_SIZE = 6;
+
+const char *OUTPUT_FORMAT_NAMES[] = {"tuple", "csv", "tsv", "json", "binary"};
+const char *RESULT_COLUMN_NAMES[] = {"id", "username", "email"};
+const char *AGGREGATE_NAMES[] = {"count(*)", "min(id)", "max(id)", "sum(id)"};
+
+bool parse_output_format(const char *name, OutputFormat *format) {
+  for (uint32_t i = 0; i <= OUTPUT_BINARY; i++) {
+    if (strcmp(name, OUTPUT_FORMAT_NAMES[i]) == 0) {
+      *format = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+ResultWriter *result_writer_open(FILE *output, OutputFormat format) {
+  ResultWriter *writer = malloc(sizeof(ResultWriter));
+  writer->output = output;
+  writer->format = format;
+  writer->length = 0;
+  return writer;
+}
+
+void result_writer_flush(ResultWriter *writer) {
+  fwrite(writer->buffer, 1, writer->length, writer->output);
+  writer->length = 0;
+}
+
+void result_writer_close(ResultWriter *writer) {
+  result_writer_flush(writer);
+  fflush(writer->output);
+  free(writer);
+}
+
+// Make room for length more bytes, which must fit in an empty buffer.
+char *result_writer_reserve(ResultWriter *writer, uint32_t length) {
+  if (writer->length + length > RESULT_WRITER_BUFFER_SIZE) {
+    result_writer_flush(writer);
+  }
+  return writer->buffer + writer->length;
+}
+
+void result_writer_bytes(ResultWriter *writer, const void *data,
+                         uint32_t length) {
+  memcpy(result_writer_reserve(writer, length), data, length);
+  writer->length += length;
+}
+
+void result_writer_text(ResultWriter *writer, const char *text) {
+  result_writer_bytes(writer, text, strlen(text));
+}
+
+void result_writer_uint64(ResultWriter *writer, uint64_t value) {
+  char digits[20];
+  uint32_t num_digits = 0;
+
+  do {
+    digits[sizeof(digits) - ++num_digits] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  result_writer_bytes(writer, digits + sizeof(digits) - num_digits,
+                      num_digits);
+}
+
+// Write one character of a string, escaped as the format needs: CSV doubles
+// quotes, TSV and JSON use backslash escapes.
+void result_writer_escaped(ResultWriter *writer, char c) {
+  char *out = result_writer_reserve(writer, RESULT_MAX_ESCAPE_SIZE);
+  bool json = writer->format == OUTPUT_JSON;
+  char escape = 0;
+
+  if (writer->format == OUTPUT_CSV) {
+    escape = c == '"' ? '"' : 0;
+  } else {
+    switch (c) {
+    case '\\':
+      escape = '\\';
+      break;
+    case '\t':
+      escape = 't';
+      break;
+    case '\n':
+      escape = 'n';
+      break;
+    case '\r':
+      escape = 'r';
+      break;
+    case '"':
+      escape = json ? '"' : 0;
+      break;
+    }
+  }
+
+  if (escape) {
+    out[0] = writer->format == OUTPUT_CSV ? '"' : '\\';
+    out[1] = escape;
+    writer->length += 2;
+  } else if (json && (uint8_t)c < 0x20) {
+    memcpy(out, "\\u00", 4);
+    out[4] = "0123456789abcdef"[(uint8_t)c >> 4];
+    out[5] = "0123456789abcdef"[c & 0xf];
+    writer->length += 6;
+  } else {
+    out[0] = c;
+    writer->length += 1;
+  }
+}
+
+// Whether c must be escaped, or in CSV makes the field need quotes.
+bool result_writer_special(ResultWriter *writer, char c) {
+  if (writer->format == OUTPUT_CSV) {
+    return c == ',' || c == '"' || c == '\n' || c == '\r';
+  }
+  return c == '\\' || (uint8_t)c < 0x20 ||
+         (c == '"' && writer->format == OUTPUT_JSON);
+}
+
+void result_writer_string(ResultWriter *writer, const char *string,
+                          uint32_t length) {
+  uint32_t plain_length = 0;
+  if (writer->format != OUTPUT_TUPLE) {
+    while (plain_length < length &&
+           !result_writer_special(writer, string[plain_length])) {
+      plain_length++;
+    }
+  } else {
+    plain_length = length;
+  }
+  bool quoted = writer->format == OUTPUT_JSON ||
+                (writer->format == OUTPUT_CSV && plain_length < length);
+
+  if (quoted) {
+    result_writer_bytes(writer, "\"", 1);
+  }
+  // Most strings need no escaping and are copied in one go.
+  result_writer_bytes(writer, string, plain_length);
+  for (uint32_t i = plain_length; i < length; i++) {
+    result_writer_escaped(writer, string[i]);
+  }
+  if (quoted) {
+    result_writer_bytes(writer, "\"", 1);
+  }
+}
+
+void result_writer_binary_row(ResultWriter *writer, uint32_t id,
+                              const char **strings, uint32_t *lengths,
+                              uint32_t columns) {
+  uint32_t row_length = columns & COLUMN_ID ? ID_SIZE : 0;
+  for (uint32_t i = 1; i < 3; i++) {
+    if (columns & (1 << i)) {
+      row_length += RESULT_STRING_LENGTH_SIZE + lengths[i];
+    }
+  }
+
+  result_writer_bytes(writer, &row_length, RESULT_ROW_LENGTH_SIZE);
+  if (columns & COLUMN_ID) {
+    result_writer_bytes(writer, &id, ID_SIZE);
+  }
+  for (uint32_t i = 1; i < 3; i++) {
+    if (columns & (1 << i)) {
+      uint8_t length = lengths[i];
+      result_writer_bytes(writer, &length, RESULT_STRING_LENGTH_SIZE);
+      result_writer_bytes(writer, strings[i], length);
+    }
+  }
+}
+
+/*
+ * Write the given ColumnMask of a leaf cell in the writer's format. The
+ * strings are copied straight out of the page.
+ */
+void result_writer_row(ResultWriter *writer, void *node, uint32_t cell_num,
+                       uint32_t columns) {
+  stats_add(STAT_ROWS_RETURNED, 1);
+  uint32_t id = columns & COLUMN_ID ? leaf_node_key(node, cell_num) : 0;
+  const char *strings[3] = {NULL, NULL, NULL};
+  uint32_t lengths[3] = {0, 0, 0};
+  for (uint32_t i = 1; i < 3; i++) {
+    if (columns & (1 << i)) {
+      strings[i] = leaf_node_string(node, cell_num, 1 << i, &lengths[i]);
+    }
+  }
+
+  if (writer->format == OUTPUT_BINARY) {
+    result_writer_binary_row(writer, id, strings, lengths, columns);
+    return;
+  }
+
+  const char *separator = writer->format == OUTPUT_TUPLE ? ", "
+                          : writer->format == OUTPUT_TSV ? "\t"
+                                                         : ",";
+  bool first = true;
+
+  if (writer->format == OUTPUT_TUPLE) {
+    result_writer_text(writer, "(");
+  } else if (writer->format == OUTPUT_JSON) {
+    result_writer_text(writer, "{");
+  }
+  for (uint32_t i = 0; i < 3; i++) {
+    if (!(columns & (1 << i))) {
+      continue;
+    }
+    if (!first) {
+      result_writer_text(writer, separator);
+    }
+    first = false;
+    if (writer->format == OUTPUT_JSON) {
+      result_writer_text(writer, "\"");
+      result_writer_text(writer, RESULT_COLUMN_NAMES[i]);
+      result_writer_text(writer, "\":");
+    }
+    if (i == 0) {
+      result_writer_uint64(writer, id);
+    } else {
+      result_writer_string(writer, strings[i], lengths[i]);
+    }
+  }
+  if (writer->format == OUTPUT_TUPLE) {
+    result_writer_text(writer, ")\n");
+  } else if (writer->format == OUTPUT_JSON) {
+    result_writer_text(writer, "}\n");
+  } else {
+    result_writer_text(writer, "\n");
+  }
+}
+
+/*
+ * Write a row of aggregate values in the writer's format, named for JSON.
+ * RESULT_NO_VALUE, the min or max of no rows, is written as a null.
+ */
+void result_writer_aggregates(ResultWriter *writer, uint8_t *aggregates,
+                              uint64_t *values, uint32_t num_values) {
+  stats_add(STAT_ROWS_RETURNED, 1);
+  if (writer->format == OUTPUT_BINARY) {
+    uint32_t row_length = num_values * sizeof(uint64_t);
+    result_writer_bytes(writer, &row_length, RESULT_ROW_LENGTH_SIZE);
+    result_writer_bytes(writer, values, row_length);
+    return;
+  }
+
+  const char *separator = writer->format == OUTPUT_TUPLE ? ", "
+                          : writer->format == OUTPUT_TSV ? "\t"
+                                                         : ",";
+  const char *null = writer->format == OUTPUT_TUPLE  ? "NULL"
+                     : writer->format == OUTPUT_JSON ? "null"
+                                                     : "";
+
+  result_writer_text(writer, writer->format == OUTPUT_TUPLE  ? "("
+                             : writer->format == OUTPUT_JSON ? "{"
+                                                             : "");
+  for (uint32_t i = 0; i < num_values; i++) {
+    if (i > 0) {
+      result_writer_text(writer, separator);
+    }
+    if (writer->format == OUTPUT_JSON) {
+      result_writer_text(writer, "\"");
+      result_writer_text(writer, AGGREGATE_NAMES[aggregates[i]]);
+      result_writer_text(writer, "\":");
+    }
+    if (values[i] == RESULT_NO_VALUE) {
+      result_writer_text(writer, null);
+    } else {
+      result_writer_uint64(writer, values[i]);
+    }
+  }
+  result_writer_text(writer, writer->format == OUTPUT_TUPLE  ? ")\n"
+                             : writer->format == OUTPUT_JSON ? "}\n"
+                                                             : "\n");
+}
+
+void initialize_internal_node(void *node, bool compress_keys) {
+  set_node_type(node, NODE_INTERNAL);
+  set_node_root(node, false);
+  *node_parent(node) = 0;
+  *node_key_width(node) = compress_keys ? KEY_BLOCK_MIN_WIDTH : 0;
+  *internal_node_num_keys(node) = 0;
+  // An empty internal node has no right child yet; page 0 is the file
+  // header, so it can never be a valid child.
+  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+}
+
+uint64_t now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// FNV-1a, chained through seed.
+uint32_t wal_checksum(uint32_t seed, void *data, uint32_t length) {
+  uint32_t hash = seed ^ 2166136261u;
+  uint8_t *bytes = data;
+
+  for (uint32_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+uint32_t wal_record_checksum(uint32_t epoch, void *record, void *payload) {
+  uint32_t length = *(uint32_t *)(record + WAL_RECORD_LENGTH_OFFSET);
+  uint32_t checksum = wal_checksum(epoch, record, WAL_RECORD_CHECKSUM_OFFSET);
+  return wal_checksum(checksum, payload, length);
+}
+
+void wal_write_buffer(Wal *wal) {
+  if (wal->buffer_used == 0) {
+    return;
+  }
+
+  ssize_t bytes_written =
+      pwrite(wal->file_descriptor, wal->buffer, wal->buffer_used, wal->length);
+
+  if (bytes_written != wal->buffer_used) {
+    printf("Error writing WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal->length += wal->buffer_used;
+  wal->buffer_used = 0;
+}
+
+void wal_sync(Wal *wal) {
+  wal_write_buffer(wal);
+
+  if (fdatasync(wal->file_descriptor) == -1) {
+    printf("Error syncing WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal->pending_statements = 0;
+  wal->last_sync_ms = now_ms();
+}
+
+void wal_format_record(Wal *wal, void *record, WalRecordType type,
+                       void *payload, uint32_t length) {
+  *(uint32_t *)(record + WAL_RECORD_TYPE_OFFSET) = type;
+  *(uint32_t *)(record + WAL_RECORD_LENGTH_OFFSET) = length;
+  *(uint32_t *)(record + WAL_RECORD_CHECKSUM_OFFSET) =
+      wal_record_checksum(wal->epoch, record, payload);
+  if (length > 0) {
+    memcpy(record + WAL_RECORD_HEADER_SIZE, payload, length);
+  }
+}
+
+void wal_append(Wal *wal, WalRecordType type, void *payload, uint32_t length) {
+  if (wal->buffer_used + WAL_RECORD_HEADER_SIZE + length > WAL_BUFFER_SIZE) {
+    wal_write_buffer(wal);
+  }
+
+  wal_format_record(wal, wal->buffer + wal->buffer_used, type, payload,
+                    length);
+  wal->buffer_used += WAL_RECORD_HEADER_SIZE + length;
+}
+
+/*
+ * Add a record to the open transaction. Records are held back so that no
+ * part of the transaction reaches the log before it commits.
+ */
+void wal_hold_record(Wal *wal, WalRecordType type, void *payload,
+                     uint32_t length) {
+  if (wal->transaction_used + WAL_RECORD_HEADER_SIZE + length >
+      wal->transaction_capacity) {
+    wal->transaction_capacity = 2 * wal->transaction_capacity + WAL_BUFFER_SIZE;
+    wal->transaction = realloc(wal->transaction, wal->transaction_capacity);
+  }
+  wal_format_record(wal, wal->transaction + wal->transaction_used, type,
+                    payload, length);
+  wal->transaction_used += WAL_RECORD_HEADER_SIZE + length;
+}
+
+void wal_log_insert(Wal *wal, Row *row) {
+  if (wal == NULL || wal->replaying) {
+    return;
+  }
+
+  uint8_t image[sizeof(Row)];
+  uint32_t length = row_size(row);
+  serialize_row(row, image);
+  if (!wal->in_transaction) {
+    wal_append(wal, WAL_RECORD_INSERT, image, length);
+    return;
+  }
+
+  if (wal->transaction_used == 0) {
+    wal_hold_record(wal, WAL_RECORD_BEGIN, NULL, 0);
+  }
+  wal_hold_record(wal, WAL_RECORD_INSERT, image, length);
+  wal->transaction_rows++;
+}
+
+// Write out the held-back records of a transaction with a single sync.
+void wal_commit_transaction(Wal *wal) {
+  if (wal->transaction_used > 0) {
+    wal_hold_record(wal, WAL_RECORD_COMMIT, &wal->transaction_rows,
+                    sizeof(uint32_t));
+  }
+  wal_write_buffer(wal);
+
+  ssize_t bytes_written = pwrite(wal->file_descriptor, wal->transaction,
+                                 wal->transaction_used, wal->length);
+  if (bytes_written != wal->transaction_used) {
+    printf("Error writing WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal->length += wal->transaction_used;
+  wal->transaction_used = 0;
+  wal->transaction_rows = 0;
+  wal->in_transaction = false;
+  wal_sync(wal);
+}
+
+bool wal_needs_undo(Wal *wal, uint32_t page_num) {
+  return page_num < wal->checkpoint_pages &&
+         !(wal->undo_logged[page_num / 8] & (1 << (page_num % 8)));
+}
+
+/*
+ * Log the checkpoint image of page_num, read back from the db file, unless
+ * it is already in the log. The record is only buffered; callers sync the
+ * log before overwriting the page.
+ */
+void wal_log_undo(Pager *pager, uint32_t page_num) {
+  Wal *wal = pager->wal;
+
+  if (!wal_needs_undo(wal, page_num)) {
+    return;
+  }
+
+  ssize_t bytes_read = pread(pager->file_descriptor, pager->scratch, PAGE_SIZE,
+                             (off_t)page_num * PAGE_SIZE);
+
+  if (bytes_read != PAGE_SIZE) {
+    printf("Error reading page %d for the WAL: %d\n", page_num, errno);
+    exit(EXIT_FAILURE);
+  }
+
+  void *payload = malloc(sizeof(uint32_t) + PAGE_SIZE);
+  *(uint32_t *)payload = page_num;
+  memcpy(payload + sizeof(uint32_t), pager->scratch, PAGE_SIZE);
+  wal_append(wal, WAL_RECORD_UNDO, payload, sizeof(uint32_t) + PAGE_SIZE);
+  wal->undo_logged[page_num / 8] |= 1 << (page_num % 8);
+  free(payload);
+}
+
+/*
+ * Start a new epoch after a checkpoint. The header is rewritten first, so a
+ * crash before the truncate leaves old records behind that no longer
+ * validate.
+ */
+void wal_reset(Wal *wal, uint32_t checkpoint_pages) {
+  uint8_t header[WAL_HEADER_SIZE];
+
+  wal->epoch++;
+  wal->checkpoint_pages = checkpoint_pages;
+  *(uint32_t *)(header + WAL_MAGIC_OFFSET) = WAL_MAGIC;
+  *(uint32_t *)(header + WAL_EPOCH_OFFSET) = wal->epoch;
+  *(uint32_t *)(header + WAL_CHECKPOINT_PAGES_OFFSET) = checkpoint_pages;
+  *(uint32_t *)(header + WAL_HEADER_CHECKSUM_OFFSET) =
+      wal_checksum(0, header, WAL_HEADER_CHECKSUM_OFFSET);
+
+  if (pwrite(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) !=
+          WAL_HEADER_SIZE ||
+      ftruncate(wal->file_descriptor, WAL_HEADER_SIZE) == -1 ||
+      fdatasync(wal->file_descriptor) == -1) {
+    printf("Error resetting WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  wal->length = WAL_HEADER_SIZE;
+  wal->buffer_used = 0;
+  wal->pending_statements = 0;
+  wal->last_sync_ms = now_ms();
+  free(wal->undo_logged);
+  wal->undo_logged = calloc(checkpoint_pages / 8 + 1, 1);
+}
+
+/*
+ * Open the log next to the db file and recover from it. UNDO images are
+ * written straight back and the db file is truncated to its checkpoint
+ * length, which leaves it exactly as it was at the checkpoint; logged rows
+ * are kept in wal->replay for the caller to insert again. A torn record ends
+ * the log.
+ */
+Wal *wal_open(const char *db_filename, Pager *pager, DbOptions *options) {
+  char *filename = malloc(strlen(db_filename) + sizeof("-wal"));
+  sprintf(filename, "%s-wal", db_filename);
+  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  free(filename);
+
+  if (fd == -1) {
+    printf("Unable to open WAL file \n");
+    exit(EXIT_FAILURE);
+  }
+
+  Wal *wal = calloc(1, sizeof(Wal));
+  wal->file_descriptor = fd;
+  wal->buffer = malloc(WAL_BUFFER_SIZE);
+  wal->sync_statements = options->wal_sync_statements;
+  wal->sync_interval_ms = options->wal_sync_interval_ms;
+  wal->last_sync_ms = now_ms();
+
+  off_t length = lseek(fd, 0, SEEK_END);
+  void *log = malloc(length + 1);
+
+  if (pread(fd, log, length, 0) != length) {
+    printf("Error reading WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (length < WAL_HEADER_SIZE ||
+      *(uint32_t *)(log + WAL_MAGIC_OFFSET) != WAL_MAGIC ||
+      *(uint32_t *)(log + WAL_HEADER_CHECKSUM_OFFSET) !=
+          wal_checksum(0, log, WAL_HEADER_CHECKSUM_OFFSET)) {
+    // No log yet, or one torn while being reset after a checkpoint. Either
+    // way the db file is complete.
+    free(log);
+    wal_reset(wal, pager->num_pages);
+    return wal;
+  }
+
+  wal->epoch = *(uint32_t *)(log + WAL_EPOCH_OFFSET);
+  wal->checkpoint_pages = *(uint32_t *)(log + WAL_CHECKPOINT_PAGES_OFFSET);
+  wal->undo_logged = calloc(wal->checkpoint_pages / 8 + 1, 1);
+  wal->replay = malloc(length);
+
+  // Where the transaction being read began, while it has no COMMIT yet.
+  bool in_transaction = false;
+  off_t transaction_offset = 0;
+  uint32_t transaction_replay_length = 0;
+  uint32_t transaction_rows = 0;
+
+  off_t offset = WAL_HEADER_SIZE;
+  while (offset + WAL_RECORD_HEADER_SIZE <= length) {
+    void *record = log + offset;
+    void *payload = record + WAL_RECORD_HEADER_SIZE;
+    uint32_t type = *(uint32_t *)(record + WAL_RECORD_TYPE_OFFSET);
+    uint32_t record_length = *(uint32_t *)(record + WAL_RECORD_LENGTH_OFFSET);
+
+    if (record_length > length - offset - WAL_RECORD_HEADER_SIZE ||
+        *(uint32_t *)(record + WAL_RECORD_CHECKSUM_OFFSET) !=
+            wal_record_checksum(wal->epoch, record, payload)) {
+      break;
+    }
+
+    if (type == WAL_RECORD_UNDO &&
+        record_length == sizeof(uint32_t) + PAGE_SIZE) {
+      uint32_t page_num = *(uint32_t *)payload;
+      memcpy(pager->scratch, payload + sizeof(uint32_t), PAGE_SIZE);
+      if (pwrite(pager->file_descriptor, pager->scratch, PAGE_SIZE,
+                 (off_t)page_num * PAGE_SIZE) != PAGE_SIZE) {
+        printf("Error restoring page %d: %d\n", page_num, errno);
+        exit(EXIT_FAILURE);
+      }
+      wal->undo_logged[page_num / 8] |= 1 << (page_num % 8);
+    } else if (type == WAL_RECORD_INSERT && record_length >= ROW_MIN_SIZE &&
+               record_length == serialized_row_size(payload)) {
+      memcpy(wal->replay + wal->replay_length, payload, record_length);
+      wal->replay_length += record_length;
+      transaction_rows++;
+    } else if (type == WAL_RECORD_BEGIN && record_length == 0 &&
+               !in_transaction) {
+      in_transaction = true;
+      transaction_offset = offset;
+      transaction_replay_length = wal->replay_length;
+      transaction_rows = 0;
+    } else if (type == WAL_RECORD_COMMIT &&
+               record_length == sizeof(uint32_t) && in_transaction &&
+               *(uint32_t *)payload == transaction_rows) {
+      in_transaction = false;
+    } else {
+      break;
+    }
+
+    offset += WAL_RECORD_HEADER_SIZE + record_length;
+  }
+  free(log);
+
+  if (in_transaction) {
+    // The commit never made it to disk: drop the transaction whole.
+    offset = transaction_offset;
+    wal->replay_length = transaction_replay_length;
+  }
+
+  off_t checkpoint_length = (off_t)wal->checkpoint_pages * PAGE_SIZE;
+  if (ftruncate(pager->file_descriptor, checkpoint_length) == -1 ||
+      fsync(pager->file_descriptor) == -1 || ftruncate(fd, offset) == -1) {
+    printf("Error recovering from WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->file_length = checkpoint_length;
+  pager->num_pages = wal->checkpoint_pages;
+  wal->length = offset;
+
+  return wal;
+}
+
+void *wal_flusher_run(void *argument) {
+  Wal *wal = argument;
+
+  pthread_mutex_lock(wal->latch);
+  while (!wal->stopping) {
+    if (wal->pending_statements == 0) {
+      pthread_cond_wait(&wal->wake, wal->latch);
+      continue;
+    }
+    uint64_t deadline_ms = wal->last_sync_ms + wal->sync_interval_ms;
+    if (now_ms() >= deadline_ms) {
+      wal_sync(wal);
+      continue;
+    }
+    struct timespec deadline = {.tv_sec = deadline_ms / 1000,
+                                .tv_nsec = deadline_ms % 1000 * 1000000};
+    pthread_cond_timedwait(&wal->wake, wal->latch, &deadline);
+  }
+  pthread_mutex_unlock(wal->latch);
+  return NULL;
+}
+
+void wal_flusher_start(Wal *wal, pthread_mutex_t *latch) {
+  wal->latch = latch;
+  wal->stopping = false;
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&wal->wake, &attributes);
+  pthread_condattr_destroy(&attributes);
+  pthread_create(&wal->flusher, NULL, wal_flusher_run, wal);
+  wal->flusher_running = true;
+}
+
+// Stops the flusher without syncing what is still pending.
+void wal_flusher_stop(Wal *wal) {
+  if (!wal->flusher_running) {
+    return;
+  }
+  pthread_mutex_lock(wal->latch);
+  wal->stopping = true;
+  pthread_cond_signal(&wal->wake);
+  pthread_mutex_unlock(wal->latch);
+  pthread_join(wal->flusher, NULL);
+  pthread_cond_destroy(&wal->wake);
+  wal->flusher_running = false;
+}
+
+void wal_close(Wal *wal) {
+  wal_flusher_stop(wal);
+  close(wal->file_descriptor);
+  free(wal->buffer);
+  free(wal->undo_logged);
+  free(wal->replay);
+  free(wal->transaction);
+  free(wal);
+}
+
+void slab_init(FrameSlab *slab, uint32_t expected_frames) {
+  uint64_t bytes = (uint64_t)expected_frames * PAGE_SIZE;
+
+  slab->chunks = NULL;
+  slab->num_chunks = 0;
+  slab->chunk_size =
+      bytes < FRAME_SLAB_CHUNK_BYTES ? bytes : FRAME_SLAB_CHUNK_BYTES;
+  slab->tail = NULL;
+  slab->tail_frames = 0;
+  slab->free_list = NULL;
+}
+
+// Huge pages if the system has some reserved, else transparent huge pages.
+void *slab_map_chunk(size_t size) {
+  void *chunk = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if (size == FRAME_SLAB_CHUNK_BYTES) {
+    chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+
+  if (chunk == MAP_FAILED) {
+    chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) {
+      printf("Unable to allocate page frames: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+  }
+
+  return chunk;
+}
+
+void *slab_alloc(FrameSlab *slab) {
+  if (slab->free_list != NULL) {
+    void *frame = slab->free_list;
+    slab->free_list = *(void **)frame;
+    return frame;
+  }
+
+  if (slab->tail_frames == 0) {
+    slab->chunks =
+        realloc(slab->chunks, (slab->num_chunks + 1) * sizeof(void *));
+    slab->tail = slab_map_chunk(slab->chunk_size);
+    slab->chunks[slab->num_chunks++] = slab->tail;
+    slab->tail_frames = slab->chunk_size / PAGE_SIZE;
+  }
+
+  void *frame = slab->tail;
+  slab->tail += PAGE_SIZE;
+  slab->tail_frames--;
+  return frame;
+}
+
+void slab_free(FrameSlab *slab, void *frame) {
+  *(void **)frame = slab->free_list;
+  slab->free_list = frame;
+}
+
+void slab_destroy(FrameSlab *slab) {
+  for (uint32_t i = 0; i < slab->num_chunks; i++) {
+    munmap(slab->chunks[i], slab->chunk_size);
+  }
+  free(slab->chunks);
+}
+
+/*
+ * Page Checksums
+ *
+ * CRC32C, eight bytes per crc32 instruction on CPUs with SSE4.2, and a
+ * byte at a time through a lookup table elsewhere.
+ */
+const uint32_t CRC32C_POLYNOMIAL = 0x82f63b78; // reflected
+
+uint32_t crc32c_table[256];
+pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+void crc32c_build_table() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (uint32_t bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+    }
+    crc32c_table[i] = crc;
+  }
+}
+
+uint32_t crc32c_scalar(uint32_t crc, const uint8_t *bytes, uint32_t length) {
+  pthread_once(&crc32c_table_once, crc32c_build_table);
+  for (uint32_t i = 0; i < length; i++) {
+    crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *bytes, uint32_t length) {
+  uint64_t crc64 = crc;
+  uint32_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  for (; i < length; i++) {
+    crc = _mm_crc32_u8(crc, bytes[i]);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c(const void *data, uint32_t length) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    return ~crc32c_sse42(UINT32_MAX, data, length);
+  }
+#endif
+  return ~crc32c_scalar(UINT32_MAX, data, length);
+}
+
+uint32_t *page_checksum(void *page) { return page + PAGE_CHECKSUM_OFFSET; }
+
+void page_stamp_checksum(void *page) {
+  *page_checksum(page) = crc32c(page, PAGE_CONTENT_SIZE);
+}
+
+// Whether the page matches its checksum. A page that was allocated but
+// never written is all zeros, checksum included, and passes too.
+bool page_checksum_ok(void *page) {
+  if (*page_checksum(page) == crc32c(page, PAGE_CONTENT_SIZE)) {
+    return true;
+  }
+  uint64_t *words = page;
+  for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+    if (words[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Check the db file's copy of a page, reading it into buffer. Pages are
+ * written under the pager's latch, so one that fails is read again under
+ * it, in case the first read raced a write.
+ */
+bool pager_check_page(Pager *pager, uint32_t page_num, void *buffer) {
+  off_t offset = (off_t)page_num * PAGE_SIZE;
+
+  if (pread(pager->file_descriptor, buffer, PAGE_SIZE, offset) == PAGE_SIZE &&
+      page_checksum_ok(buffer)) {
+    return true;
+  }
+
+  pthread_mutex_lock(&pager->latch);
+  // A rollback may have cut the page off the file meanwhile.
+  bool ok = offset + PAGE_SIZE > pager->file_length ||
+            (pread(pager->file_descriptor, buffer, PAGE_SIZE, offset) ==
+                 PAGE_SIZE &&
+             page_checksum_ok(buffer));
+  pthread_mutex_unlock(&pager->latch);
+  return ok;
+}
+
+/*
+ * Map the file into a reserved stretch of address space. Growing the file
+ * later maps the new tail with MAP_FIXED right after the existing mapping
+ * instead of mremap'ing it, which could move pages callers still point into.
+ */
+void pager_mmap_open(Pager *pager) {
+  pager->map = mmap(NULL, MMAP_RESERVE_BYTES, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (pager->map == MAP_FAILED) {
+    printf("Unable to reserve address space for mmap: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  pager->map_length = 0;
+  if (pager->file_length > 0) {
+    void *mapped = mmap(pager->map, pager->file_length, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, pager->file_descriptor, 0);
+    if (mapped == MAP_FAILED) {
+      printf("Unable to mmap db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->map_length = pager->file_length;
+  }
+}
+
+void pager_mmap_grow(Pager *pager, off_t needed_length) {
+  off_t new_length = pager->map_length * 2;
+
+  if (new_length < needed_length) {
+    new_length = needed_length;
+  }
+  if (new_length < pager->map_length + MMAP_MIN_GROWTH_BYTES) {
+    new_length = pager->map_length + MMAP_MIN_GROWTH_BYTES;
+  }
+  if ((uint64_t)new_length > MMAP_RESERVE_BYTES) {
+    printf("Db file outgrew the mmap reservation\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (ftruncate(pager->file_descriptor, new_length) == -1) {
+    printf("Error growing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  void *mapped = mmap(pager->map + pager->map_length,
+                      new_length - pager->map_length, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, pager->file_descriptor,
+                      pager->map_length);
+  if (mapped == MAP_FAILED) {
+    printf("Unable to extend mmap: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  pager->map_length = new_length;
+  pager->file_length = new_length;
+}
+
+void *pager_mmap_page(Pager *pager, uint32_t page_num) {
+  off_t page_end = ((off_t)page_num + 1) * PAGE_SIZE;
+
+  if (page_end > pager->map_length) {
+    pager_mmap_grow(pager, page_end);
+  }
+  if (page_num >= pager->num_pages) {
+    pager->num_pages = page_num + 1;
+  }
+
+  return pager->map + (off_t)page_num * PAGE_SIZE;
+}
+
+/*
+ * Pages are changed in place in the mapping and the kernel writes them back
+ * when it likes, so the mmap pager only stamps checksums when it closes the
+ * file and verifies none while it has the file open.
+ */
+void pager_mmap_close(Pager *pager) {
+  off_t length = (off_t)pager->num_pages * PAGE_SIZE;
+
+  if (pager->num_pages > 0) {
+    *(uint32_t *)(pager->map + DB_HEADER_CHECKSUMS_STALE_OFFSET) = 0;
+  }
+  for (uint32_t i = 0; i < pager->num_pages; i++) {
+    page_stamp_checksum(pager->map + (off_t)i * PAGE_SIZE);
+  }
+  if (length > 0 && msync(pager->map, length, MS_SYNC) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  munmap(pager->map, MMAP_RESERVE_BYTES);
+
+  // Drop the slack left over from growing the file in large steps.
+  if (ftruncate(pager->file_descriptor, length) == -1) {
+    printf("Error truncating db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * A file the mmap pager left open, by crashing or being killed, has pages
+ * whose checksums predate their last change. Stamp those again before the
+ * pool reads any, and clear the header's flag once they are on disk.
+ */
+void pager_restamp_stale(Pager *pager) {
+  void *buffer = pager->scratch;
+  uint32_t num_pages = pager->file_length / PAGE_SIZE;
+
+  if (num_pages == 0 ||
+      pread(pager->file_descriptor, buffer, PAGE_SIZE, 0) != PAGE_SIZE ||
+      *(uint32_t *)(buffer + DB_HEADER_MAGIC_OFFSET) != DB_FILE_MAGIC ||
+      *(uint32_t *)(buffer + DB_HEADER_CHECKSUMS_STALE_OFFSET) == 0) {
+    return;
+  }
+
+  for (uint32_t page_num = 1; page_num < num_pages; page_num++) {
+    off_t offset = (off_t)page_num * PAGE_SIZE;
+    if (pread(pager->file_descriptor, buffer, PAGE_SIZE, offset) !=
+        PAGE_SIZE) {
+      printf("Error restamping db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    if (page_checksum_ok(buffer)) {
+      continue;
+    }
+    page_stamp_checksum(buffer);
+    if (pwrite(pager->file_descriptor, buffer, PAGE_SIZE, offset) !=
+        PAGE_SIZE) {
+      printf("Error restamping db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // The header goes last, so a crash part way through leaves it flagged.
+  if (fsync(pager->file_descriptor) == -1 ||
+      pread(pager->file_descriptor, buffer, PAGE_SIZE, 0) != PAGE_SIZE) {
+    printf("Error restamping db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  *(uint32_t *)(buffer + DB_HEADER_CHECKSUMS_STALE_OFFSET) = 0;
+  page_stamp_checksum(buffer);
+  if (pwrite(pager->file_descriptor, buffer, PAGE_SIZE, 0) != PAGE_SIZE ||
+      fsync(pager->file_descriptor) == -1) {
+    printf("Error restamping db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+Pager *pager_open(const char *filename, DbOptions *options) {
+  int flags = O_RDWR | O_CREAT;
+
+#ifdef O_DIRECT
+  // Frames are aligned and all I/O is whole pages, so the pool can bypass
+  // the kernel's page cache instead of caching everything twice.
+  if (options->direct_io && options->pager_mode == PAGER_MODE_BUFFER_POOL) {
+    flags |= O_DIRECT;
+  }
+#endif
+
+  int fd = open(filename, flags, S_IWUSR | S_IRUSR);
+
+#ifdef O_DIRECT
+  if (fd == -1 && (flags & O_DIRECT) && errno == EINVAL) {
+    printf("O_DIRECT is not supported for this file, using buffered I/O\n");
+    fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  }
+#endif
+
+  if (fd == -1) {
+    printf("Unable to open file \n");
+    exit(EXIT_FAILURE);
+  }
+
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  Pager *pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->file_length = file_length;
+  pager->num_pages = file_length / PAGE_SIZE;
+
+  if (file_length % PAGE_SIZE != 0) {
+    printf("Db file is not whole, corrupted db file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pager->mode = options->pager_mode;
+  pager->read_ahead = true;
+#ifdef O_DIRECT
+  pager->read_ahead = !(fcntl(fd, F_GETFL) & O_DIRECT);
+#endif
+  pager->wal = NULL;
+  pager->transaction = NULL;
+  pthread_mutexattr_t latch_attributes;
+  pthread_mutexattr_init(&latch_attributes);
+  pthread_mutexattr_settype(&latch_attributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&pager->latch, &latch_attributes);
+  pthread_mutexattr_destroy(&latch_attributes);
+  pager->map = NULL;
+  pager->map_length = 0;
+  if (pager->mode == PAGER_MODE_MMAP) {
+    pager_mmap_open(pager);
+  }
+
+  uint32_t cache_pages = options->cache_pages;
+  if (pager->mode == PAGER_MODE_MMAP) {
+    // The kernel page cache does the caching; no frames are needed.
+    cache_pages = 0;
+  } else if (cache_pages < POOL_MIN_PAGES) {
+    cache_pages = POOL_MIN_PAGES;
+  }
+
+  pager->num_frames = cache_pages;
+  pager->num_frames_used = 0;
+  pager->clock_hand = 0;
+  pager->frames = calloc(cache_pages, sizeof(Frame));
+  for (uint32_t i = 0; i < cache_pages; i++) {
+    pthread_rwlock_init(&pager->frames[i].latch, NULL);
+  }
+  slab_init(&pager->slab, cache_pages + 1);
+  pager->scratch = slab_alloc(&pager->slab);
+
+  // Fibonacci hashing into a power-of-two bucket array with at least one
+  // bucket per frame.
+  pager->hash_shift = 32;
+  while ((1u << (32 - pager->hash_shift)) < cache_pages) {
+    pager->hash_shift--;
+  }
+  uint32_t num_buckets = 1u << (32 - pager->hash_shift);
+  pager->buckets = malloc(num_buckets * sizeof(int32_t));
+  for (uint32_t i = 0; i < num_buckets; i++) {
+    pager->buckets[i] = -1;
+  }
+
+  if (pager->mode == PAGER_MODE_BUFFER_POOL) {
+    pager_restamp_stale(pager);
+  }
+
+  return pager;
+}
+
+uint32_t pager_bucket(Pager *pager, uint32_t page_num) {
+  if (pager->hash_shift == 32) {
+    return 0;
+  }
+  return (page_num * 2654435761u) >> pager->hash_shift;
+}
+
+// Index of the frame holding page_num, or -1 if it is not resident.
+int32_t pager_lookup(Pager *pager, uint32_t page_num) {
+  int32_t index = pager->buckets[pager_bucket(pager, page_num)];
+
+  while (index != -1 && pager->frames[index].page_num != page_num) {
+    index = pager->frames[index].next_in_bucket;
+  }
+
+  return index;
+}
+
+void pager_hash_insert(Pager *pager, int32_t frame_index) {
+  Frame *frame = &pager->frames[frame_index];
+  uint32_t bucket = pager_bucket(pager, frame->page_num);
+
+  frame->next_in_bucket = pager->buckets[bucket];
+  pager->buckets[bucket] = frame_index;
+}
+
+void pager_hash_remove(Pager *pager, int32_t frame_index) {
+  Frame *frame = &pager->frames[frame_index];
+  int32_t *link = &pager->buckets[pager_bucket(pager, frame->page_num)];
+
+  while (*link != frame_index) {
+    link = &pager->frames[*link].next_in_bucket;
+  }
+  *link = frame->next_in_bucket;
+}
+
+Frame *pager_frame(Pager *pager, uint32_t page_num) {
+  int32_t index = pager_lookup(pager, page_num);
+
+  if (index == -1) {
+    printf("Page %d is not in the buffer pool\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  return &pager->frames[index];
+}
+
+void pager_write_frame(Pager *pager, Frame *frame) {
+  if (pager->wal != NULL && wal_needs_undo(pager->wal, frame->page_num)) {
+    wal_log_undo(pager, frame->page_num);
+    wal_sync(pager->wal);
+  }
+
+  off_t offset = lseek(pager->file_descriptor,
+                       (off_t)frame->page_num * PAGE_SIZE, SEEK_SET);
+
+  if (offset == -1) {
+    printf("Error seeking during flush\n");
+    exit(EXIT_FAILURE);
+  }
+
+  page_stamp_checksum(frame->data);
+  ssize_t bytes_written =
+      write(pager->file_descriptor, frame->data, PAGE_SIZE);
+
+  if (bytes_written == -1) {
+    printf("Error during db write \n");
+    exit(EXIT_FAILURE);
+  }
+  stats_add(STAT_BYTES_WRITTEN, bytes_written);
+
+  if (offset + PAGE_SIZE > pager->file_length) {
+    pager->file_length = offset + PAGE_SIZE;
+  }
+  frame->dirty = false;
+}
+
+void pager_flush(Pager *pager, uint32_t page_num) {
+  if (pager->mode == PAGER_MODE_MMAP) {
+    page_stamp_checksum(pager_mmap_page(pager, page_num));
+    if (msync(pager->map + (off_t)page_num * PAGE_SIZE, PAGE_SIZE, MS_SYNC) ==
+        -1) {
+      printf("Error during db write \n");
+      exit(EXIT_FAILURE);
+    }
+    stats_add(STAT_BYTES_WRITTEN, PAGE_SIZE);
+    return;
+  }
+
+  pthread_mutex_lock(&pager->latch);
+  if (pager_lookup(pager, page_num) == -1) {
+    printf("Error flushing db\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pager_write_frame(pager, pager_frame(pager, page_num));
+  pthread_mutex_unlock(&pager->latch);
+}
+
+int compare_frame_page_nums(const void *a, const void *b) {
+  uint32_t left = (*(Frame **)a)->page_num;
+  uint32_t right = (*(Frame **)b)->page_num;
+  return (left > right) - (left < right);
+}
+
+// Copy the db file's image of a page the open transaction is about to
+// write out, unless it already has one or the page is new.
+void pager_save_undo(Pager *pager, uint32_t page_num) {
+  Transaction *transaction = pager->transaction;
+
+  if (page_num >= transaction->num_pages ||
+      transaction->undo_saved[page_num / 8] & (1 << (page_num % 8))) {
+    return;
+  }
+
+  memset(pager->scratch, 0, PAGE_SIZE);
+  if (pread(pager->file_descriptor, pager->scratch, PAGE_SIZE,
+            (off_t)page_num * PAGE_SIZE) == -1) {
+    printf("Error reading page %d for undo: %d\n", page_num, errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (transaction->num_undo == transaction->undo_capacity) {
+    transaction->undo_capacity = 2 * transaction->undo_capacity + 16;
+    transaction->undo_page_nums =
+        realloc(transaction->undo_page_nums,
+                transaction->undo_capacity * sizeof(uint32_t));
+    transaction->undo_images = realloc(
+        transaction->undo_images, (size_t)transaction->undo_capacity * PAGE_SIZE);
+  }
+  transaction->undo_page_nums[transaction->num_undo] = page_num;
+  memcpy(transaction->undo_images + (size_t)transaction->num_undo * PAGE_SIZE,
+         pager->scratch, PAGE_SIZE);
+  transaction->num_undo++;
+  transaction->undo_saved[page_num / 8] |= 1 << (page_num % 8);
+}
+
+/*
+ * Write back every dirty frame, or every unpinned one. Frames are sorted by
+ * page number and each run of consecutive pages goes out in a single
+ * pwritev, so a checkpoint costs one write per run rather than a seek and a
+ * write per page. Clean frames are never written.
+ */
+void pager_write_dirty(Pager *pager, bool skip_pinned) {
+  pthread_mutex_lock(&pager->latch);
+  Frame **dirty = malloc(pager->num_frames_used * sizeof(Frame *));
+  uint32_t num_dirty = 0;
+
+  for (uint32_t i = 0; i < pager->num_frames_used; i++) {
+    Frame *frame = &pager->frames[i];
+    if (frame->dirty && !(skip_pinned && frame->pin_count > 0)) {
+      if (pager->transaction != NULL) {
+        pager_save_undo(pager, frame->page_num);
+      }
+      dirty[num_dirty++] = frame;
+    }
+  }
+  qsort(dirty, num_dirty, sizeof(Frame *), compare_frame_page_nums);
+
+  // Log the checkpoint images of everything about to be overwritten with a
+  // single sync.
+  if (pager->wal != NULL) {
+    for (uint32_t i = 0; i < num_dirty; i++) {
+      wal_log_undo(pager, dirty[i]->page_num);
+    }
+    wal_sync(pager->wal);
+  }
+
+  struct iovec iov[IOV_MAX];
+  uint32_t i = 0;
+  while (i < num_dirty) {
+    uint32_t first_page_num = dirty[i]->page_num;
+    uint32_t run = 0;
+
+    while (i + run < num_dirty && run < IOV_MAX &&
+           dirty[i + run]->page_num == first_page_num + run) {
+      page_stamp_checksum(dirty[i + run]->data);
+      iov[run].iov_base = dirty[i + run]->data;
+      iov[run].iov_len = PAGE_SIZE;
+      run++;
+    }
+
+    off_t offset = (off_t)first_page_num * PAGE_SIZE;
+    ssize_t bytes_written =
+        pwritev(pager->file_descriptor, iov, run, offset);
+
+    if (bytes_written != (ssize_t)run * PAGE_SIZE) {
+      printf("Error during db write: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    stats_add(STAT_BYTES_WRITTEN, bytes_written);
+
+    for (uint32_t j = 0; j < run; j++) {
+      dirty[i + j]->dirty = false;
+    }
+    if (offset + bytes_written > pager->file_length) {
+      pager->file_length = offset + bytes_written;
+    }
+    i += run;
+  }
+
+  free(dirty);
+  pthread_mutex_unlock(&pager->latch);
+}
+
+void pager_flush_dirty(Pager *pager) { pager_write_dirty(pager, false); }
+
+/*
+ * Pick a frame for a page that is not resident. Frames that have never been
+ * used are handed out first; after that the CLOCK hand sweeps the pool,
+ * skipping pinned frames and giving recently referenced ones a second chance.
+ * A dirty victim is written back before it is reused.
+ */
+int32_t pager_find_victim(Pager *pager) {
+  if (pager->num_frames_used < pager->num_frames) {
+    int32_t index = pager->num_frames_used++;
+    pager->frames[index].data = slab_alloc(&pager->slab);
+    return index;
+  }
+
+  for (uint32_t i = 0; i < 2 * pager->num_frames; i++) {
+    int32_t index = pager->clock_hand;
+    Frame *frame = &pager->frames[index];
+    pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+    // An open transaction keeps the pages it changed.
+    if (frame->pin_count > 0 ||
+        (frame->dirty && pager->transaction != NULL)) {
+      continue;
+    }
+    if (frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
+
+    if (frame->dirty) {
+      pager_write_frame(pager, frame);
+    }
+    pager_hash_remove(pager, index);
+    return index;
+  }
+
+  // Unless they fill the pool: then they are all spilled in one go, rather
+  // than sweeping the pool again for every page that has to go.
+  if (pager->transaction != NULL) {
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_frames_used; i++) {
+      num_dirty += pager->frames[i].dirty && pager->frames[i].pin_count == 0;
+    }
+    if (num_dirty > 0) {
+      pager_write_dirty(pager, true);
+      return pager_find_victim(pager);
+    }
+  }
+
+  printf("Buffer pool exhausted: all %d pages are pinned\n",
+         pager->num_frames);
+  exit(EXIT_FAILURE);
+}
+
+// Pin the page's frame, reading the page in on a miss.
+Frame *pager_pin(Pager *pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->latch);
+  int32_t index = pager_lookup(pager, page_num);
+
+  stats_add(index == -1 ? STAT_PAGE_MISSES : STAT_PAGE_HITS, 1);
+  if (index == -1) {
+    index = pager_find_victim(pager);
+    Frame *frame = &pager->frames[index];
+    uint32_t num_pages_on_disk = pager->file_length / PAGE_SIZE;
+
+    memset(frame->data, 0, PAGE_SIZE);
+    if (page_num < num_pages_on_disk) {
+      lseek(pager->file_descriptor, (off_t)page_num * PAGE_SIZE, SEEK_SET);
+      ssize_t bytes_read = read(pager->file_descriptor, frame->data, PAGE_SIZE);
+
+      if (bytes_read == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      stats_add(STAT_BYTES_READ, bytes_read);
+      if (!page_checksum_ok(frame->data)) {
+        printf("Page %d of the db file is corrupt: its checksum does not "
+               "match.\n",
+               page_num);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    frame->page_num = page_num;
+    frame->pin_count = 0;
+    frame->dirty = false;
+    pager_hash_insert(pager, index);
+
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+  }
+
+  Frame *frame = &pager->frames[index];
+  frame->pin_count++;
+  frame->referenced = true;
+  pthread_mutex_unlock(&pager->latch);
+  return frame;
+}
+
+/*
+ * Return the page, reading it into the buffer pool on a miss. The page stays
+ * pinned, and so cannot be evicted, until the caller hands it back with
+ * pager_unpin. Callers that change the page must also pager_mark_dirty it.
+ */
+void *get_page(Pager *pager, uint32_t page_num) {
+  if (page_num == INVALID_PAGE_NUM) {
+    printf("Tried to fetch invalid page\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (pager->mode == PAGER_MODE_MMAP) {
+    return pager_mmap_page(pager, page_num);
+  }
+
+  return pager_pin(pager, page_num)->data;
+}
+
+void pager_unpin(Pager *pager, uint32_t page_num) {
+  if (pager->mode == PAGER_MODE_MMAP) {
+    return;
+  }
+
+  pthread_mutex_lock(&pager->latch);
+  Frame *frame = pager_frame(pager, page_num);
+
+  if (frame->pin_count == 0) {
+    printf("Page %d unpinned more often than pinned\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  frame->pin_count--;
+  pthread_mutex_unlock(&pager->latch);
+}
+
+/*
+ * Ask the kernel to start reading in a page that will be wanted soon, so the
+ * read that fetches it finds it cached. Resident pages and pages past the
+ * end of the file are left alone. With O_DIRECT there is no page cache to
+ * read into, so there is nothing to do.
+ */
+void pager_read_ahead(Pager *pager, uint32_t page_num) {
+  off_t offset = (off_t)page_num * PAGE_SIZE;
+
+  if (pager->mode == PAGER_MODE_MMAP) {
+    if (offset + PAGE_SIZE <= pager->map_length) {
+      madvise(pager->map + offset, PAGE_SIZE, MADV_WILLNEED);
+    }
+    return;
+  }
+  if (!pager->read_ahead) {
+    return;
+  }
+
+  pthread_mutex_lock(&pager->latch);
+  bool wanted = offset + PAGE_SIZE <= pager->file_length &&
+                pager_lookup(pager, page_num) == -1;
+  pthread_mutex_unlock(&pager->latch);
+  if (wanted) {
+    posix_fadvise(pager->file_descriptor, offset, PAGE_SIZE,
+                  POSIX_FADV_WILLNEED);
+  }
+}
+
+void pager_mark_dirty(Pager *pager, uint32_t page_num) {
+  if (pager->mode == PAGER_MODE_MMAP) {
+    return;
+  }
+
+  pthread_mutex_lock(&pager->latch);
+  pager_frame(pager, page_num)->dirty = true;
+  pthread_mutex_unlock(&pager->latch);
+}
+
+/*
+ * Pin a page and take its latch, shared to read it or exclusive to change
+ * it. Latches are taken top-down, root first, and never while holding the
+ * pager's own latch, which their holders may be waiting for. The mmap pager
+ * has no frames to latch, so it stays single-threaded.
+ */
+void *page_latch(Pager *pager, uint32_t page_num, bool exclusive) {
+  if (pager->mode == PAGER_MODE_MMAP) {
+    return get_page(pager, page_num);
+  }
+
+  Frame *frame = pager_pin(pager, page_num);
+  if (exclusive) {
+    pthread_rwlock_wrlock(&frame->latch);
+  } else {
+    pthread_rwlock_rdlock(&frame->latch);
+  }
+  return frame->data;
+}
+
+void page_unlatch(Pager *pager, uint32_t page_num) {
+  if (pager->mode == PAGER_MODE_MMAP) {
+    return;
+  }
+
+  pthread_mutex_lock(&pager->latch);
+  Frame *frame = pager_frame(pager, page_num);
+  pthread_rwlock_unlock(&frame->latch);
+  pthread_mutex_unlock(&pager->latch);
+  pager_unpin(pager, page_num);
+}
+
+void print_contants() {
+  printf("ROW MAX SIZE: %d\n", ROW_MAX_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+}
+
+void indent(uint32_t level) {
+  for (uint32_t i = 0; i < level; i++) {
+    printf("  ");
+  }
+}
+
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
+  void *node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+
+  switch (get_node_type(node)) {
+  case (NODE_LEAF):
+    num_keys = *leaf_node_num_cells(node);
+    indent(indentation_level);
+    printf("- leaf (size %d)\n", num_keys);
+    for (uint32_t i = 0; i < num_keys; i++) {
+      indent(indentation_level + 1);
+      printf("- %d\n", leaf_node_key(node, i));
+    }
+    break;
+  case (NODE_INTERNAL):
+    num_keys = *internal_node_num_keys(node);
+    indent(indentation_level);
+    printf("- internal (size %d)\n", num_keys);
+    for (uint32_t i = 0; i < num_keys; i++) {
+      child = *internal_node_child(node, i);
+      print_tree(pager, child, indentation_level + 1);
+
+      indent(indentation_level + 1);
+      printf("- key %d\n", internal_node_key(node, i));
+    }
+    child = *internal_node_right_child(node);
+    print_tree(pager, child, indentation_level + 1);
+    break;
+  case (NODE_INDEX_LEAF):
+  case (NODE_INDEX_INTERNAL):
+    // Only the table's tree is dumped; index trees hang off the header.
+    indent(indentation_level);
+    printf("- index page %d, not part of the table tree\n", page_num);
+    break;
+  }
+
+  pager_unpin(pager, page_num);
+}
+
+// Until we start recycling free pages, new pages will always go onto the end
+// of the database file.
+uint32_t get_unused_page_num(Pager *pager) { return pager->num_pages; }
+
+uint32_t get_node_max_key(Pager *pager, void *node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    return leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+  }
+
+  uint32_t right_child_page_num = *internal_node_right_child(node);
+  void *right_child = get_page(pager, right_child_page_num);
+  uint32_t max_key = get_node_max_key(pager, right_child);
+  pager_unpin(pager, right_child_page_num);
+  return max_key;
+}
+
+uint32_t get_page_max_key(Pager *pager, uint32_t page_num) {
+  uint32_t max_key = get_node_max_key(pager, get_page(pager, page_num));
+  pager_unpin(pager, page_num);
+  return max_key;
+}
+
+// Number of levels between the root and the leaves, counting both.
+uint32_t tree_depth(Table *table) {
+  uint32_t depth = 1;
+  uint32_t page_num = table->root_page_num;
+  void *node = get_page(table->pager, page_num);
+
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_page_num = *internal_node_right_child(node);
+    pager_unpin(table->pager, page_num);
+    page_num = child_page_num;
+    node = get_page(table->pager, page_num);
+    depth++;
+  }
+
+  pager_unpin(table->pager, page_num);
+  return depth;
+}
+
+// Only the writer reads parent pointers, so they are rewritten without
+// latching the child, which readers may be in.
+void set_page_parent(Pager *pager, uint32_t page_num,
+                     uint32_t parent_page_num) {
+  void *node = get_page(pager, page_num);
+  *node_parent(node) = parent_page_num;
+  pager_mark_dirty(pager, page_num);
+  pager_unpin(pager, page_num);
+}
+
+/*
+ * Handle splitting the root. The old root's contents move into a freshly
+ * allocated left child so the root keeps living at root_page_num; the right
+ * child has already been populated by the caller.
+ */
+void create_new_root(Table *table, uint32_t right_child_page_num) {
+  Pager *pager = table->pager;
+  uint32_t root_page_num = table->root_page_num;
+  void *root = get_page(pager, root_page_num);
+  uint32_t left_child_page_num = get_unused_page_num(pager);
+  void *left_child = get_page(pager, left_child_page_num);
+
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+  *node_parent(left_child) = root_page_num;
+  pager_mark_dirty(pager, left_child_page_num);
+
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    for (uint32_t i = 0; i <= *internal_node_num_keys(left_child); i++) {
+      set_page_parent(pager, *internal_node_child(left_child, i),
+                      left_child_page_num);
+    }
+  }
+
+  uint32_t children[2] = {left_child_page_num, right_child_page_num};
+  uint32_t keys[1] = {get_node_max_key(pager, left_child)};
+  initialize_internal_node(root, node_keys_compressed(left_child));
+  set_node_root(root, true);
+  internal_node_store(root, children, keys, 1);
+  pager_mark_dirty(pager, root_page_num);
+  set_page_parent(pager, right_child_page_num, root_page_num);
+
+  pager_unpin(pager, left_child_page_num);
+  pager_unpin(pager, root_page_num);
+}
+
+void internal_node_split_and_insert(Table *table, uint32_t page_num,
+                                    uint32_t left_child_page_num,
+                                    uint32_t new_child_page_num);
+
+/*
+ * Add new_child_page_num to the parent directly after left_child_page_num,
+ * which has just been split in two. The left child's key is refreshed since
+ * its maximum shrank.
+ */
+void internal_node_insert(Table *table, uint32_t parent_page_num,
+                          uint32_t left_child_page_num,
+                          uint32_t new_child_page_num) {
+  Pager *pager = table->pager;
+  void *parent = get_page(pager, parent_page_num);
+  uint32_t children[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+  uint32_t keys[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+  uint32_t num_keys = internal_node_load(parent, children, keys);
+  uint32_t index = internal_node_child_index(parent, left_child_page_num);
+
+  // If the right child was split, it gains a key and its new sibling becomes
+  // the right child.
+  for (uint32_t i = num_keys + 1; i > index + 1; i--) {
+    children[i] = children[i - 1];
+    keys[i] = keys[i - 1];
+  }
+  children[index + 1] = new_child_page_num;
+  keys[index] = get_page_max_key(pager, left_child_page_num);
+  if (index < num_keys) {
+    keys[index + 1] = get_page_max_key(pager, new_child_page_num);
+  }
+
+  if (!internal_node_fits(parent, keys, num_keys + 1)) {
+    pager_unpin(pager, parent_page_num);
+    internal_node_split_and_insert(table, parent_page_num,
+                                   left_child_page_num, new_child_page_num);
+    return;
+  }
+
+  internal_node_store(parent, children, keys, num_keys + 1);
+  pager_mark_dirty(pager, parent_page_num);
+  pager_unpin(pager, parent_page_num);
+  set_page_parent(pager, new_child_page_num, parent_page_num);
+}
+
+/*
+ * Split a full internal node. The children (including the new one) are
+ * divided in half; the upper half moves to a new sibling whose children get
+ * their parent pointers rewritten, and the sibling is then inserted into the
+ * grandparent the same way a split leaf is.
+ */
+void internal_node_split_and_insert(Table *table, uint32_t page_num,
+                                    uint32_t left_child_page_num,
+                                    uint32_t new_child_page_num) {
+  Pager *pager = table->pager;
+  void *old_node = get_page(pager, page_num);
+  uint32_t num_keys = *internal_node_num_keys(old_node);
+  uint32_t index = internal_node_child_index(old_node, left_child_page_num);
+  uint32_t total = num_keys + 2;
+  uint32_t children[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+  uint32_t keys[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+
+  for (uint32_t i = 0, j = 0; i <= num_keys; i++) {
+    children[j] = *internal_node_child(old_node, i);
+    // The right child's key is never stored; it stays the last child of
+    // whichever node ends up holding it.
+    keys[j] = i < num_keys ? internal_node_key(old_node, i) : 0;
+    j++;
+
+    if (i == index) {
+      children[j] = new_child_page_num;
+      keys[j] = get_page_max_key(pager, new_child_page_num);
+      j++;
+    }
+  }
+  keys[index] = get_page_max_key(pager, left_child_page_num);
+
+  uint32_t left_count = total / 2;
+  uint32_t parent_page_num = *node_parent(old_node);
+  bool was_root = is_node_root(old_node);
+  uint32_t sibling_page_num = get_unused_page_num(pager);
+  void *sibling = get_page(pager, sibling_page_num);
+  initialize_internal_node(sibling, node_keys_compressed(old_node));
+  *node_parent(sibling) = parent_page_num;
+
+  internal_node_store(old_node, children, keys, left_count - 1);
+  internal_node_store(sibling, children + left_count, keys + left_count,
+                      total - left_count - 1);
+
+  pager_mark_dirty(pager, page_num);
+  pager_mark_dirty(pager, sibling_page_num);
+  pager_unpin(pager, page_num);
+  pager_unpin(pager, sibling_page_num);
+
+  for (uint32_t i = 0; i < total; i++) {
+    set_page_parent(pager, children[i],
+                    i < left_count ? page_num : sibling_page_num);
+  }
+
+  if (was_root) {
+    create_new_root(table, sibling_page_num);
+  } else {
+    internal_node_insert(table, parent_page_num, page_num, sibling_page_num);
+  }
+}
+
+/*
+ * Create a new leaf and move half of the cells over, inserting the new value
+ * in whichever of the two nodes it belongs. Then update the parent, or
+ * create a new one if the split leaf was the root.
+ */
+void leaf_node_split_and_insert(Cursor *cursor, Row *value) {
+  Table *table = cursor->table;
+  Pager *pager = table->pager;
+  void *old_node = get_page(pager, cursor->page_num);
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void *new_node = get_page(pager, new_page_num);
+  initialize_leaf_node(new_node, *leaf_node_layout(old_node),
+                       node_keys_compressed(old_node));
+  *node_parent(new_node) = *node_parent(old_node);
+
+  /*
+   * All existing cells plus the new row are divided between the old (left)
+   * and new (right) nodes so that each holds about half the bytes. The old
+   * node is rebuilt in place from a copy.
+   */
+  void *copy = malloc(PAGE_SIZE);
+  memcpy(copy, old_node, PAGE_SIZE);
+  uint32_t num_cells = *leaf_node_num_cells(copy);
+  uint32_t value_bytes = leaf_node_row_bytes(copy, value);
+
+  uint32_t total_bytes = value_bytes;
+  for (uint32_t i = 0; i < num_cells; i++) {
+    total_bytes += leaf_node_cell_bytes(copy, i);
+  }
+
+  uint32_t parent_page_num = *node_parent(old_node);
+  bool was_root = is_node_root(old_node);
+  initialize_leaf_node(old_node, *leaf_node_layout(copy),
+                       node_keys_compressed(copy));
+  set_node_root(old_node, was_root);
+  *node_parent(old_node) = parent_page_num;
+  // The new leaf goes in to the right of the old one.
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(copy);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  uint32_t left_bytes = 0;
+  void *destination_node = old_node;
+  for (uint32_t i = 0; i <= num_cells; i++) {
+    uint32_t copy_index = i - (i > cursor->cell_num);
+    uint32_t cell_bytes = i == cursor->cell_num
+                              ? value_bytes
+                              : leaf_node_cell_bytes(copy, copy_index);
+
+    if (destination_node == old_node && i > 0 && i < num_cells &&
+        left_bytes + cell_bytes / 2 > total_bytes / 2) {
+      destination_node = new_node;
+    }
+    if (destination_node == old_node) {
+      left_bytes += cell_bytes;
+    }
+
+    uint32_t index_within_node = *leaf_node_num_cells(destination_node);
+    if (i == cursor->cell_num) {
+      leaf_node_insert_row(destination_node, index_within_node, value);
+    } else if (leaf_node_is_pax(copy)) {
+      Row row;
+      leaf_node_read_row(copy, copy_index, &row);
+      leaf_node_insert_row(destination_node, index_within_node, &row);
+    } else {
+      uint32_t cell_size = leaf_node_cell_size(copy, copy_index);
+      void *destination =
+          leaf_node_allocate_cell(destination_node, index_within_node,
+                                  leaf_node_key(copy, copy_index), cell_size);
+      memcpy(destination, leaf_node_cell(copy, copy_index), cell_size);
+    }
+  }
+  free(copy);
+
+  pager_mark_dirty(pager, cursor->page_num);
+  pager_mark_dirty(pager, new_page_num);
+  pager_unpin(pager, cursor->page_num);
+  pager_unpin(pager, new_page_num);
+
+  if (was_root) {
+    create_new_root(table, new_page_num);
+  } else {
+    internal_node_insert(table, parent_page_num, cursor->page_num,
+                         new_page_num);
+  }
+}
+
+void leaf_node_insert(Cursor *cursor, Row *row) {
+  Pager *pager = cursor->table->pager;
+  void *node = get_page(pager, cursor->page_num);
+
+  if (!leaf_node_has_room(node, row)) {
+    pager_unpin(pager, cursor->page_num);
+    leaf_node_split_and_insert(cursor, row);
+    return;
+  }
+
+  leaf_node_insert_row(node, cursor->cell_num, row);
+  pager_mark_dirty(pager, cursor->page_num);
+  pager_unpin(pager, cursor->page_num);
+}
+
+DbOptions default_db_options() {
+  DbOptions options;
+  options.cache_pages = DEFAULT_CACHE_PAGES;
+  options.pager_mode = PAGER_MODE_BUFFER_POOL;
+  options.direct_io = false;
+  options.wal_enabled = true;
+  options.wal_sync_statements = DEFAULT_WAL_SYNC_STATEMENTS;
+  options.wal_sync_interval_ms = DEFAULT_WAL_SYNC_INTERVAL_MS;
+  options.compress_keys = false;
+  options.leaf_layout = LEAF_LAYOUT_SLOTTED;
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  options.scan_threads = num_cpus < 1 ? 1 : num_cpus;
+  options.scrub_pages_per_second = 0;
+  return options;
+}
+
+// void *row_slot(Table *table, uint32_t row_num) {
+//   uint32_t page_num = row_num / ROWS_PER_PAGE;
+//   void *page = get_page(table->pager, page_num);
+//
+//   uint32_t row_offset = row_num % ROWS_PER_PAGE;
+//   uint32_t byte_offset = row_offset * ROW_SIZE;
+//   return page + byte_offset;
+// }
+
+// void free_table(Table *table) {
+//   for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+//     free(table->pages[i]);
+//   }
+//
+//   free(table);
+// }
+
+void close_input_buffer(InputBuffer *input_buffer) {
+  free(input_buffer->buffer);
+  free(input_buffer);
+};
+
+// Write every dirty page back and start a fresh log.
+void db_checkpoint(Table *table) {
+  Pager *pager = table->pager;
+
+  pthread_mutex_lock(&pager->latch);
+  pager_flush_dirty(pager);
+
+  if (fsync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal_reset(pager->wal, pager->file_length / PAGE_SIZE);
+  pthread_mutex_unlock(&pager->latch);
+}
+
+/*
+ * Statement boundary. Logged statements become durable in groups: the log
+ * is synced once enough statements are pending or enough time has passed
+ * since the last sync (by the flusher, if no statement follows), and
+ * checkpointed once it outgrows
+ * WAL_CHECKPOINT_BYTES.
+ */
+void db_commit(Table *table) {
+  Wal *wal = table->pager->wal;
+
+  if (wal == NULL || wal->replaying || table->pager->transaction != NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&table->pager->latch);
+  wal->pending_statements++;
+  if (wal->pending_statements >= wal->sync_statements ||
+      now_ms() - wal->last_sync_ms >= wal->sync_interval_ms) {
+    wal_sync(wal);
+  } else if (wal->pending_statements == 1) {
+    // The flusher syncs it if no further statement does in time.
+    pthread_cond_signal(&wal->wake);
+  }
+  if (wal->length + wal->buffer_used >= WAL_CHECKPOINT_BYTES) {
+    db_checkpoint(table);
+  }
+  pthread_mutex_unlock(&table->pager->latch);
+}
+
+/*
+ * Start a transaction. Every dirty page is written out first, so the db
+ * file holds the state a rollback returns to.
+ */
+ExecuteResult db_begin(Table *table) {
+  Pager *pager = table->pager;
+
+  if (pager->mode == PAGER_MODE_MMAP) {
+    return EXECUTE_TRANSACTIONS_UNSUPPORTED;
+  }
+  pthread_mutex_lock(&table->writer);
+  if (pager->transaction != NULL) {
+    pthread_mutex_unlock(&table->writer);
+    return EXECUTE_TRANSACTION_OPEN;
+  }
+
+  pthread_mutex_lock(&pager->latch);
+  pager_flush_dirty(pager);
+  Transaction *transaction = calloc(1, sizeof(Transaction));
+  transaction->num_pages = pager->num_pages;
+  transaction->file_length = pager->file_length;
+  transaction->undo_saved = calloc(pager->num_pages / 8 + 1, 1);
+  pager->transaction = transaction;
+  if (pager->wal != NULL) {
+    pager->wal->in_transaction = true;
+  }
+  pthread_mutex_unlock(&pager->latch);
+  pthread_mutex_unlock(&table->writer);
+  return EXECUTE_SUCCESS;
+}
+
+void transaction_free(Transaction *transaction) {
+  free(transaction->undo_saved);
+  free(transaction->undo_page_nums);
+  free(transaction->undo_images);
+  free(transaction);
+}
+
+/*
+ * Make the transaction durable with one sync of its log records, then write
+ * back the pages it changed in a single ordered flush.
+ */
+ExecuteResult db_commit_transaction(Table *table) {
+  Pager *pager = table->pager;
+
+  pthread_mutex_lock(&table->writer);
+  if (pager->transaction == NULL) {
+    pthread_mutex_unlock(&table->writer);
+    return EXECUTE_NO_TRANSACTION;
+  }
+
+  pthread_mutex_lock(&pager->latch);
+  Transaction *transaction = pager->transaction;
+  pager->transaction = NULL;
+  if (pager->wal != NULL) {
+    wal_commit_transaction(pager->wal);
+  }
+  pager_flush_dirty(pager);
+  transaction_free(transaction);
+  db_commit(table);
+  pthread_mutex_unlock(&pager->latch);
+  pthread_mutex_unlock(&table->writer);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * Throw the transaction away. Pages it changed are read back from the db
+ * file, or from undo if they were spilled there, and pages it added are
+ * cut off the end of the file. Readers are shut out meanwhile, as no one
+ * page latch covers the whole rewrite.
+ */
+ExecuteResult db_rollback(Table *table) {
+  Pager *pager = table->pager;
+
+  pthread_mutex_lock(&table->writer);
+  Transaction *transaction = pager->transaction;
+  if (transaction == NULL) {
+    pthread_mutex_unlock(&table->writer);
+    return EXECUTE_NO_TRANSACTION;
+  }
+
+  pthread_rwlock_wrlock(&table->tree_latch);
+  pthread_mutex_lock(&pager->latch);
+
+  for (uint32_t i = 0; i < pager->num_frames_used; i++) {
+    Frame *frame = &pager->frames[i];
+    uint32_t page_num = frame->page_num;
+
+    if (page_num >= transaction->num_pages) {
+      memset(frame->data, 0, PAGE_SIZE);
+      frame->dirty = false;
+    } else if (frame->dirty &&
+               !(transaction->undo_saved[page_num / 8] & (1 << (page_num % 8)))) {
+      memset(frame->data, 0, PAGE_SIZE);
+      if (pread(pager->file_descriptor, frame->data, PAGE_SIZE,
+                (off_t)page_num * PAGE_SIZE) == -1) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      frame->dirty = false;
+    }
+  }
+  pager->transaction = NULL;
+  for (uint32_t i = 0; i < transaction->num_undo; i++) {
+    uint32_t page_num = transaction->undo_page_nums[i];
+    void *page = get_page(pager, page_num);
+    memcpy(page, transaction->undo_images + (size_t)i * PAGE_SIZE, PAGE_SIZE);
+    pager_mark_dirty(pager, page_num);
+    pager_unpin(pager, page_num);
+  }
+
+  if (pager->file_length > transaction->file_length) {
+    if (ftruncate(pager->file_descriptor, transaction->file_length) == -1) {
+      printf("Error truncating db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = transaction->file_length;
+  }
+  pager->num_pages = transaction->num_pages;
+  if (pager->wal != NULL) {
+    pager->wal->in_transaction = false;
+    pager->wal->transaction_used = 0;
+    pager->wal->transaction_rows = 0;
+  }
+  transaction_free(transaction);
+  pthread_mutex_unlock(&pager->latch);
+  pthread_rwlock_unlock(&table->tree_latch);
+  pthread_mutex_unlock(&table->writer);
+  return EXECUTE_SUCCESS;
+}
+
+/*
+ * A background thread that reads the pages of the db file one after
+ * another, pages_per_second of them, and checks them against their
+ * checksums, so damage on disk shows up before a query reads the page. At
+ * the end of the file it starts over.
+ */
+typedef struct Scrubber {
+  Pager *pager;
+  uint32_t pages_per_second;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // signalled to stop
+  bool stopping;
+  uint64_t pages_checked;
+  uint64_t bad_pages;
+} Scrubber;
+
+void *scrubber_run(void *argument) {
+  Scrubber *scrubber = argument;
+  Pager *pager = scrubber->pager;
+  void *buffer = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+  uint64_t interval_ns = 1000000000ULL / scrubber->pages_per_second;
+  uint32_t page_num = 0;
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  pthread_mutex_lock(&scrubber->lock);
+  while (!scrubber->stopping) {
+    uint64_t nanoseconds = deadline.tv_nsec + interval_ns;
+    deadline.tv_sec += nanoseconds / 1000000000;
+    deadline.tv_nsec = nanoseconds % 1000000000;
+    if (pthread_cond_timedwait(&scrubber->wake, &scrubber->lock,
+                               &deadline) != ETIMEDOUT) {
+      continue;
+    }
+    pthread_mutex_unlock(&scrubber->lock);
+
+    pthread_mutex_lock(&pager->latch);
+    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+    pthread_mutex_unlock(&pager->latch);
+    if (page_num >= num_pages) {
+      page_num = 0;
+    }
+    bool ok = num_pages == 0 || pager_check_page(pager, page_num, buffer);
+    if (!ok) {
+      printf("Scrubber: page %d of the db file fails its checksum.\n",
+             page_num);
+    }
+
+    pthread_mutex_lock(&scrubber->lock);
+    scrubber->pages_checked += num_pages > 0;
+    scrubber->bad_pages += !ok;
+    page_num++;
+  }
+  pthread_mutex_unlock(&scrubber->lock);
+  free(buffer);
+  return NULL;
+}
+
+Scrubber *scrubber_start(Pager *pager, uint32_t pages_per_second) {
+  Scrubber *scrubber = malloc(sizeof(Scrubber));
+  scrubber->pager = pager;
+  scrubber->pages_per_second = pages_per_second;
+  scrubber->stopping = false;
+  scrubber->pages_checked = 0;
+  scrubber->bad_pages = 0;
+  pthread_mutex_init(&scrubber->lock, NULL);
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&scrubber->wake, &attributes);
+  pthread_condattr_destroy(&attributes);
+  pthread_create(&scrubber->thread, NULL, scrubber_run, scrubber);
+  return scrubber;
+}
+
+void scrubber_stop(Scrubber *scrubber) {
+  pthread_mutex_lock(&scrubber->lock);
+  scrubber->stopping = true;
+  pthread_cond_signal(&scrubber->wake);
+  pthread_mutex_unlock(&scrubber->lock);
+  pthread_join(scrubber->thread, NULL);
+  pthread_cond_destroy(&scrubber->wake);
+  pthread_mutex_destroy(&scrubber->lock);
+  free(scrubber);
+}
+
+/*
+ * Check every page of the db file against its checksum, listing the bad
+ * ones. Returns how many there were.
+ */
+uint32_t db_check(Table *table) {
+  Pager *pager = table->pager;
+  void *buffer = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+  uint32_t num_bad = 0;
+
+  pthread_mutex_lock(&pager->latch);
+  uint32_t num_pages = pager->file_length / PAGE_SIZE;
+  pthread_mutex_unlock(&pager->latch);
+  for (uint32_t i = 0; i < num_pages; i++) {
+    if (!pager_check_page(pager, i, buffer)) {
+      printf("Page %d fails its checksum.\n", i);
+      num_bad++;
+    }
+  }
+  printf("Checked %d pages, %d bad.\n", num_pages, num_bad);
+
+  if (table->scrubber != NULL) {
+    pthread_mutex_lock(&table->scrubber->lock);
+    printf("The scrubber has checked %lu pages, %lu bad.\n",
+           (unsigned long)table->scrubber->pages_checked,
+           (unsigned long)table->scrubber->bad_pages);
+    pthread_mutex_unlock(&table->scrubber->lock);
+  }
+  free(buffer);
+  return num_bad;
+}
+
+// Pages of the db file held in memory: frames in use for the buffer pool,
+// and pages of the mapping the kernel has resident for mmap.
+uint32_t pager_num_resident(Pager *pager) {
+  if (pager->mode == PAGER_MODE_BUFFER_POOL) {
+    pthread_mutex_lock(&pager->latch);
+    uint32_t num_resident = pager->num_frames_used;
+    pthread_mutex_unlock(&pager->latch);
+    return num_resident;
+  }
+
+  uint32_t num_pages = pager->map_length / PAGE_SIZE;
+  uint32_t system_pages_per_page = PAGE_SIZE / sysconf(_SC_PAGESIZE);
+  uint8_t *resident = malloc(num_pages * system_pages_per_page + 1);
+  uint32_t num_resident = 0;
+  if (mincore(pager->map, pager->map_length, resident) == 0) {
+    for (uint32_t i = 0; i < num_pages; i++) {
+      num_resident += resident[i * system_pages_per_page] & 1;
+    }
+  }
+  free(resident);
+  return num_resident;
+}
+
+/*
+ * Print the statistics since the last reset, as text or as one JSON object.
+ * Latency percentiles are the tops of histogram buckets, so they are upper
+ * bounds within a factor of two.
+ */
+void stats_print(Table *table, bool json) {
+  Stats stats;
+  stats_collect(&stats);
+  uint32_t num_resident = pager_num_resident(table->pager);
+
+  printf(json ? "{" : "");
+  for (uint32_t i = 0; i < STAT_COUNT; i++) {
+    printf(json ? "\"%s\": %lu, " : "%s: %lu\n", STAT_NAMES[i],
+           (unsigned long)stats.counters[i]);
+  }
+  printf(json ? "\"pages_resident\": %d, \"latency_ns\": {"
+              : "pages_resident: %d\n",
+         num_resident);
+
+  bool first = true;
+  for (uint32_t type = 0; type < STATEMENT_TYPE_COUNT; type++) {
+    uint64_t count = stats_latency_count(&stats, type);
+    if (count == 0) {
+      continue;
+    }
+    unsigned long mean = stats.latency_ns[type] / count;
+    unsigned long p50 = stats_latency_percentile(&stats, type, 0.5);
+    unsigned long p99 = stats_latency_percentile(&stats, type, 0.99);
+    unsigned long p999 = stats_latency_percentile(&stats, type, 0.999);
+    if (json) {
+      printf("%s\"%s\": {\"count\": %lu, \"mean\": %lu, \"p50\": %lu, "
+             "\"p99\": %lu, \"p999\": %lu}",
+             first ? "" : ", ", STATEMENT_TYPE_NAMES[type],
+             (unsigned long)count, mean, p50, p99, p999);
+    } else {
+      printf("%s: %lu statements, mean %lu ns, p50 < %lu ns, p99 < %lu ns, "
+             "p999 < %lu ns\n",
+             STATEMENT_TYPE_NAMES[type], (unsigned long)count, mean, p50 + 1,
+             p99 + 1, p999 + 1);
+    }
+    first = false;
+  }
+  printf(json ? "}}\n" : "");
+}
+
+void scan_pool_close(struct ScanPool *pool);
+
+void db_close(Table *table) {
+  Pager *pager = table->pager;
+
+  if (table->scrubber != NULL) {
+    scrubber_stop(table->scrubber);
+  }
+  if (table->scan_pool != NULL) {
+    scan_pool_close(table->scan_pool);
+  }
+
+  if (pager->transaction != NULL) {
+    db_rollback(table);
+  }
+
+  if (pager->mode == PAGER_MODE_MMAP) {
+    pager_mmap_close(pager);
+  }
+  if (pager->wal != NULL) {
+    db_checkpoint(table);
+    wal_close(pager->wal);
+  } else {
+    pager_flush_dirty(pager);
+  }
+
+  for (uint32_t i = 0; i < pager->num_frames_used; i++) {
+    if (pager->frames[i].pin_count > 0) {
+      printf("Page %d is still pinned at close\n", pager->frames[i].page_num);
+    }
+  }
+
+  int result = close(pager->file_descriptor);
+
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    pthread_rwlock_destroy(&pager->frames[i].latch);
+  }
+  pthread_mutex_destroy(&pager->latch);
+  pthread_mutex_destroy(&table->writer);
+  pthread_rwlock_destroy(&table->tree_latch);
+  slab_destroy(&pager->slab);
+  free(pager->frames);
+  free(pager->buckets);
+  free(pager);
+  free(table);
+}
+
+InputBuffer *new_input_buffer() {
+  InputBuffer *input_buffer = malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+
+  return input_buffer;
+};
+
+const char *KEYWORD_NAMES[] = {"insert", "select", "where",    "and",
+                               "in",     "like",   "id",       "username",
+                               "email",  "create", "index",    "on",
+                               "begin",  "commit", "rollback", "between",
+                               "count",  "min",    "max",      "sum"};
+const char *SYMBOL_NAMES[] = {",", "(", ")", "*", "=", "<", "<=", ">", ">="};
+
+// Recognise the symbol at the start of text, if there is one.
+bool match_symbol(const char *text, Token *token) {
+  token->length = 1;
+  switch (text[0]) {
+  case ',':
+    token->kind = SYMBOL_COMMA;
+    return true;
+  case '(':
+    token->kind = SYMBOL_LEFT_PAREN;
+    return true;
+  case ')':
+    token->kind = SYMBOL_RIGHT_PAREN;
+    return true;
+  case '*':
+    token->kind = SYMBOL_STAR;
+    return true;
+  case '=':
+    token->kind = SYMBOL_EQUALS;
+    return true;
+  case '<':
+  case '>':
+    token->length = text[1] == '=' ? 2 : 1;
+    token->kind = text[0] == '<'
+                      ? (text[1] == '=' ? SYMBOL_LESS_EQUAL : SYMBOL_LESS)
+                      : (text[1] == '=' ? SYMBOL_GREATER_EQUAL : SYMBOL_GREATER);
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*
+ * Split text into tokens in one pass. Symbols need no surrounding spaces;
+ * any other run of non-space characters is a keyword, a number or a string.
+ * Returns the number of tokens before the closing TOKEN_END, or -1 if there
+ * are too many.
+ */
+int32_t tokenize(const char *text, Token *tokens, uint32_t max_tokens) {
+  uint32_t num_tokens = 0;
+  const char *position = text;
+  Token scratch;
+
+  while (true) {
+    while (*position == ' ' || *position == '\t') {
+      position++;
+    }
+    if (num_tokens == max_tokens) {
+      return -1;
+    }
+    Token *token = &tokens[num_tokens];
+    token->start = position;
+    token->value = 0;
+    if (*position == '\0') {
+      token->type = TOKEN_END;
+      token->length = 0;
+      return num_tokens;
+    }
+    num_tokens++;
+
+    if (match_symbol(position, token)) {
+      token->type = TOKEN_SYMBOL;
+      position += token->length;
+      continue;
+    }
+
+    // A word runs to the next space or symbol. Digits are accumulated on the
+    // way; 64 bits cannot overflow before the value passes UINT32_MAX.
+    uint64_t value = 0;
+    bool number = true;
+    const char *end = position;
+    while (*end != '\0' && *end != ' ' && *end != '\t' &&
+           !match_symbol(end, &scratch)) {
+      number = number && *end >= '0' && *end <= '9' && value <= UINT32_MAX;
+      if (number) {
+        value = value * 10 + (*end - '0');
+      }
+      end++;
+    }
+    token->length = end - position;
+    position = end;
+
+    if (number && value <= UINT32_MAX) {
+      token->type = TOKEN_NUMBER;
+      token->value = value;
+      continue;
+    }
+    token->type = TOKEN_STRING;
+    for (uint32_t i = 0; i <= KEYWORD_SUM; i++) {
+      if (token->start[0] == KEYWORD_NAMES[i][0] &&
+          strncmp(token->start, KEYWORD_NAMES[i], token->length) == 0 &&
+          KEYWORD_NAMES[i][token->length] == '\0') {
+        token->type = TOKEN_KEYWORD;
+        token->kind = i;
+        break;
+      }
+    }
+  }
+}
+
+/*
+ * The cache key of a statement: its tokens with every number replaced by
+ * '#' and every string by '?'. Statements with the same key compile to the
+ * same program. Returns false if the key does not fit.
+ */
+bool statement_cache_key(Token *tokens, char *key) {
+  uint32_t length = 0;
+
+  for (Token *token = tokens; token->type != TOKEN_END; token++) {
+    const char *text = token->type == TOKEN_NUMBER   ? "#"
+                       : token->type == TOKEN_STRING ? "?"
+                       : token->type == TOKEN_SYMBOL
+                           ? SYMBOL_NAMES[token->kind]
+                           : KEYWORD_NAMES[token->kind];
+    uint32_t text_length = strlen(text);
+    if (length + text_length + 2 > STATEMENT_CACHE_KEY_SIZE) {
+      return false;
+    }
+    memcpy(key + length, text, text_length);
+    length += text_length;
+    key[length++] = ' ';
+  }
+  key[length] = '\0';
+  return true;
+}
+
+StatementCacheEntry *statement_cache_entry(StatementCache *cache,
+                                           const char *key) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (const char *c = key; *c != '\0'; c++) {
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+  }
+  return &cache->entries[hash % STATEMENT_CACHE_ENTRIES];
+}
+
+typedef struct {
+  Token *tokens;
+  uint32_t position;
+  Program *program;
+} Parser;
+
+Token *parser_peek(Parser *parser) { return &parser->tokens[parser->position]; }
+
+// Consume the next token if it is the given keyword or symbol.
+bool parser_accept(Parser *parser, TokenType type, uint32_t kind) {
+  Token *token = parser_peek(parser);
+  if (token->type != type || token->kind != kind) {
+    return false;
+  }
+  parser->position++;
+  return true;
+}
+
+// Consume a token of the given type, returning its index, or -1.
+int32_t parser_expect(Parser *parser, TokenType type) {
+  if (parser_peek(parser)->type != type) {
+    return -1;
+  }
+  return parser->position++;
+}
+
+// A string literal; a number or keyword is taken as a string here.
+int32_t parser_expect_string(Parser *parser) {
+  TokenType type = parser_peek(parser)->type;
+  if (type != TOKEN_STRING && type != TOKEN_NUMBER && type != TOKEN_KEYWORD) {
+    return -1;
+  }
+  return parser->position++;
+}
+
+bool program_emit(Instruction *code, uint32_t *num_instructions,
+                  Opcode opcode, uint32_t arg, uint32_t operand) {
+  if (*num_instructions == PROGRAM_MAX_INSTRUCTIONS) {
+    return false;
+  }
+  code[(*num_instructions)++] = (Instruction){opcode, arg, operand};
+  return true;
+}
+
+bool program_bind_op(Program *program, Opcode opcode, uint32_t arg,
+                     int32_t token) {
+  return token >= 0 &&
+         program_emit(program->bind, &program->num_bind, opcode, arg, token);
+}
+
+// insert ID USERNAME EMAIL
+PrepareResult parse_insert(Parser *parser) {
+  Program *program = parser->program;
+  program->type = STATEMENT_INSERT;
+
+  Token *id = parser_peek(parser);
+  if (id->type == TOKEN_STRING && id->start[0] == '-' && id->length > 1 &&
+      id->start[1] >= '0' && id->start[1] <= '9') {
+    return PREPARE_NEGATIVE_ID;
+  }
+  if (!program_bind_op(program, OP_BIND_ROW_ID, 0,
+                       parser_expect(parser, TOKEN_NUMBER)) ||
+      !program_bind_op(program, OP_BIND_ROW_USERNAME, 0,
+                       parser_expect_string(parser)) ||
+      !program_bind_op(program, OP_BIND_ROW_EMAIL, 0,
+                       parser_expect_string(parser))) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  program_emit(program->code, &program->num_code, OP_INSERT, 0, 0);
+  program_emit(program->code, &program->num_code, OP_HALT, 0, 0);
+  return PREPARE_SUCCESS;
+}
+
+// column := "*" | id | username | email
+bool parse_column(Parser *parser, uint32_t *columns) {
+  if (parser_accept(parser, TOKEN_SYMBOL, SYMBOL_STAR)) {
+    *columns |= COLUMN_ALL;
+  } else if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_ID)) {
+    *columns |= COLUMN_ID;
+  } else if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_USERNAME)) {
+    *columns |= COLUMN_USERNAME;
+  } else if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_EMAIL)) {
+    *columns |= COLUMN_EMAIL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// aggregate := count "(" ("*" | id) ")" | (min | max | sum) "(" id ")"
+bool parse_aggregate(Parser *parser) {
+  Program *program = parser->program;
+  Token *token = parser_peek(parser);
+  if (token->type != TOKEN_KEYWORD || token->kind < KEYWORD_COUNT ||
+      program->num_aggregates == STATEMENT_MAX_AGGREGATES) {
+    return false;
+  }
+  parser->position++;
+
+  Aggregate aggregate = AGGREGATE_COUNT + (token->kind - KEYWORD_COUNT);
+  if (!parser_accept(parser, TOKEN_SYMBOL, SYMBOL_LEFT_PAREN) ||
+      !(parser_accept(parser, TOKEN_KEYWORD, KEYWORD_ID) ||
+        (aggregate == AGGREGATE_COUNT &&
+         parser_accept(parser, TOKEN_SYMBOL, SYMBOL_STAR))) ||
+      !parser_accept(parser, TOKEN_SYMBOL, SYMBOL_RIGHT_PAREN)) {
+    return false;
+  }
+  program->aggregates[program->num_aggregates++] = aggregate;
+  return true;
+}
+
+/*
+ * predicate := id (= | < | <= | > | >=) NUMBER
+ *            | id between NUMBER and NUMBER
+ *            | id in "(" NUMBER ("," NUMBER)* ")"
+ *            | (username | email) (= | like) STRING
+ */
+bool parse_predicate(Parser *parser, uint32_t *num_predicates) {
+  Program *program = parser->program;
+  if ((*num_predicates)++ == STATEMENT_MAX_PREDICATES) {
+    return false;
+  }
+
+  if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_ID)) {
+    if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_IN)) {
+      uint32_t num_ids = 0;
+      if (!parser_accept(parser, TOKEN_SYMBOL, SYMBOL_LEFT_PAREN) ||
+          !program_bind_op(program, OP_BIND_ID_IN, 0, 0)) {
+        return false;
+      }
+      do {
+        if (num_ids++ == PREDICATE_MAX_IDS ||
+            !program_bind_op(program, OP_BIND_IN_ID, 0,
+                             parser_expect(parser, TOKEN_NUMBER))) {
+          return false;
+        }
+      } while (parser_accept(parser, TOKEN_SYMBOL, SYMBOL_COMMA));
+      return parser_accept(parser, TOKEN_SYMBOL, SYMBOL_RIGHT_PAREN);
+    }
+
+    // Both ends are inclusive, so this is id >= low and id <= high.
+    if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_BETWEEN)) {
+      return (*num_predicates)++ < STATEMENT_MAX_PREDICATES &&
+             program_bind_op(program, OP_BIND_ID_COMPARE,
+                             SYMBOL_GREATER_EQUAL,
+                             parser_expect(parser, TOKEN_NUMBER)) &&
+             parser_accept(parser, TOKEN_KEYWORD, KEYWORD_AND) &&
+             program_bind_op(program, OP_BIND_ID_COMPARE, SYMBOL_LESS_EQUAL,
+                             parser_expect(parser, TOKEN_NUMBER));
+    }
+
+    Token *comparison = parser_peek(parser);
+    if (comparison->type != TOKEN_SYMBOL ||
+        comparison->kind < SYMBOL_EQUALS) {
+      return false;
+    }
+    parser->position++;
+    return program_bind_op(program, OP_BIND_ID_COMPARE, comparison->kind,
+                           parser_expect(parser, TOKEN_NUMBER));
+  }
+
+  uint32_t column;
+  if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_USERNAME)) {
+    column = COLUMN_USERNAME;
+  } else if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_EMAIL)) {
+    column = COLUMN_EMAIL;
+  } else {
+    return false;
+  }
+  if (parser_accept(parser, TOKEN_SYMBOL, SYMBOL_EQUALS)) {
+    return program_bind_op(program, OP_BIND_EQUALS, column,
+                           parser_expect_string(parser));
+  } else if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_LIKE)) {
+    return program_bind_op(program, OP_BIND_LIKE, column,
+                           parser_expect_string(parser));
+  }
+  return false;
+}
+
+// Emit the code of a select: an index lookup when one applies, else a scan
+// that filters and prints a leaf at a time. Whether an index applies is
+// decided as the program runs, so cached programs survive a create index.
+void program_emit_scan(Program *program) {
+  Instruction *code = program->code;
+  uint32_t *num_code = &program->num_code;
+  uint32_t start = *num_code;
+
+  program_emit(code, num_code, OP_OPEN_INDEX, 0, start + 3);
+  program_emit(code, num_code, OP_EMIT_INDEXED, 0, 0);
+  program_emit(code, num_code, OP_HALT, 0, 0);
+  program_emit(code, num_code, OP_PARALLEL_SCAN, 0, start + 9);
+  program_emit(code, num_code, OP_OPEN_SCAN, 0, start + 9);
+  program_emit(code, num_code, OP_FILTER_LEAF, 0, 0);
+  program_emit(code, num_code, OP_EMIT_SELECTED, 0, 0);
+  program_emit(code, num_code, OP_NEXT_LEAF, 0, start + 5);
+  program_emit(code, num_code, OP_CLOSE_SCAN, 0, 0);
+  program_emit(code, num_code, OP_HALT, 0, 0);
+}
+
+/*
+ * select [column (","? column)* | aggregate ("," aggregate)*]
+ *        [where predicate (and predicate)*]
+ */
+PrepareResult parse_select(Parser *parser) {
+  Program *program = parser->program;
+  program->type = STATMENT_SELECT;
+  program->columns = 0;
+  program->num_aggregates = 0;
+
+  if (parse_aggregate(parser)) {
+    while (parser_accept(parser, TOKEN_SYMBOL, SYMBOL_COMMA)) {
+      if (!parse_aggregate(parser)) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+    }
+  } else if (parse_column(parser, &program->columns)) {
+    parser_accept(parser, TOKEN_SYMBOL, SYMBOL_COMMA);
+    while (parse_column(parser, &program->columns)) {
+      parser_accept(parser, TOKEN_SYMBOL, SYMBOL_COMMA);
+    }
+  }
+  if (program->columns == 0) {
+    program->columns = COLUMN_ALL;
+  }
+
+  if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_WHERE)) {
+    uint32_t num_predicates = 0;
+    do {
+      if (!parse_predicate(parser, &num_predicates)) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+    } while (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_AND));
+  }
+
+  if (program->num_aggregates > 0) {
+    program_emit(program->code, &program->num_code, OP_AGGREGATE, 0, 0);
+    program_emit(program->code, &program->num_code, OP_HALT, 0, 0);
+  } else {
+    program_emit_scan(program);
+  }
+  return PREPARE_SUCCESS;
+}
+
+// create index on (username | email)
+PrepareResult parse_create_index(Parser *parser) {
+  Program *program = parser->program;
+  program->type = STATEMENT_CREATE_INDEX;
+  uint32_t column;
+
+  if (!parser_accept(parser, TOKEN_KEYWORD, KEYWORD_INDEX) ||
+      !parser_accept(parser, TOKEN_KEYWORD, KEYWORD_ON)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_USERNAME)) {
+    column = COLUMN_USERNAME;
+  } else if (parser_accept(parser, TOKEN_KEYWORD, KEYWORD_EMAIL)) {
+    column = COLUMN_EMAIL;
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  program_emit(program->code, &program->num_code, OP_CREATE_INDEX, column, 0);
+  program_emit(program->code, &program->num_code, OP_HALT, 0, 0);
+  return PREPARE_SUCCESS;
+}
+
+// begin | commit | rollback
+PrepareResult parse_transaction(Parser *parser, Opcode opcode) {
+  Program *program = parser->program;
+  program->type = STATEMENT_TRANSACTION;
+  program_emit(program->code, &program->num_code, opcode, 0, 0);
+  program_emit(program->code, &program->num_code, OP_HALT, 0, 0);
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult parse_statement(Token *tokens, Program *program) {
+  Parser parser = {tokens, 0, program};
+  PrepareResult result;
+
+  program->num_bind = 0;
+  program->num_code = 0;
+  if (parser_accept(&parser, TOKEN_KEYWORD, KEYWORD_INSERT)) {
+    result = parse_insert(&parser);
+  } else if (parser_accept(&parser, TOKEN_KEYWORD, KEYWORD_SELECT)) {
+    result = parse_select(&parser);
+  } else if (parser_accept(&parser, TOKEN_KEYWORD, KEYWORD_CREATE)) {
+    result = parse_create_index(&parser);
+  } else if (parser_accept(&parser, TOKEN_KEYWORD, KEYWORD_BEGIN)) {
+    result = parse_transaction(&parser, OP_BEGIN);
+  } else if (parser_accept(&parser, TOKEN_KEYWORD, KEYWORD_COMMIT)) {
+    result = parse_transaction(&parser, OP_COMMIT);
+  } else if (parser_accept(&parser, TOKEN_KEYWORD, KEYWORD_ROLLBACK)) {
+    result = parse_transaction(&parser, OP_ROLLBACK);
+  } else {
+    return PREPARE_UNRECOGNISED_STATEMENT;
+  }
+
+  if (result == PREPARE_SUCCESS && parser_peek(&parser)->type != TOKEN_END) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return result;
+}
+
+/*
+ * Run a program's bind operations, filling in the statement's row or
+ * predicates from its tokens. This is all the work a cached statement needs
+ * before it can execute.
+ */
+PrepareResult program_bind(Program *program, Statement *statement) {
+  statement->type = program->type;
+  statement->columns = program->columns;
+  statement->num_predicates = 0;
+  Predicate *predicate = NULL;
+
+  for (uint32_t i = 0; i < program->num_bind; i++) {
+    Instruction *instruction = &program->bind[i];
+    Token *token = &statement->tokens[instruction->operand];
+    uint32_t value = token->value;
+
+    switch (instruction->opcode) {
+    case OP_BIND_ROW_ID:
+      statement->row_to_insert.id = value;
+      continue;
+    case OP_BIND_ROW_USERNAME:
+    case OP_BIND_ROW_EMAIL: {
+      bool username = instruction->opcode == OP_BIND_ROW_USERNAME;
+      char *field = username ? statement->row_to_insert.username
+                             : statement->row_to_insert.email;
+      if (token->length >
+          (username ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE)) {
+        return PREPARE_STRING_TOO_LONG;
+      }
+      memcpy(field, token->start, token->length);
+      field[token->length] = '\0';
+      continue;
+    }
+    case OP_BIND_IN_ID:
+      predicate->ids[predicate->num_ids++] = value;
+      continue;
+    default:
+      break;
+    }
+
+    predicate = &statement->predicates[statement->num_predicates++];
+    switch (instruction->opcode) {
+    case OP_BIND_ID_COMPARE:
+      // An empty range is left as min_id > max_id.
+      predicate->type = PREDICATE_ID_RANGE;
+      predicate->min_id = 0;
+      predicate->max_id = UINT32_MAX;
+      switch (instruction->arg) {
+      case SYMBOL_EQUALS:
+        predicate->min_id = value;
+        predicate->max_id = value;
+        break;
+      case SYMBOL_LESS:
+        predicate->min_id = value == 0 ? 1 : 0;
+        predicate->max_id = value == 0 ? 0 : value - 1;
+        break;
+      case SYMBOL_LESS_EQUAL:
+        predicate->max_id = value;
+        break;
+      case SYMBOL_GREATER:
+        predicate->min_id = value == UINT32_MAX ? 1 : value + 1;
+        predicate->max_id = value == UINT32_MAX ? 0 : UINT32_MAX;
+        break;
+      case SYMBOL_GREATER_EQUAL:
+        predicate->min_id = value;
+        break;
+      }
+      break;
+    case OP_BIND_ID_IN:
+      predicate->type = PREDICATE_ID_IN;
+      predicate->num_ids = 0;
+      break;
+    default: {
+      // "like" only takes a trailing %; without one it is plain equality.
+      uint32_t length = token->length;
+      predicate->type = PREDICATE_EQUALS;
+      if (instruction->opcode == OP_BIND_LIKE &&
+          token->start[length - 1] == '%') {
+        predicate->type = PREDICATE_PREFIX;
+        length--;
+      }
+      if (length > (instruction->arg == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE
+                                                        : COLUMN_EMAIL_SIZE)) {
+        return PREPARE_STRING_TOO_LONG;
+      }
+      predicate->column = instruction->arg;
+      predicate->length = length;
+      memcpy(predicate->text, token->start, length);
+      predicate->text[length] = '\0';
+    }
+    }
+  }
+  return PREPARE_SUCCESS;
+}
+
+/*
+ * Tokenize the input, then compile it, or take its program from the cache
+ * when a statement with the same shape has been seen before, and bind the
+ * literals. cache may be NULL.
+ */
+PrepareResult prepare_statement_cached(InputBuffer *input_buffer,
+                                       Statement *statement,
+                                       StatementCache *cache) {
+  int32_t num_tokens =
+      tokenize(input_buffer->buffer, statement->tokens, STATEMENT_MAX_TOKENS);
+  if (num_tokens < 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  statement->num_tokens = num_tokens;
+
+  char key[STATEMENT_CACHE_KEY_SIZE];
+  StatementCacheEntry *entry = NULL;
+  if (cache != NULL && num_tokens > 0 &&
+      statement_cache_key(statement->tokens, key)) {
+    entry = statement_cache_entry(cache, key);
+    if (strcmp(entry->key, key) == 0) {
+      cache->hits++;
+      statement->program = entry->program;
+      return program_bind(&statement->program, statement);
+    }
+    cache->misses++;
+  }
+
+  PrepareResult result = parse_statement(statement->tokens, &statement->program);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  result = program_bind(&statement->program, statement);
+  if (result == PREPARE_SUCCESS && entry != NULL) {
+    strcpy(entry->key, key);
+    entry->program = statement->program;
+  }
+  return result;
+}
+
+PrepareResult prepare_statement(InputBuffer *input_buffer,
+                                Statement *statement) {
+  return prepare_statement_cached(input_buffer, statement, NULL);
+}
+
+void print_start_screen() {
+  printf("   ____   ____   _      \n");
+  printf("  / ___| / __ \\ | |     \n");
+  printf(" | (___ | |  | || |     \n");
+  printf("  \\___ \\| |  | || |     \n");
+  printf("  ____) | |__| || |____ \n");
+  printf(" |_____/ \\____/ |______|\n");
+  printf("             |          \n");
+  printf("             Q          \n");
+  printf("       OurSQL-BIH REPL ENGINE\n");
+  printf("       Respectfully... run your queries\n");
+  printf("       Version 0.1.0-dev\n\n");
+
+  printf("Type '.help' for options.\n");
+  printf("Type '.exit' to leave this madness.\n");
+}
+
+void print_prompt() { printf("f_yeah_db 🤞🏾> "); }
+
+void read_input(InputBuffer *input_buffer) {
+  ssize_t bytes_read =
+      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+  if (bytes_read <= 0) {
+    printf("Error reading input\n");
+    exit(EXIT_FAILURE);
+  }
+
+  input_buffer->input_length = bytes_read - 1;
+  input_buffer->buffer[bytes_read - 1] = 0;
+};
+
+uint32_t leftmost_leaf_page_num(Pager *pager, uint32_t page_num) {
+  void *node = get_page(pager, page_num);
+
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_page_num = *internal_node_child(node, 0);
+    pager_unpin(pager, page_num);
+    page_num = child_page_num;
+    node = get_page(pager, page_num);
+  }
+
+  pager_unpin(pager, page_num);
+  return page_num;
+}
+
+/*
+ * Binary search a leaf for the key. Returns the key's position, or the
+ * position where it would need to be inserted.
+ */
+uint32_t leaf_node_find(void *node, uint32_t key) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  if (node_keys_compressed(node)) {
+    return key_block_lower_bound(leaf_node_key_block(node), num_cells,
+                                 *node_key_width(node), key);
+  }
+
+  uint32_t min_index = 0;
+  uint32_t one_past_max_index = num_cells;
+  while (one_past_max_index != min_index) {
+    uint32_t index = (min_index + one_past_max_index) / 2;
+    uint32_t key_at_index = leaf_node_key(node, index);
+    if (key == key_at_index) {
+      return index;
+    }
+    if (key < key_at_index) {
+      one_past_max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+
+  return min_index;
+}
+
+/*
+ * Return the index of the child which should contain the given key: the
+ * first child whose max key is >= key, or the right child if there is none.
+ */
+uint32_t internal_node_find_child(void *node, uint32_t key) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+
+  if (node_keys_compressed(node)) {
+    return key_block_lower_bound(internal_node_key_block(node), num_keys,
+                                 *node_key_width(node), key);
+  }
+
+  uint32_t min_index = 0;
+  uint32_t max_index = num_keys; // there is one more child than key
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    uint32_t key_to_right = internal_node_key(node, index);
+    if (key_to_right >= key) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+
+  return min_index;
+}
+
+// Whether a split child could be added without splitting the node too.
+// Compressed keys are assumed to need their full width.
+bool internal_node_has_room(void *node) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+
+  if (!node_keys_compressed(node)) {
+    return num_keys < INTERNAL_NODE_MAX_KEYS;
+  }
+  return (num_keys + 1) * INTERNAL_NODE_CHILD_SIZE +
+             key_block_size(num_keys + 1, sizeof(uint32_t)) <=
+         INTERNAL_NODE_SPACE_FOR_CELLS;
+}
+
+// Let go of the pages a cursor holds latched, except the last keep of them.
+void cursor_unlatch(Cursor *cursor, uint32_t keep) {
+  uint32_t release = cursor->num_latched - keep;
+
+  for (uint32_t i = 0; i < release; i++) {
+    page_unlatch(cursor->table->pager, cursor->latched[i]);
+  }
+  memmove(cursor->latched, cursor->latched + release,
+          keep * sizeof(uint32_t));
+  cursor->num_latched = keep;
+}
+
+/*
+ * Walk from the root to the leaf that holds key, crabbing latches: the
+ * child's is taken before the parent's is let go. Readers take shared
+ * latches and hold one level at a time. The writer, inserting row, takes
+ * exclusive ones and keeps every ancestor a split could reach, up to the
+ * lowest node with room for one more child.
+ */
+void cursor_seek(Cursor *cursor, uint32_t key, Row *row) {
+  Pager *pager = cursor->table->pager;
+  bool exclusive = row != NULL;
+  uint32_t page_num = cursor->table->root_page_num;
+  void *node = page_latch(pager, page_num, exclusive);
+  cursor->latched[cursor->num_latched++] = page_num;
+  cursor->num_ahead = 0;
+  cursor->next_ahead = 0;
+  cursor->num_hinted = 0;
+  cursor->level = 0;
+  profile_page(cursor->table, 0);
+
+  while (get_node_type(node) == NODE_INTERNAL) {
+    void *parent = node;
+    uint32_t child_num = internal_node_find_child(parent, key);
+    page_num = *internal_node_child(parent, child_num);
+    node = page_latch(pager, page_num, exclusive);
+    profile_page(cursor->table, ++cursor->level);
+
+    // Note the leaves to the right, for a reader that goes on to scan.
+    if (!exclusive && get_node_type(node) == NODE_LEAF) {
+      uint32_t num_keys = *internal_node_num_keys(parent);
+      while (child_num < num_keys && cursor->num_ahead < CURSOR_MAX_AHEAD) {
+        cursor->ahead[cursor->num_ahead++] =
+            *internal_node_child(parent, ++child_num);
+      }
+    }
+
+    bool safe = !exclusive || (get_node_type(node) == NODE_LEAF
+                                   ? leaf_node_has_room(node, row)
+                                   : internal_node_has_room(node));
+    if (safe) {
+      cursor_unlatch(cursor, 0);
+    }
+    cursor->latched[cursor->num_latched++] = page_num;
+  }
+
+  cursor->page_num = page_num;
+  cursor->cell_num = leaf_node_find(node, key);
+  cursor->end_of_table = false;
+}
+
+/*
+ * A cursor keeps the leaf it points into latched, and so pinned, so
+ * pointers handed out by cursor_value stay valid until the cursor moves on
+ * or is closed. It also holds the table's tree latch shared, which keeps a
+ * rollback from rewriting pages under it.
+ */
+Cursor *table_descend(Table *table, uint32_t key, Row *row) {
+  Cursor *cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->num_latched = 0;
+
+  pthread_rwlock_rdlock(&table->tree_latch);
+  cursor_seek(cursor, key, row);
+  return cursor;
+}
+
+/*
+ * Return the position of the given key. If the key is not present, return
+ * the position where it should be inserted.
+ */
+Cursor *table_find(Table *table, uint32_t key) {
+  return table_descend(table, key, NULL);
+}
+
+// table_find for the writer: the cursor holds exclusive latches on every
+// page inserting row could change.
+Cursor *table_find_for_insert(Table *table, Row *row) {
+  return table_descend(table, row->id, row);
+}
+
+uint32_t cursor_num_cells(Cursor *cursor) {
+  void *node = get_page(cursor->table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  pager_unpin(cursor->table->pager, cursor->page_num);
+  return num_cells;
+}
+
+Cursor *table_start(Table *table) {
+  Cursor *cursor = table_find(table, 0);
+  cursor->end_of_table = cursor_num_cells(cursor) == 0;
+  return cursor;
+}
+
+Cursor *table_end(Table *table) {
+  Cursor *cursor = table_find(table, UINT32_MAX);
+  cursor->cell_num = cursor_num_cells(cursor);
+  cursor->end_of_table = true;
+  return cursor;
+}
+
+void cursor_close(Cursor *cursor) {
+  cursor_unlatch(cursor, 0);
+  pthread_rwlock_unlock(&cursor->table->tree_latch);
+  free(cursor);
+}
+
+void *cursor_value(Cursor *cursor) {
+  uint32_t page_num = cursor->page_num;
+
+  // The cursor's own pin keeps the page resident after this one is dropped.
+  void *page = get_page(cursor->table->pager, page_num);
+  pager_unpin(cursor->table->pager, page_num);
+
+  // Only plain slotted cells hold the row as serialized; other layouts
+  // keep the key or the columns apart.
+  if (node_keys_compressed(page) || leaf_node_is_pax(page)) {
+    Row row;
+    leaf_node_read_row(page, cursor->cell_num, &row);
+    serialize_row(&row, cursor->value);
+    return cursor->value;
+  }
+  return leaf_node_cell(page, cursor->cell_num);
+}
+
+// Read the given ColumnMask of the row under the cursor.
+void cursor_read_columns(Cursor *cursor, uint32_t columns, Row *row) {
+  void *page = get_page(cursor->table->pager, cursor->page_num);
+  pager_unpin(cursor->table->pager, cursor->page_num);
+  leaf_node_read_columns(page, cursor->cell_num, columns, row);
+}
+
+// Read ahead the leaves the cursor will step onto next, up to
+// READ_AHEAD_PAGES past its own.
+void cursor_read_ahead(Cursor *cursor) {
+  uint32_t end = cursor->next_ahead + READ_AHEAD_PAGES;
+
+  if (end > cursor->num_ahead) {
+    end = cursor->num_ahead;
+  }
+  for (; cursor->num_hinted < end; cursor->num_hinted++) {
+    pager_read_ahead(cursor->table->pager, cursor->ahead[cursor->num_hinted]);
+  }
+}
+
+/*
+ * Step to the first cell of the next leaf, along its sibling link. The next
+ * leaf's latch is taken before this one's is let go; latching left to right
+ * cannot deadlock with the writer, which only latches a leaf's new sibling.
+ * Once the cursor is past the leaves it noted on its last descent, it
+ * descends again instead, to note the ones under the next parent.
+ */
+void cursor_next_leaf(Cursor *cursor) {
+  Pager *pager = cursor->table->pager;
+  void *node = get_page(pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t max_key = num_cells > 0 ? leaf_node_key(node, num_cells - 1) : 0;
+  uint32_t next_page_num = *leaf_node_next_leaf(node);
+  pager_unpin(pager, cursor->page_num);
+
+  if (next_page_num == 0) {
+    cursor->end_of_table = true;
+    return;
+  }
+
+  if (cursor->next_ahead == cursor->num_ahead) {
+    cursor_unlatch(cursor, 0);
+    cursor_seek(cursor, max_key + 1, NULL);
+  } else {
+    page_latch(pager, next_page_num, false);
+    profile_page(cursor->table, cursor->level);
+    cursor_unlatch(cursor, 0);
+    cursor->latched[cursor->num_latched++] = next_page_num;
+    cursor->page_num = next_page_num;
+    cursor->cell_num = 0;
+    cursor->next_ahead++;
+  }
+  cursor_read_ahead(cursor);
+  cursor->end_of_table = cursor->cell_num == cursor_num_cells(cursor);
+}
+
+void cursor_advance(Cursor *cursor) {
+  cursor->cell_num += 1;
+  if (cursor->cell_num >= cursor_num_cells(cursor)) {
+    cursor_next_leaf(cursor);
+  }
+}
+
+/*
+ * Secondary indexes. Each is a B-tree of (value, id) entries described in
+ * the Index Node Layout; lookups collect matching ids from it and then
+ * fetch the rows from the table.
+ */
+void index_entry(void *value, uint32_t length, uint32_t id, uint8_t *entry) {
+  uint32_t key_length = length < INDEX_KEY_SIZE ? length : INDEX_KEY_SIZE;
+
+  memcpy(entry, value, key_length);
+  memset(entry + key_length, 0, INDEX_KEY_SIZE - key_length);
+  entry[INDEX_KEY_SIZE] = id >> 24;
+  entry[INDEX_KEY_SIZE + 1] = id >> 16;
+  entry[INDEX_KEY_SIZE + 2] = id >> 8;
+  entry[INDEX_KEY_SIZE + 3] = id;
+}
+
+uint32_t index_entry_id(uint8_t *entry) {
+  return (uint32_t)entry[INDEX_KEY_SIZE] << 24 |
+         (uint32_t)entry[INDEX_KEY_SIZE + 1] << 16 |
+         (uint32_t)entry[INDEX_KEY_SIZE + 2] << 8 | entry[INDEX_KEY_SIZE + 3];
+}
+
+uint32_t *index_leaf_num_entries(void *node) {
+  return node + INDEX_LEAF_NUM_ENTRIES_OFFSET;
+}
+
+uint32_t *index_leaf_next_leaf(void *node) {
+  return node + INDEX_LEAF_NEXT_LEAF_OFFSET;
+}
+
+uint8_t *index_leaf_entry(void *node, uint32_t entry_num) {
+  return node + INDEX_LEAF_HEADER_SIZE + entry_num * INDEX_ENTRY_SIZE;
+}
+
+uint8_t *index_internal_entry(void *node, uint32_t key_num) {
+  return node + INTERNAL_NODE_HEADER_SIZE +
+         key_num * INDEX_INTERNAL_CELL_SIZE + INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint32_t *index_internal_child(void *node, uint32_t child_num) {
+  if (child_num == *internal_node_num_keys(node)) {
+    return internal_node_right_child(node);
+  }
+  return node + INTERNAL_NODE_HEADER_SIZE +
+         child_num * INDEX_INTERNAL_CELL_SIZE;
+}
+
+void initialize_index_leaf(void *node) {
+  memset(node, 0, INDEX_LEAF_HEADER_SIZE);
+  set_node_type(node, NODE_INDEX_LEAF);
+}
+
+void initialize_index_internal(void *node) {
+  memset(node, 0, INTERNAL_NODE_HEADER_SIZE);
+  set_node_type(node, NODE_INDEX_INTERNAL);
+  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+}
+
+// The first entry of a leaf that is >= entry, or the first child of an
+// internal node whose max entry is, or else its right child.
+uint32_t index_node_find(void *node, uint8_t *entry) {
+  bool leaf = get_node_type(node) == NODE_INDEX_LEAF;
+  uint32_t min_index = 0;
+  uint32_t max_index =
+      leaf ? *index_leaf_num_entries(node) : *internal_node_num_keys(node);
+
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    uint8_t *at_index = leaf ? index_leaf_entry(node, index)
+                             : index_internal_entry(node, index);
+    if (memcmp(at_index, entry, INDEX_ENTRY_SIZE) >= 0) {
+      max_index = index;
+    } else {
+      min_index = index + 1;
+    }
+  }
+  return min_index;
+}
+
+bool index_node_full(void *node) {
+  return get_node_type(node) == NODE_INDEX_LEAF
+             ? *index_leaf_num_entries(node) == INDEX_LEAF_MAX_ENTRIES
+             : *internal_node_num_keys(node) == INDEX_INTERNAL_MAX_KEYS;
+}
+
+/*
+ * Put entry at position in a leaf. In an internal node, entry is the max
+ * entry of the child at position after that child has split: the child
+ * keeps the entries up to it and right_page_num takes the rest.
+ */
+void index_node_insert(void *node, uint32_t position, uint8_t *entry,
+                       uint32_t right_page_num) {
+  if (get_node_type(node) == NODE_INDEX_LEAF) {
+    uint32_t *num_entries = index_leaf_num_entries(node);
+    uint8_t *at_position = index_leaf_entry(node, position);
+    memmove(at_position + INDEX_ENTRY_SIZE, at_position,
+            (*num_entries - position) * INDEX_ENTRY_SIZE);
+    memcpy(at_position, entry, INDEX_ENTRY_SIZE);
+    (*num_entries)++;
+    return;
+  }
+
+  uint32_t *num_keys = internal_node_num_keys(node);
+  uint32_t child_page_num = *index_internal_child(node, position);
+  void *cell = index_internal_child(node, position);
+  if (position < *num_keys) {
+    memmove(cell + INDEX_INTERNAL_CELL_SIZE, cell,
+            (*num_keys - position) * INDEX_INTERNAL_CELL_SIZE);
+  }
+  (*num_keys)++;
+  *index_internal_child(node, position) = child_page_num;
+  memcpy(index_internal_entry(node, position), entry, INDEX_ENTRY_SIZE);
+  *index_internal_child(node, position + 1) = right_page_num;
+}
+
+/*
+ * Insert into a full node by splitting it in half. The node keeps the
+ * lower half; the upper half goes to a new page, whose number is
+ * returned, and separator is set to the max entry of the lower half.
+ */
+uint32_t index_node_split(Pager *pager, void *node, uint32_t position,
+                          uint8_t *entry, uint32_t right_page_num,
+                          uint8_t *separator) {
+  // Room for the node with one more entry or cell than fits in a page.
+  uint8_t staging[PAGE_SIZE + INDEX_INTERNAL_CELL_SIZE];
+  memcpy(staging, node, PAGE_SIZE);
+  index_node_insert(staging, position, entry, right_page_num);
+
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void *new_node = get_page(pager, new_page_num);
+
+  if (get_node_type(node) == NODE_INDEX_LEAF) {
+    uint32_t num_entries = *index_leaf_num_entries(staging);
+    uint32_t left_entries = num_entries / 2;
+
+    initialize_index_leaf(new_node);
+    *index_leaf_num_entries(new_node) = num_entries - left_entries;
+    memcpy(index_leaf_entry(new_node, 0),
+           index_leaf_entry(staging, left_entries),
+           (num_entries - left_entries) * INDEX_ENTRY_SIZE);
+    *index_leaf_next_leaf(new_node) = *index_leaf_next_leaf(node);
+
+    *index_leaf_num_entries(node) = left_entries;
+    memcpy(index_leaf_entry(node, 0), index_leaf_entry(staging, 0),
+           left_entries * INDEX_ENTRY_SIZE);
+    *index_leaf_next_leaf(node) = new_page_num;
+    memcpy(separator, index_leaf_entry(node, left_entries - 1),
+           INDEX_ENTRY_SIZE);
+  } else {
+    // The middle key moves up; its child becomes the left's right child.
+    uint32_t num_keys = *internal_node_num_keys(staging);
+    uint32_t middle = num_keys / 2;
+
+    initialize_index_internal(new_node);
+    *internal_node_num_keys(new_node) = num_keys - middle - 1;
+    memcpy(index_internal_child(new_node, 0),
+           index_internal_child(staging, middle + 1),
+           (num_keys - middle - 1) * INDEX_INTERNAL_CELL_SIZE);
+    *internal_node_right_child(new_node) =
+        *internal_node_right_child(staging);
+
+    memcpy(separator, index_internal_entry(staging, middle),
+           INDEX_ENTRY_SIZE);
+    *internal_node_num_keys(node) = middle;
+    memcpy(index_internal_child(node, 0), index_internal_child(staging, 0),
+           middle * INDEX_INTERNAL_CELL_SIZE);
+    *internal_node_right_child(node) = *index_internal_child(staging, middle);
+  }
+
+  pager_mark_dirty(pager, new_page_num);
+  pager_unpin(pager, new_page_num);
+  return new_page_num;
+}
+
+// The root has split: move its lower half to a new page so the root can
+// stay where the catalog points and become their parent.
+void index_new_root(Pager *pager, uint32_t root_page_num, uint8_t *separator,
+                    uint32_t right_page_num) {
+  void *root = get_page(pager, root_page_num);
+  uint32_t left_page_num = get_unused_page_num(pager);
+  void *left = get_page(pager, left_page_num);
+
+  memcpy(left, root, PAGE_SIZE);
+  set_node_root(left, false);
+  initialize_index_internal(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *index_internal_child(root, 0) = left_page_num;
+  memcpy(index_internal_entry(root, 0), separator, INDEX_ENTRY_SIZE);
+  *internal_node_right_child(root) = right_page_num;
+
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, root_page_num);
+  pager_unpin(pager, left_page_num);
+  pager_unpin(pager, root_page_num);
+}
+
+/*
+ * Descend with exclusive latches, letting go of the ancestors whenever a
+ * node has room, since a split cannot reach past it. The nodes from
+ * path[latched] down stay latched until the insert is done.
+ */
+void index_insert(Pager *pager, uint32_t root_page_num, uint8_t *entry) {
+  uint32_t path[INDEX_MAX_DEPTH + 1];
+  uint32_t positions[INDEX_MAX_DEPTH];
+  uint32_t depth = 0;
+  uint32_t latched = 0;
+  uint32_t page_num = root_page_num;
+  void *node = page_latch(pager, page_num, true);
+
+  while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+    path[depth] = page_num;
+    positions[depth] = index_node_find(node, entry);
+    page_num = *index_internal_child(node, positions[depth]);
+    node = page_latch(pager, page_num, true);
+    depth++;
+    if (!index_node_full(node)) {
+      for (; latched < depth; latched++) {
+        page_unlatch(pager, path[latched]);
+      }
+    }
+  }
+  path[depth] = page_num;
+  uint32_t leaf_depth = depth;
+
+  // Insert into the leaf; while a node is full, split it and insert the
+  // separator into its parent instead.
+  uint8_t pending[INDEX_ENTRY_SIZE];
+  uint8_t separator[INDEX_ENTRY_SIZE];
+  uint32_t position = index_node_find(node, entry);
+  uint32_t right_page_num = 0;
+  memcpy(pending, entry, INDEX_ENTRY_SIZE);
+
+  for (;;) {
+    pager_mark_dirty(pager, page_num);
+    if (!index_node_full(node)) {
+      index_node_insert(node, position, pending, right_page_num);
+      break;
+    }
+    right_page_num = index_node_split(pager, node, position, pending,
+                                      right_page_num, separator);
+    if (depth == 0) {
+      index_new_root(pager, root_page_num, separator, right_page_num);
+      break;
+    }
+
+    memcpy(pending, separator, INDEX_ENTRY_SIZE);
+    depth--;
+    page_num = path[depth];
+    position = positions[depth];
+    node = get_page(pager, page_num);
+    pager_unpin(pager, page_num); // still pinned by its latch
+  }
+
+  for (; latched <= leaf_depth; latched++) {
+    page_unlatch(pager, path[latched]);
+  }
+}
+
+void index_add_row(Table *table, Index *index, void *node, uint32_t cell_num) {
+  uint8_t entry[INDEX_ENTRY_SIZE];
+  uint32_t length;
+  void *value = leaf_node_string(node, cell_num, index->column, &length);
+
+  index_entry(value, length, leaf_node_key(node, cell_num), entry);
+  index_insert(table->pager, index->root_page_num, entry);
+}
+
+// Add every row of the table to a new index.
+void index_fill(Table *table, Index *index) {
+  Pager *pager = table->pager;
+  Cursor *cursor = table_start(table);
+
+  while (!cursor->end_of_table) {
+    void *node = get_page(pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    stats_add(STAT_ROWS_SCANNED, num_cells);
+    for (uint32_t i = 0; i < num_cells; i++) {
+      index_add_row(table, index, node, i);
+    }
+    pager_unpin(pager, cursor->page_num);
+    cursor_next_leaf(cursor);
+  }
+  cursor_close(cursor);
+}
+
+int compare_ids(const void *a, const void *b) {
+  uint32_t left = *(uint32_t *)a;
+  uint32_t right = *(uint32_t *)b;
+  return (left > right) - (left < right);
+}
+
+/*
+ * The ids of the rows whose indexed column may satisfy predicate, in id
+ * order, in a malloc'd array. Values are only indexed up to INDEX_KEY_SIZE
+ * bytes, so longer ones can match here and still fail the predicate.
+ */
+uint32_t *index_lookup(Table *table, Index *index, Predicate *predicate,
+                       uint32_t *num_ids) {
+  Pager *pager = table->pager;
+  uint8_t low[INDEX_ENTRY_SIZE];
+  uint32_t compare_length = INDEX_KEY_SIZE;
+  uint32_t capacity = 64;
+  uint32_t *ids = malloc(capacity * sizeof(uint32_t));
+
+  index_entry(predicate->text, predicate->length, 0, low);
+  if (predicate->type == PREDICATE_PREFIX &&
+      predicate->length < INDEX_KEY_SIZE) {
+    compare_length = predicate->length;
+  }
+
+  // Crab down with shared latches, then along the leaves, never holding
+  // more than a parent and its child.
+  pthread_rwlock_rdlock(&table->tree_latch);
+  uint32_t page_num = index->root_page_num;
+  void *node = page_latch(pager, page_num, false);
+  profile_index_page(table);
+  while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+    uint32_t child_page_num =
+        *index_internal_child(node, index_node_find(node, low));
+    void *child = page_latch(pager, child_page_num, false);
+    profile_index_page(table);
+    page_unlatch(pager, page_num);
+    page_num = child_page_num;
+    node = child;
+  }
+
+  *num_ids = 0;
+  uint32_t entry_num = index_node_find(node, low);
+  for (;;) {
+    if (entry_num == *index_leaf_num_entries(node)) {
+      uint32_t next_page_num = *index_leaf_next_leaf(node);
+      if (next_page_num == 0) {
+        page_unlatch(pager, page_num);
+        break;
+      }
+      void *next = page_latch(pager, next_page_num, false);
+      profile_index_page(table);
+      page_unlatch(pager, page_num);
+      page_num = next_page_num;
+      node = next;
+      entry_num = 0;
+      continue;
+    }
+
+    uint8_t *entry = index_leaf_entry(node, entry_num++);
+    if (memcmp(entry, low, compare_length) != 0) {
+      page_unlatch(pager, page_num);
+      break;
+    }
+    if (*num_ids == capacity) {
+      capacity *= 2;
+      ids = realloc(ids, capacity * sizeof(uint32_t));
+    }
+    ids[(*num_ids)++] = index_entry_id(entry);
+  }
+  pthread_rwlock_unlock(&table->tree_latch);
+
+  qsort(ids, *num_ids, sizeof(uint32_t), compare_ids);
+  return ids;
+}
+
+// The index that can answer one of the predicates, or NULL.
+Index *index_for_predicates(Table *table, Predicate *predicates,
+                            uint32_t num_predicates, Predicate **predicate) {
+  for (uint32_t p = 0; p < num_predicates; p++) {
+    if ((predicates[p].type != PREDICATE_EQUALS &&
+         predicates[p].type != PREDICATE_PREFIX) ||
+        predicates[p].length == 0) {
+      continue;
+    }
+    uint32_t num_indexes =
+        __atomic_load_n(&table->num_indexes, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < num_indexes; i++) {
+      if (table->indexes[i].column == predicates[p].column) {
+        *predicate = &predicates[p];
+        return &table->indexes[i];
+      }
+    }
+  }
+  return NULL;
+}
+
+void db_write_index_catalog(Table *table) {
+  Pager *pager = table->pager;
+  void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+
+  *(uint32_t *)(header + DB_HEADER_NUM_INDEXES_OFFSET) = table->num_indexes;
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    void *entry = header + DB_HEADER_INDEXES_OFFSET + i * DB_HEADER_INDEX_SIZE;
+    *(uint32_t *)entry = table->indexes[i].column;
+    *(uint32_t *)(entry + sizeof(uint32_t)) = table->indexes[i].root_page_num;
+  }
+  pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+  pager_unpin(pager, DB_HEADER_PAGE_NUM);
+}
+
+void db_read_index_catalog(Table *table) {
+  Pager *pager = table->pager;
+  void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+
+  table->num_indexes = *(uint32_t *)(header + DB_HEADER_NUM_INDEXES_OFFSET);
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    void *entry = header + DB_HEADER_INDEXES_OFFSET + i * DB_HEADER_INDEX_SIZE;
+    table->indexes[i].column = *(uint32_t *)entry;
+    table->indexes[i].root_page_num = *(uint32_t *)(entry + sizeof(uint32_t));
+  }
+  pager_unpin(pager, DB_HEADER_PAGE_NUM);
+}
+
+// The header's row count. Readers load it while the writer adds to it.
+uint64_t table_num_rows(Table *table) {
+  void *header = get_page(table->pager, DB_HEADER_PAGE_NUM);
+  uint64_t num_rows = __atomic_load_n(
+      (uint64_t *)(header + DB_HEADER_NUM_ROWS_OFFSET), __ATOMIC_RELAXED);
+  pager_unpin(table->pager, DB_HEADER_PAGE_NUM);
+  return num_rows;
+}
+
+void table_add_rows(Table *table, uint64_t num_rows) {
+  void *header = get_page(table->pager, DB_HEADER_PAGE_NUM);
+  __atomic_add_fetch((uint64_t *)(header + DB_HEADER_NUM_ROWS_OFFSET),
+                     num_rows, __ATOMIC_RELAXED);
+  pager_mark_dirty(table->pager, DB_HEADER_PAGE_NUM);
+  pager_unpin(table->pager, DB_HEADER_PAGE_NUM);
+}
+
+/*
+ * Build an index over the rows already in the table. Like a bulk import,
+ * the new pages bypass the WAL, so the index is checkpointed straight
+ * away; until then, recovery drops it again. That checkpoint would write
+ * out an open transaction too, so it has to be committed first.
+ */
+ExecuteResult create_index(Table *table, uint32_t column) {
+  Pager *pager = table->pager;
+
+  if (pager->transaction != NULL) {
+    return EXECUTE_TRANSACTION_OPEN;
+  }
+
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    if (table->indexes[i].column == column) {
+      return EXECUTE_INDEX_EXISTS;
+    }
+  }
+
+  Index *index = &table->indexes[table->num_indexes];
+  index->column = column;
+  index->root_page_num = get_unused_page_num(pager);
+  void *root = get_page(pager, index->root_page_num);
+  initialize_index_leaf(root);
+  set_node_root(root, true);
+  pager_mark_dirty(pager, index->root_page_num);
+  pager_unpin(pager, index->root_page_num);
+
+  index_fill(table, index);
+  // Readers only see the index once it holds every row.
+  __atomic_store_n(&table->num_indexes, table->num_indexes + 1,
+                   __ATOMIC_RELEASE);
+  db_write_index_catalog(table);
+  if (pager->wal != NULL) {
+    db_checkpoint(table);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_create_index(Table *table, uint32_t column) {
+  profile_access_path(table, "full scan to build an index on %s",
+                      RESULT_COLUMN_NAMES[__builtin_ctz(column)]);
+  pthread_mutex_lock(&table->writer);
+  ExecuteResult result = create_index(table, column);
+  pthread_mutex_unlock(&table->writer);
+  return result;
+}
+
+// Insert one row. The caller holds the table's writer lock.
+ExecuteResult table_insert(Table *table, Row *row_to_insert) {
+  uint32_t key_to_insert = row_to_insert->id;
+  Cursor *cursor = table_find_for_insert(table, row_to_insert);
+
+  void *node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t key_at_index =
+      cursor->cell_num < num_cells ? leaf_node_key(node, cursor->cell_num) : 0;
+  bool needs_split = !leaf_node_has_room(node, row_to_insert);
+  pager_unpin(table->pager, cursor->page_num);
+
+  if (cursor->cell_num < num_cells && key_at_index == key_to_insert) {
+    cursor_close(cursor);
+    return EXECUTE_DUPLICATE_KEY;
+  }
+
+  // A split allocates at most one page per level plus a copy of the root,
+  // in the table and in each index; page numbers must stay clear of
+  // INVALID_PAGE_NUM.
+  uint64_t new_pages = (uint64_t)table->num_indexes * (INDEX_MAX_DEPTH + 1);
+  if (needs_split) {
+    new_pages += tree_depth(table) + 1;
+  }
+  if (new_pages > 0 &&
+      (uint64_t)table->pager->num_pages + new_pages >= INVALID_PAGE_NUM) {
+    cursor_close(cursor);
+    return EXECUTE_TABLE_FULL;
+  }
+
+  leaf_node_insert(cursor, row_to_insert);
+  cursor_close(cursor);
+  table_add_rows(table, 1);
+
+  if (table->num_indexes > 0) {
+    // A split may have moved the row, so look it up again.
+    cursor = table_find(table, key_to_insert);
+    node = get_page(table->pager, cursor->page_num);
+    for (uint32_t i = 0; i < table->num_indexes; i++) {
+      index_add_row(table, &table->indexes[i], node, cursor->cell_num);
+    }
+    pager_unpin(table->pager, cursor->page_num);
+    cursor_close(cursor);
+  }
+
+  pthread_mutex_lock(&table->pager->latch);
+  wal_log_insert(table->pager->wal, row_to_insert);
+  pthread_mutex_unlock(&table->pager->latch);
+  db_commit(table);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement *statement, Table *table) {
+  profile_access_path(table, "key lookup of id %u for insert",
+                      statement->row_to_insert.id);
+  pthread_mutex_lock(&table->writer);
+  ExecuteResult result = table_insert(table, &statement->row_to_insert);
+  pthread_mutex_unlock(&table->writer);
+  return result;
+}
+
+/*
+ * Aggregates are functions of the matching rows' ids alone, so they never
+ * read a row. A leaf's keys are sorted, which makes its first and last key
+ * and its cell count a zone map for it: with only id bounds to meet and no
+ * sum to take, the part of a leaf within the bounds is counted from its
+ * ends without reading the cells between. With no predicates at all, the
+ * count comes from the file header and the min and max from the two ends
+ * of the tree.
+ */
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint32_t min_id;
+  uint32_t max_id;
+} AggregateResult;
+
+// Add count rows whose ids run from first_id to last_id. Sums are only
+// taken over rows added one at a time.
+void aggregate_add_rows(AggregateResult *result, uint32_t first_id,
+                        uint32_t last_id, uint64_t count) {
+  if (result->count == 0 || first_id < result->min_id) {
+    result->min_id = first_id;
+  }
+  if (result->count == 0 || last_id > result->max_id) {
+    result->max_id = last_id;
+  }
+  result->count += count;
+}
+
+void aggregate_add_row(AggregateResult *result, uint32_t id) {
+  aggregate_add_rows(result, id, id, 1);
+  result->sum += id;
+}
+
+// Fold in the aggregates of rows disjoint from those already added.
+void aggregate_merge(AggregateResult *result, AggregateResult *part) {
+  if (part->count > 0) {
+    aggregate_add_rows(result, part->min_id, part->max_id, part->count);
+    result->sum += part->sum;
+  }
+}
+
+// Aggregate the rows of ids min_id..max_id the statement matches, a leaf at
+// a time.
+void aggregate_leaves(Table *table, Statement *statement, bool wants_sum,
+                      uint32_t min_id, uint32_t max_id,
+                      AggregateResult *result) {
+  Pager *pager = table->pager;
+  Predicate *predicates = statement->predicates;
+  uint32_t num_predicates = statement->num_predicates;
+  bool id_bounds_only = true;
+
+  for (uint32_t p = 0; p < num_predicates; p++) {
+    id_bounds_only = id_bounds_only && predicates[p].type == PREDICATE_ID_RANGE;
+  }
+
+  uint32_t key_buffer[LEAF_NODE_COMPRESSED_MAX_CELLS];
+  uint64_t selection[LEAF_NODE_SELECTION_WORDS];
+  Cursor *cursor = table_find(table, min_id);
+  cursor_read_ahead(cursor);
+  while (!cursor->end_of_table) {
+    void *node = get_page(pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t start = cursor->cell_num;
+    uint32_t end = max_id == UINT32_MAX ? num_cells
+                                        : leaf_node_find(node, max_id + 1);
+
+    if (id_bounds_only && !wants_sum) {
+      if (end > start) {
+        aggregate_add_rows(result, leaf_node_key(node, start),
+                           leaf_node_key(node, end - 1), end - start);
+      }
+    } else {
+      uint32_t *keys = leaf_node_keys(node, key_buffer);
+      leaf_node_select(node, predicates, num_predicates, selection);
+      for (uint32_t i = start; i < end; i++) {
+        if (selection[i / 64] & (1ULL << (i % 64))) {
+          aggregate_add_row(result, keys[i]);
+        }
+      }
+    }
+    bool past_max_id =
+        num_cells > 0 && leaf_node_key(node, num_cells - 1) >= max_id;
+    pager_unpin(pager, cursor->page_num);
+    if (past_max_id) {
+      break;
+    }
+    cursor_next_leaf(cursor);
+  }
+  cursor_close(cursor);
+}
+
+/*
+ * Parallel scans split the ids a select covers into morsels of about
+ * SCAN_MORSEL_PAGES leaves each and hand them to the table's pool of scan
+ * threads. Each thread filters its morsels into its own buffers, and the
+ * thread running the select writes the buffers out in id order as they
+ * complete. An aggregating select instead has each morsel aggregated on its
+ * own, and merges the results.
+ */
+typedef struct {
+  uint32_t min_id; // the morsel covers min_id..max_id
+  uint32_t max_id;
+  char *output;
+  size_t output_length;
+  AggregateResult aggregate;
+  bool done;
+} Morsel;
+
+// A worker's share of a scan, as slots of the scan's morsels: slot s of
+// worker w is morsel s * num_threads + w. The worker takes slots from the
+// front, and idle workers steal them from the back.
+typedef struct {
+  pthread_mutex_t lock;
+  uint32_t head;
+  uint32_t tail;
+} MorselQueue;
+
+typedef struct {
+  struct ScanPool *pool;
+  uint32_t index;
+  pthread_t thread;
+} ScanWorker;
+
+typedef struct ScanPool {
+  Table *table;
+  uint32_t num_threads;
+  ScanWorker workers[SCAN_MAX_THREADS];
+  MorselQueue queues[SCAN_MAX_THREADS];
+  pthread_mutex_t busy; // held by the select using the pool
+  // Guards the fields below.
+  pthread_mutex_t lock;
+  pthread_cond_t job_ready;
+  pthread_cond_t morsel_done;
+  uint64_t generation; // bumped for each scan
+  bool stopping;
+  uint32_t num_working;
+  Statement *statement;
+  bool aggregating;
+  bool wants_sum;
+  Morsel *morsels;
+  uint32_t num_morsels;
+} ScanPool;
+
+// Filter one morsel's rows into its output buffer, or aggregate them.
+void scan_morsel(ScanPool *pool, Morsel *morsel) {
+  Table *table = pool->table;
+  Statement *statement = pool->statement;
+
+  if (pool->aggregating) {
+    aggregate_leaves(table, statement, pool->wants_sum, morsel->min_id,
+                     morsel->max_id, &morsel->aggregate);
+    return;
+  }
+  uint64_t selection[LEAF_NODE_SELECTION_WORDS];
+  FILE *output = open_memstream(&morsel->output, &morsel->output_length);
+  ResultWriter *writer = result_writer_open(output, table->output_format);
+  Cursor *cursor = table_find(table, morsel->min_id);
+
+  cursor_read_ahead(cursor);
+  while (!cursor->end_of_table) {
+    void *node = get_page(table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t end = morsel->max_id == UINT32_MAX
+                       ? num_cells
+                       : leaf_node_find(node, morsel->max_id + 1);
+
+    leaf_node_select(node, statement->predicates, statement->num_predicates,
+                     selection);
+    for (uint32_t i = cursor->cell_num; i < end; i++) {
+      if (selection[i / 64] & (1ULL << (i % 64))) {
+        result_writer_row(writer, node, i, statement->columns);
+      }
+    }
+    // Morsels end on a leaf's last key, so stop there rather than reading
+    // the next morsel's first leaf only to find nothing in range.
+    bool past_max_id =
+        num_cells > 0 && leaf_node_key(node, num_cells - 1) >= morsel->max_id;
+    pager_unpin(table->pager, cursor->page_num);
+    if (past_max_id) {
+      break;
+    }
+    cursor_next_leaf(cursor);
+  }
+
+  cursor_close(cursor);
+  result_writer_close(writer);
+  fclose(output);
+}
+
+bool scan_pool_take(ScanPool *pool, uint32_t index, uint32_t *morsel_num) {
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    uint32_t victim = (index + i) % pool->num_threads;
+    MorselQueue *queue = &pool->queues[victim];
+    bool taken = false;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail) {
+      uint32_t slot = victim == index ? queue->head++ : --queue->tail;
+      *morsel_num = slot * pool->num_threads + victim;
+      taken = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (taken) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void *scan_worker(void *argument) {
+  ScanWorker *worker = argument;
+  ScanPool *pool = worker->pool;
+  uint64_t generation = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping && pool->generation == generation) {
+      pthread_cond_wait(&pool->job_ready, &pool->lock);
+    }
+    if (pool->stopping) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    uint32_t morsel_num;
+    while (scan_pool_take(pool, worker->index, &morsel_num)) {
+      scan_morsel(pool, &pool->morsels[morsel_num]);
+      pthread_mutex_lock(&pool->lock);
+      pool->morsels[morsel_num].done = true;
+      pthread_cond_broadcast(&pool->morsel_done);
+      pthread_mutex_unlock(&pool->lock);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->num_working--;
+    pthread_cond_broadcast(&pool->morsel_done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+ScanPool *scan_pool_open(Table *table, uint32_t num_threads) {
+  ScanPool *pool = calloc(1, sizeof(ScanPool));
+  pool->table = table;
+  pool->num_threads = num_threads;
+  pthread_mutex_init(&pool->busy, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->job_ready, NULL);
+  pthread_cond_init(&pool->morsel_done, NULL);
+
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    pthread_create(&pool->workers[i].thread, NULL, scan_worker,
+                   &pool->workers[i]);
+  }
+  return pool;
+}
+
+void scan_pool_close(ScanPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->job_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+    pthread_mutex_destroy(&pool->queues[i].lock);
+  }
+  pthread_mutex_destroy(&pool->busy);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->job_ready);
+  pthread_cond_destroy(&pool->morsel_done);
+  free(pool);
+}
+
+/*
+ * Append the keys between min_id and max_id of the nodes just above the
+ * leaves under page_num; each is the largest id of a leaf. The tree may
+ * change once a node is let go, but any key still splits the ids into
+ * ranges that the morsels' own descents handle correctly.
+ */
+void table_leaf_keys(Table *table, uint32_t page_num, uint32_t min_id,
+                     uint32_t max_id, uint32_t **keys, uint32_t *num_keys,
+                     uint32_t *capacity) {
+  uint32_t children[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+  uint32_t node_keys[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+  void *node = page_latch(table->pager, page_num, false);
+  if (get_node_type(node) != NODE_INTERNAL) {
+    page_unlatch(table->pager, page_num);
+    return;
+  }
+  uint32_t num_node_keys = internal_node_load(node, children, node_keys);
+  page_unlatch(table->pager, page_num);
+  void *child = page_latch(table->pager, children[0], false);
+  bool above_leaves = get_node_type(child) == NODE_LEAF;
+  page_unlatch(table->pager, children[0]);
+
+  for (uint32_t i = 0; i <= num_node_keys; i++) {
+    // Child i holds the ids after key i - 1, up to key i.
+    if (i > 0 && node_keys[i - 1] >= max_id) {
+      break;
+    }
+    if (i < num_node_keys && node_keys[i] < min_id) {
+      continue;
+    }
+    if (!above_leaves) {
+      table_leaf_keys(table, children[i], min_id, max_id, keys, num_keys,
+                      capacity);
+    } else if (i < num_node_keys && node_keys[i] < max_id) {
+      if (*num_keys == *capacity) {
+        *capacity *= 2;
+        *keys = realloc(*keys, *capacity * sizeof(uint32_t));
+      }
+      (*keys)[(*num_keys)++] = node_keys[i];
+    }
+  }
+}
+
+/*
+ * Split the ids min_id..max_id into morsels and set the scan pool to work
+ * on them. Returns NULL, having started nothing, if there is no pool,
+ * another select has it, or the ids span too few leaves to be worth
+ * splitting. Otherwise the caller waits for each morsel with
+ * scan_pool_wait and hands the pool back with scan_pool_finish.
+ */
+Morsel *scan_pool_start(Table *table, Statement *statement, bool aggregating,
+                        bool wants_sum, uint32_t min_id, uint32_t max_id,
+                        uint32_t *num_morsels_out) {
+  ScanPool *pool = table->scan_pool;
+  if (pool == NULL || pthread_mutex_trylock(&pool->busy) != 0) {
+    return NULL;
+  }
+
+  uint32_t capacity = 1024;
+  uint32_t num_keys = 0;
+  uint32_t *keys = malloc(capacity * sizeof(uint32_t));
+  table_leaf_keys(table, table->root_page_num, min_id, max_id, &keys,
+                  &num_keys, &capacity);
+
+  uint32_t num_morsels = num_keys / SCAN_MORSEL_PAGES + 1;
+  if (num_morsels < 2) {
+    free(keys);
+    pthread_mutex_unlock(&pool->busy);
+    return NULL;
+  }
+  profile_access_path(table, "parallel %s of ids %u..%u: %u morsels on %u "
+                      "threads", aggregating ? "aggregate" : "scan", min_id,
+                      max_id, num_morsels, pool->num_threads);
+
+  Morsel *morsels = calloc(num_morsels, sizeof(Morsel));
+  for (uint32_t i = 0; i < num_morsels; i++) {
+    morsels[i].min_id = i == 0 ? min_id : morsels[i - 1].max_id + 1;
+    morsels[i].max_id = i + 1 == num_morsels
+                            ? max_id
+                            : keys[(i + 1) * SCAN_MORSEL_PAGES - 1];
+  }
+  free(keys);
+
+  pthread_mutex_lock(&pool->lock);
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    pool->queues[i].head = 0;
+    pool->queues[i].tail =
+        num_morsels / pool->num_threads + (i < num_morsels % pool->num_threads);
+  }
+  pool->statement = statement;
+  pool->aggregating = aggregating;
+  pool->wants_sum = wants_sum;
+  pool->morsels = morsels;
+  pool->num_morsels = num_morsels;
+  pool->num_working = pool->num_threads;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->job_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  *num_morsels_out = num_morsels;
+  return morsels;
+}
+
+void scan_pool_wait(ScanPool *pool, Morsel *morsel) {
+  pthread_mutex_lock(&pool->lock);
+  while (!morsel->done) {
+    pthread_cond_wait(&pool->morsel_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait for the workers to run out of morsels, then release the pool.
+void scan_pool_finish(ScanPool *pool, Morsel *morsels) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->num_working > 0) {
+    pthread_cond_wait(&pool->morsel_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  free(morsels);
+  pthread_mutex_unlock(&pool->busy);
+}
+
+/*
+ * Run a select's scan of ids min_id..max_id on the scan pool. Returns false,
+ * having written nothing, if scan_pool_start does not take it on.
+ */
+bool parallel_scan(Table *table, Statement *statement, FILE *output,
+                   uint32_t min_id, uint32_t max_id) {
+  uint32_t num_morsels;
+  Morsel *morsels = scan_pool_start(table, statement, false, false, min_id,
+                                    max_id, &num_morsels);
+  if (morsels == NULL) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < num_morsels; i++) {
+    scan_pool_wait(table->scan_pool, &morsels[i]);
+    fwrite(morsels[i].output, 1, morsels[i].output_length, output);
+    free(morsels[i].output);
+  }
+  fflush(output);
+  scan_pool_finish(table->scan_pool, morsels);
+  return true;
+}
+
+// Aggregate ids min_id..max_id on the scan pool, as parallel_scan selects.
+bool parallel_aggregate(Table *table, Statement *statement, bool wants_sum,
+                        uint32_t min_id, uint32_t max_id,
+                        AggregateResult *result) {
+  uint32_t num_morsels;
+  Morsel *morsels = scan_pool_start(table, statement, true, wants_sum, min_id,
+                                    max_id, &num_morsels);
+  if (morsels == NULL) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < num_morsels; i++) {
+    scan_pool_wait(table->scan_pool, &morsels[i]);
+    aggregate_merge(result, &morsels[i].aggregate);
+  }
+  scan_pool_finish(table->scan_pool, morsels);
+  return true;
+}
+
+void aggregate_rows(Table *table, Statement *statement, bool wants_sum,
+                    AggregateResult *result) {
+  Pager *pager = table->pager;
+  Predicate *predicates = statement->predicates;
+  uint32_t num_predicates = statement->num_predicates;
+  uint32_t min_id, max_id;
+
+  if (!predicates_id_bounds(predicates, num_predicates, &min_id, &max_id)) {
+    return;
+  }
+
+  if (num_predicates == 0 && !wants_sum) {
+    profile_access_path(table, "row count from the file header");
+    result->count = table_num_rows(table);
+    Cursor *cursor = table_start(table);
+    if (!cursor->end_of_table) {
+      void *node = get_page(pager, cursor->page_num);
+      result->min_id = leaf_node_key(node, cursor->cell_num);
+      pager_unpin(pager, cursor->page_num);
+    }
+    cursor_close(cursor);
+    cursor = table_end(table);
+    if (cursor->cell_num > 0) {
+      void *node = get_page(pager, cursor->page_num);
+      result->max_id = leaf_node_key(node, cursor->cell_num - 1);
+      pager_unpin(pager, cursor->page_num);
+    }
+    cursor_close(cursor);
+    return;
+  }
+
+  Predicate *indexed;
+  Index *index =
+      index_for_predicates(table, predicates, num_predicates, &indexed);
+  if (index != NULL) {
+    uint32_t num_ids;
+    profile_access_path(table, "index lookup on %s",
+                        RESULT_COLUMN_NAMES[__builtin_ctz(index->column)]);
+    uint32_t *ids = index_lookup(table, index, indexed, &num_ids);
+    stats_add(STAT_ROWS_SCANNED, num_ids);
+    for (uint32_t i = 0; i < num_ids; i++) {
+      Cursor *cursor = table_find(table, ids[i]);
+      void *node = get_page(pager, cursor->page_num);
+      if (cursor->cell_num < *leaf_node_num_cells(node) &&
+          leaf_node_key(node, cursor->cell_num) == ids[i] &&
+          leaf_node_cell_matches(node, cursor->cell_num, predicates,
+                                 num_predicates)) {
+        aggregate_add_row(result, ids[i]);
+      }
+      pager_unpin(pager, cursor->page_num);
+      cursor_close(cursor);
+    }
+    free(ids);
+    return;
+  }
+
+  if (parallel_aggregate(table, statement, wants_sum, min_id, max_id,
+                         result)) {
+    return;
+  }
+  profile_scan(table, min_id, max_id);
+  aggregate_leaves(table, statement, wants_sum, min_id, max_id, result);
+}
+
+// Compute the program's aggregates over the rows the statement matches.
+void table_aggregate(Table *table, Program *program, Statement *statement,
+                     uint64_t *values) {
+  AggregateResult result = {0, 0, 0, 0};
+  bool wants_sum = false;
+
+  for (uint32_t i = 0; i < program->num_aggregates; i++) {
+    wants_sum = wants_sum || program->aggregates[i] == AGGREGATE_SUM;
+  }
+  aggregate_rows(table, statement, wants_sum, &result);
+
+  for (uint32_t i = 0; i < program->num_aggregates; i++) {
+    switch (program->aggregates[i]) {
+    case AGGREGATE_COUNT:
+      values[i] = result.count;
+      break;
+    case AGGREGATE_MIN:
+      values[i] = result.count > 0 ? result.min_id : RESULT_NO_VALUE;
+      break;
+    case AGGREGATE_MAX:
+      values[i] = result.count > 0 ? result.max_id : RESULT_NO_VALUE;
+      break;
+    case AGGREGATE_SUM:
+      values[i] = result.count > 0 ? result.sum : RESULT_NO_VALUE;
+      break;
+    }
+  }
+}
+
+/*
+ * Run a bound statement's code. A select first tries an index on one of its
+ * string predicates and fetches the rows it points to. Otherwise it is a
+ * loop over leaves: open a cursor at the lowest id the predicates allow,
+ * evaluate the predicates over the leaf, write out the cells they select,
+ * and step to the next leaf until one reaches past the highest id.
+ */
+ExecuteResult vm_run(Program *program, Statement *statement, Table *table,
+                     FILE *output) {
+  Pager *pager = table->pager;
+  Cursor *cursor = NULL;
+  ResultWriter *writer = NULL;
+  void *node = NULL;
+  uint32_t min_id = 0;
+  uint32_t max_id = 0;
+  uint64_t selection[LEAF_NODE_SELECTION_WORDS];
+  uint32_t *ids = NULL;
+  uint32_t num_ids = 0;
+
+  for (uint32_t pc = 0;; pc++) {
+    Instruction *instruction = &program->code[pc];
+
+    switch (instruction->opcode) {
+    case OP_HALT:
+      return EXECUTE_SUCCESS;
+    case OP_INSERT: {
+      ExecuteResult result = execute_insert(statement, table);
+      if (result != EXECUTE_SUCCESS) {
+        return result;
+      }
+      break;
+    }
+    case OP_CREATE_INDEX:
+      return execute_create_index(table, instruction->arg);
+    case OP_BEGIN:
+      return db_begin(table);
+    case OP_COMMIT:
+      return db_commit_transaction(table);
+    case OP_ROLLBACK:
+      return db_rollback(table);
+    case OP_OPEN_INDEX: {
+      Predicate *predicate;
+      Index *index = index_for_predicates(table, statement->predicates,
+                                          statement->num_predicates, &predicate);
+      if (index == NULL) {
+        pc = instruction->operand - 1;
+        break;
+      }
+      profile_access_path(table, "index lookup on %s",
+                          RESULT_COLUMN_NAMES[__builtin_ctz(index->column)]);
+      ids = index_lookup(table, index, predicate, &num_ids);
+      stats_add(STAT_ROWS_SCANNED, num_ids);
+      break;
+    }
+    case OP_EMIT_INDEXED:
+      writer = result_writer_open(output, table->output_format);
+      for (uint32_t i = 0; i < num_ids; i++) {
+        cursor = table_find(table, ids[i]);
+        node = get_page(pager, cursor->page_num);
+        if (cursor->cell_num < *leaf_node_num_cells(node) &&
+            leaf_node_key(node, cursor->cell_num) == ids[i] &&
+            leaf_node_cell_matches(node, cursor->cell_num,
+                                   statement->predicates,
+                                   statement->num_predicates)) {
+          result_writer_row(writer, node, cursor->cell_num, statement->columns);
+        }
+        pager_unpin(pager, cursor->page_num);
+        cursor_close(cursor);
+      }
+      result_writer_close(writer);
+      free(ids);
+      break;
+    case OP_PARALLEL_SCAN:
+      if (predicates_id_bounds(statement->predicates,
+                               statement->num_predicates, &min_id, &max_id) &&
+          parallel_scan(table, statement, output, min_id, max_id)) {
+        pc = instruction->operand - 1;
+      }
+      break;
+    case OP_OPEN_SCAN:
+      if (!predicates_id_bounds(statement->predicates,
+                                statement->num_predicates, &min_id, &max_id)) {
+        pc = instruction->operand - 1;
+        break;
+      }
+      profile_scan(table, min_id, max_id);
+      cursor = table_find(table, min_id);
+      cursor_read_ahead(cursor);
+      writer = result_writer_open(output, table->output_format);
+      node = get_page(pager, cursor->page_num);
+      break;
+    case OP_FILTER_LEAF:
+      leaf_node_select(node, statement->predicates, statement->num_predicates,
+                       selection);
+      break;
+    case OP_EMIT_SELECTED:
+      for (uint32_t i = cursor->cell_num; i < *leaf_node_num_cells(node);
+           i++) {
+        if (selection[i / 64] & (1ULL << (i % 64))) {
+          result_writer_row(writer, node, i, statement->columns);
+        }
+      }
+      break;
+    case OP_NEXT_LEAF: {
+      uint32_t num_cells = *leaf_node_num_cells(node);
+      bool past_max_id =
+          num_cells > 0 && leaf_node_key(node, num_cells - 1) >= max_id;
+      pager_unpin(pager, cursor->page_num);
+      node = NULL;
+      if (!past_max_id) {
+        cursor_next_leaf(cursor);
+      }
+      if (!past_max_id && !cursor->end_of_table) {
+        node = get_page(pager, cursor->page_num);
+        pc = instruction->operand - 1;
+      }
+      break;
+    }
+    case OP_CLOSE_SCAN:
+      result_writer_close(writer);
+      cursor_close(cursor);
+      break;
+    case OP_AGGREGATE: {
+      uint64_t values[STATEMENT_MAX_AGGREGATES];
+      table_aggregate(table, program, statement, values);
+      writer = result_writer_open(output, table->output_format);
+      result_writer_aggregates(writer, program->aggregates, values,
+                               program->num_aggregates);
+      result_writer_close(writer);
+      break;
+    }
+    }
+  }
+}
+
+// Scan the table for the statement's predicates and columns.
+ExecuteResult execute_select(Statement *statement, Table *table) {
+  Program program;
+  program.num_code = 0;
+  program_emit_scan(&program);
+  return vm_run(&program, statement, table, stdout);
+}
+
+// Run the statement, writing any rows it selects to output.
+ExecuteResult execute_statement_to(Statement *statement, Table *table,
+                                   FILE *output) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ExecuteResult result = vm_run(&statement->program, statement, table, output);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats_record_latency(statement->type,
+                       (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                           end.tv_nsec - start.tv_nsec);
+  return result;
+}
+
+// A point to measure a statement's cost from.
+typedef struct {
+  struct timespec wall;
+  struct rusage usage; // of every thread, scan threads included
+  Stats stats;
+} Snapshot;
+
+void snapshot_take(Snapshot *snapshot) {
+  stats_collect(&snapshot->stats);
+  getrusage(RUSAGE_SELF, &snapshot->usage);
+  clock_gettime(CLOCK_MONOTONIC, &snapshot->wall);
+}
+
+double snapshot_seconds(Snapshot *from, Snapshot *to) {
+  return (to->wall.tv_sec - from->wall.tv_sec) +
+         (to->wall.tv_nsec - from->wall.tv_nsec) / 1e9;
+}
+
+double timeval_seconds(struct timeval *from, struct timeval *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+// Pages read from the db file between the snapshots: buffer-pool misses,
+// or major faults on the mapping.
+uint64_t snapshot_page_reads(Snapshot *from, Snapshot *to) {
+  return to->stats.counters[STAT_PAGE_MISSES] -
+         from->stats.counters[STAT_PAGE_MISSES] + to->usage.ru_majflt -
+         from->usage.ru_majflt;
+}
+
+/*
+ * Run a statement from the REPL. With .timer on, follow its output with
+ * the wall and CPU time it took and the pages it read in.
+ */
+ExecuteResult execute_statement(Statement *statement, Table *table) {
+  if (!table->timer) {
+    return execute_statement_to(statement, table, stdout);
+  }
+
+  Snapshot start, end;
+  snapshot_take(&start);
+  ExecuteResult result = execute_statement_to(statement, table, stdout);
+  fflush(stdout);
+  snapshot_take(&end);
+  printf("Run Time: real %.6f user %.6f sys %.6f page reads %lu\n",
+         snapshot_seconds(&start, &end),
+         timeval_seconds(&start.usage.ru_utime, &end.usage.ru_utime),
+         timeval_seconds(&start.usage.ru_stime, &end.usage.ru_stime),
+         (unsigned long)snapshot_page_reads(&start, &end));
+  return result;
+}
+
+Table *db_open_with_options(char *filename, DbOptions *options) {
+  Pager *pager = pager_open(filename, options);
+
+  // The WAL cannot order write-back of a shared mapping, so mmap mode runs
+  // without it.
+  Wal *wal = NULL;
+  if (options->wal_enabled && pager->mode == PAGER_MODE_BUFFER_POOL) {
+    wal = wal_open(filename, pager, options);
+  }
+  pager->wal = wal;
+
+  Table *table = malloc(sizeof(Table));
+  table->pager = pager;
+  table->output_format = OUTPUT_TUPLE;
+  table->timer = false;
+  table->profile = NULL;
+  table->num_indexes = 0;
+  pthread_mutex_init(&table->writer, NULL);
+  pthread_rwlock_init(&table->tree_latch, NULL);
+  table->scan_pool = NULL;
+  table->scrubber = NULL;
+
+  if (pager->num_pages == 0) {
+    // New database file: the header page, then an empty root leaf.
+    void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+    *(uint32_t *)(header + DB_HEADER_MAGIC_OFFSET) = DB_FILE_MAGIC;
+    *(uint32_t *)(header + DB_HEADER_VERSION_OFFSET) = DB_FILE_VERSION;
+    *(uint32_t *)(header + DB_HEADER_ROOT_PAGE_NUM_OFFSET) =
+        DB_HEADER_PAGE_NUM + 1;
+    *(uint32_t *)(header + DB_HEADER_NUM_INDEXES_OFFSET) = 0;
+    *(uint64_t *)(header + DB_HEADER_NUM_ROWS_OFFSET) = 0;
+    pager_mark_dirty(pager, DB_HEADER_PAGE_NUM);
+    pager_unpin(pager, DB_HEADER_PAGE_NUM);
+
+    void *root_node = get_page(pager, DB_HEADER_PAGE_NUM + 1);
+    initialize_leaf_node(root_node, options->leaf_layout,
+                         options->compress_keys);
+    set_node_root(root_node, true);
+    pager_mark_dirty(pager, DB_HEADER_PAGE_NUM + 1);
+    pager_unpin(pager, DB_HEADER_PAGE_NUM + 1);
+  }
+
+  void *header = get_page(pager, DB_HEADER_PAGE_NUM);
+  if (*(uint32_t *)(header + DB_HEADER_MAGIC_OFFSET) != DB_FILE_MAGIC ||
+      *(uint32_t *)(header + DB_HEADER_VERSION_OFFSET) != DB_FILE_VERSION) {
+    printf("Not a database file, or one from an incompatible version.\n");
+    exit(EXIT_FAILURE);
+  }
+  table->root_page_num =
+      *(uint32_t *)(header + DB_HEADER_ROOT_PAGE_NUM_OFFSET);
+  if (pager->mode == PAGER_MODE_MMAP) {
+    // On disk before any page goes stale, so that a crash before
+    // pager_mmap_close leaves the file marked for the buffer pool to restamp.
+    *(uint32_t *)(header + DB_HEADER_CHECKSUMS_STALE_OFFSET) = 1;
+    pager_flush(pager, DB_HEADER_PAGE_NUM);
+  }
+  pager_unpin(pager, DB_HEADER_PAGE_NUM);
+  db_read_index_catalog(table);
+
+  if (wal != NULL && wal->length > WAL_HEADER_SIZE) {
+    // Redo the rows logged since the checkpoint, then checkpoint so the next
+    // open starts from a clean log.
+    wal->replaying = true;
+    uint32_t offset = 0;
+    while (offset < wal->replay_length) {
+      Statement statement;
+      statement.type = STATEMENT_INSERT;
+      deserialize_row(wal->replay + offset, &statement.row_to_insert);
+      execute_insert(&statement, table);
+      offset += serialized_row_size(wal->replay + offset);
+    }
+    wal->replaying = false;
+    free(wal->replay);
+    wal->replay = NULL;
+    wal->replay_length = 0;
+    db_checkpoint(table);
+  }
+  if (wal != NULL) {
+    wal_flusher_start(wal, &pager->latch);
+  }
+
+  // The mmap pager has no latches, so its scans stay on one thread.
+  uint32_t scan_threads = options->scan_threads > SCAN_MAX_THREADS
+                              ? SCAN_MAX_THREADS
+                              : options->scan_threads;
+  if (scan_threads > 1 && pager->mode == PAGER_MODE_BUFFER_POOL) {
+    table->scan_pool = scan_pool_open(table, scan_threads);
+  }
+  // The mmap pager leaves the checksums stale until it closes the file.
+  if (options->scrub_pages_per_second > 0 &&
+      pager->mode == PAGER_MODE_BUFFER_POOL) {
+    table->scrubber = scrubber_start(pager, options->scrub_pages_per_second);
+  }
+  return table;
+}
+
+Table *db_open(char *filename) {
+  DbOptions options = default_db_options();
+  return db_open_with_options(filename, &options);
+}
+
+/*
+ * Bottom-up B-tree builder for bulk loads into an empty table. Rows arrive in
+ * key order and are packed into fresh leaves; each finished node is pushed
+ * into the open node one level up, so every level is written once, left to
+ * right. When the input ends the top node is copied into the root page.
+ */
+typedef struct {
+  Table *table;
+  LeafLayout leaf_layout;
+  bool compress_keys;
+  uint32_t leaf_capacity;     // bytes past the header per leaf
+  uint32_t internal_capacity; // bytes past the header per internal node
+  uint32_t num_levels;
+  uint32_t open_page[32];  // the node being filled at each level
+  uint32_t open_count[32]; // rows in a leaf, children in an internal node
+  uint32_t open_max_key[32];
+  uint32_t nodes_built[32];
+} TreeBuilder;
+
+void tree_builder_init(TreeBuilder *builder, Table *table,
+                       uint32_t fill_percent) {
+  void *root = get_page(table->pager, table->root_page_num);
+  builder->table = table;
+  builder->leaf_layout = *leaf_node_layout(root);
+  builder->compress_keys = node_keys_compressed(root);
+  builder->leaf_capacity = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+  builder->internal_capacity =
+      INTERNAL_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+  builder->num_levels = 0;
+  pager_unpin(table->pager, table->root_page_num);
+}
+
+// Start a new node at level, pinned until it is pushed up.
+void tree_builder_open(TreeBuilder *builder, uint32_t level) {
+  Pager *pager = builder->table->pager;
+  uint32_t page_num = get_unused_page_num(pager);
+  void *node = get_page(pager, page_num);
+
+  if (level == 0) {
+    initialize_leaf_node(node, builder->leaf_layout, builder->compress_keys);
+    if (builder->num_levels > 0) {
+      void *previous = get_page(pager, builder->open_page[0]);
+      *leaf_node_next_leaf(previous) = page_num;
+      pager_unpin(pager, builder->open_page[0]);
+    }
+  } else {
+    initialize_internal_node(node, builder->compress_keys);
+  }
+  pager_mark_dirty(pager, page_num);
+
+  if (level == builder->num_levels) {
+    builder->num_levels++;
+    builder->nodes_built[level] = 0;
+  }
+  builder->open_page[level] = page_num;
+  builder->open_count[level] = 0;
+  builder->nodes_built[level]++;
+}
+
+void tree_builder_close(TreeBuilder *builder, uint32_t level);
+
+// Whether another child would take the open internal node at level past its
+// capacity. A node always takes at least two children.
+bool tree_builder_internal_full(TreeBuilder *builder, uint32_t level) {
+  Pager *pager = builder->table->pager;
+  uint32_t children[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+  uint32_t keys[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+
+  if (builder->open_count[level] < 2) {
+    return false;
+  }
+
+  void *node = get_page(pager, builder->open_page[level]);
+  uint32_t num_keys = internal_node_load(node, children, keys);
+  keys[num_keys] = builder->open_max_key[level];
+  bool full = internal_node_body_size(node, keys, num_keys + 1) >
+              builder->internal_capacity;
+  pager_unpin(pager, builder->open_page[level]);
+  return full;
+}
+
+/*
+ * Append a finished child to the open node at level. The previous right
+ * child gains a key, its max key, and the new child takes its place.
+ */
+void tree_builder_push(TreeBuilder *builder, uint32_t level,
+                       uint32_t child_page_num, uint32_t child_max_key) {
+  Pager *pager = builder->table->pager;
+
+  if (level == builder->num_levels ||
+      tree_builder_internal_full(builder, level)) {
+    if (level < builder->num_levels) {
+      tree_builder_close(builder, level);
+    }
+    tree_builder_open(builder, level);
+  }
+
+  uint32_t page_num = builder->open_page[level];
+  void *node = get_page(pager, page_num);
+
+  if (builder->open_count[level] > 0) {
+    uint32_t children[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+    uint32_t keys[INTERNAL_NODE_COMPRESSED_MAX_KEYS + 2];
+    uint32_t num_keys = internal_node_load(node, children, keys);
+    keys[num_keys] = builder->open_max_key[level];
+    children[num_keys + 1] = child_page_num;
+    internal_node_store(node, children, keys, num_keys + 1);
+  } else {
+    *internal_node_right_child(node) = child_page_num;
+  }
+  builder->open_count[level]++;
+  builder->open_max_key[level] = child_max_key;
+  pager_unpin(pager, page_num);
+
+  set_page_parent(pager, child_page_num, page_num);
+}
+
+void tree_builder_close(TreeBuilder *builder, uint32_t level) {
+  uint32_t page_num = builder->open_page[level];
+
+  pager_unpin(builder->table->pager, page_num);
+  tree_builder_push(builder, level + 1, page_num,
+                    builder->open_max_key[level]);
+}
+
+void tree_builder_add(TreeBuilder *builder, Row *row) {
+  Pager *pager = builder->table->pager;
+  bool full = builder->num_levels == 0;
+
+  // A leaf always takes at least one row, whatever the fill factor.
+  if (!full && builder->open_count[0] > 0) {
+    void *leaf = get_page(pager, builder->open_page[0]);
+    full = leaf_node_bytes_with(leaf, row) > builder->leaf_capacity;
+    pager_unpin(pager, builder->open_page[0]);
+  }
+  if (full) {
+    if (builder->num_levels > 0) {
+      tree_builder_close(builder, 0);
+    }
+    tree_builder_open(builder, 0);
+  }
+
+  void *leaf = get_page(pager, builder->open_page[0]);
+  leaf_node_insert_row(leaf, *leaf_node_num_cells(leaf), row);
+  builder->open_count[0]++;
+  builder->open_max_key[0] = row->id;
+  pager_unpin(pager, builder->open_page[0]);
+}
+
+/*
+ * Close the open nodes bottom-up until a level holds a single node, and copy
+ * that node into the root page. Its old page is left unused.
+ */
+void tree_builder_finish(TreeBuilder *builder) {
+  Table *table = builder->table;
+  Pager *pager = table->pager;
+
+  if (builder->num_levels == 0) {
+    return;
+  }
+
+  uint32_t level = 0;
+  while (level + 1 < builder->num_levels || builder->nodes_built[level] > 1) {
+    tree_builder_close(builder, level);
+    level++;
+  }
+
+  uint32_t top_page_num = builder->open_page[level];
+  void *top = get_page(pager, top_page_num);
+  void *root = page_latch(pager, table->root_page_num, true);
+  memcpy(root, top, PAGE_SIZE);
+  set_node_root(root, true);
+  *node_parent(root) = 0;
+  pager_mark_dirty(pager, table->root_page_num);
+
+  if (get_node_type(root) == NODE_INTERNAL) {
+    for (uint32_t i = 0; i < *internal_node_num_keys(root); i++) {
+      set_page_parent(pager, *internal_node_child(root, i),
+                      table->root_page_num);
+    }
+    set_page_parent(pager, *internal_node_right_child(root),
+                    table->root_page_num);
+  }
+
+  page_unlatch(pager, table->root_page_num);
+  pager_unpin(pager, top_page_num);
+  pager_unpin(pager, top_page_num);
+}
+
+/*
+ * Where sorted import rows go: straight into a TreeBuilder when the table
+ * started out empty, through the regular insert path otherwise.
+ */
+typedef struct {
+  Table *table;
+  bool bulk;
+  TreeBuilder builder;
+  bool has_last_id;
+  uint32_t last_id;
+  uint64_t imported;
+  uint64_t duplicates;
+} ImportSink;
+
+void import_sink_add(ImportSink *sink, Row *row) {
+  if (sink->has_last_id && row->id == sink->last_id) {
+    sink->duplicates++;
+    return;
+  }
+  sink->has_last_id = true;
+  sink->last_id = row->id;
+
+  if (sink->bulk) {
+    tree_builder_add(&sink->builder, row);
+    sink->imported++;
+    return;
+  }
+
+  switch (table_insert(sink->table, row)) {
+  case (EXECUTE_SUCCESS):
+    sink->imported++;
+    break;
+  case (EXECUTE_DUPLICATE_KEY):
+    sink->duplicates++;
+    break;
+  case (EXECUTE_TABLE_FULL):
+    printf("Error: Table full.\n");
+    exit(EXIT_FAILURE);
+  case (EXECUTE_INDEX_EXISTS):
+  case (EXECUTE_TRANSACTION_OPEN):
+  case (EXECUTE_NO_TRANSACTION):
+  case (EXECUTE_TRANSACTIONS_UNSUPPORTED):
+    // table_insert never creates indexes or opens or closes transactions.
+    printf("Internal error: unexpected result from table_insert.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Split the field at *cursor off the line, unquoting it in place, and move
+ * *cursor to the next field, or to NULL after the last. A quoted field runs
+ * to its closing quote, delimiters included, and "" inside it stands for a
+ * quote. Returns NULL if a quote is left open or followed by anything but
+ * the delimiter or the end of the line.
+ */
+char *import_next_field(char **cursor, char delimiter) {
+  char *field = *cursor;
+
+  if (*field != '"') {
+    char *end = strchr(field, delimiter);
+    *cursor = end == NULL ? NULL : end + 1;
+    if (end != NULL) {
+      *end = '\0';
+    }
+    return field;
+  }
+
+  char *in = field + 1;
+  char *out = field;
+  while (*in != '"' || in[1] == '"') {
+    if (*in == '\0') {
+      return NULL;
+    }
+    in += *in == '"' ? 2 : 1;
+    *out++ = in[-1];
+  }
+  in++;
+  if (*in == delimiter) {
+    *cursor = in + 1;
+  } else if (*in == '\0') {
+    *cursor = NULL;
+  } else {
+    return NULL;
+  }
+  *out = '\0';
+  return field;
+}
+
+/*
+ * Parse one "id,username,email" line (tab separated for TSV) into row.
+ * Fields may be wrapped in double quotes. Returns false if the line is
+ * malformed.
+ */
+bool import_parse_line(char *line, char delimiter, Row *row) {
+  char *fields[3];
+  uint32_t num_fields = 0;
+  char *cursor = line;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  while (cursor != NULL) {
+    char *field = import_next_field(&cursor, delimiter);
+    if (field == NULL || num_fields == 3) {
+      return false;
+    }
+    fields[num_fields++] = field;
+  }
+  if (num_fields != 3) {
+    return false;
+  }
+
+  char *end;
+  errno = 0;
+  unsigned long id = strtoul(fields[0], &end, 10);
+  if (fields[0][0] < '0' || fields[0][0] > '9' || *end != '\0' ||
+      errno != 0 || id > UINT32_MAX) {
+    return false;
+  }
+
+  size_t username_length = strlen(fields[1]);
+  size_t email_length = strlen(fields[2]);
+  if (username_length > COLUMN_USERNAME_SIZE ||
+      email_length > COLUMN_EMAIL_SIZE) {
+    return false;
+  }
+
+  memset(row, 0, sizeof(Row));
+  row->id = id;
+  memcpy(row->username, fields[1], username_length);
+  memcpy(row->email, fields[2], email_length);
+  return true;
+}
+
+/*
+ * Reads rows from an import file. The delimiter is a tab if the first line
+ * has one, a comma otherwise, and a first line that does not parse as a row
+ * is taken to be a header.
+ */
+typedef struct {
+  FILE *file;
+  char *line;
+  size_t line_capacity;
+  uint64_t line_num;
+  char delimiter;
+} ImportReader;
+
+bool import_reader_open(ImportReader *reader, const char *path) {
+  reader->file = fopen(path, "r");
+  reader->line = NULL;
+  reader->line_capacity = 0;
+  reader->line_num = 0;
+  reader->delimiter = ',';
+
+  if (reader->file == NULL) {
+    return false;
+  }
+
+  if (getline(&reader->line, &reader->line_capacity, reader->file) != -1) {
+    if (strchr(reader->line, '\t') != NULL) {
+      reader->delimiter = '\t';
+    }
+    Row row;
+    if (import_parse_line(reader->line, reader->delimiter, &row)) {
+      rewind(reader->file);
+    } else {
+      reader->line_num++;
+    }
+  }
+  return true;
+}
+
+// 1 on a row, 0 at the end of the file, -1 on a malformed line.
+int import_reader_next(ImportReader *reader, Row *row) {
+  while (getline(&reader->line, &reader->line_capacity, reader->file) != -1) {
+    reader->line_num++;
+    if (reader->line[strspn(reader->line, " \r\n")] == '\0') {
+      continue;
+    }
+    return import_parse_line(reader->line, reader->delimiter, row) ? 1 : -1;
+  }
+  return 0;
+}
+
+void import_reader_close(ImportReader *reader) {
+  fclose(reader->file);
+  free(reader->line);
+}
+
+int compare_rows_by_id(const void *a, const void *b) {
+  uint32_t left = ((Row *)a)->id;
+  uint32_t right = ((Row *)b)->id;
+  return (left > right) - (left < right);
+}
+
+typedef struct {
+  FILE *file;
+  Row *rows;
+  uint32_t num_rows;
+  uint32_t next;
+} ImportRun;
+
+bool import_run_fill(ImportRun *run) {
+  if (run->next == run->num_rows) {
+    run->num_rows =
+        fread(run->rows, sizeof(Row), IMPORT_MERGE_BUFFER_ROWS, run->file);
+    run->next = 0;
+  }
+  return run->next < run->num_rows;
+}
+
+uint32_t import_run_head(ImportRun *runs, uint32_t *heap, uint32_t i) {
+  ImportRun *run = &runs[heap[i]];
+  return run->rows[run->next].id;
+}
+
+// Restore the min-heap of runs, keyed by their next row's id, below parent.
+void import_heap_sift_down(ImportRun *runs, uint32_t *heap, uint32_t heap_size,
+                           uint32_t parent) {
+  while (true) {
+    uint32_t smallest = parent;
+    uint32_t left = 2 * parent + 1;
+    uint32_t right = left + 1;
+
+    if (left < heap_size && import_run_head(runs, heap, left) <
+                                import_run_head(runs, heap, smallest)) {
+      smallest = left;
+    }
+    if (right < heap_size && import_run_head(runs, heap, right) <
+                                 import_run_head(runs, heap, smallest)) {
+      smallest = right;
+    }
+    if (smallest == parent) {
+      return;
+    }
+
+    uint32_t swap = heap[parent];
+    heap[parent] = heap[smallest];
+    heap[smallest] = swap;
+    parent = smallest;
+  }
+}
+
+/*
+ * Sort an unsorted input into sink. Inputs that fit in one run are sorted in
+ * memory; larger ones are cut into sorted runs spilled to temporary files,
+ * then merged through a min-heap of run heads.
+ */
+void import_sort(ImportReader *reader, ImportSink *sink) {
+  Row *rows = malloc(IMPORT_RUN_ROWS * sizeof(Row));
+  ImportRun *runs = NULL;
+  uint32_t num_runs = 0;
+  uint32_t num_rows = 0;
+  bool done = false;
+
+  while (!done) {
+    num_rows = 0;
+    while (num_rows < IMPORT_RUN_ROWS &&
+           import_reader_next(reader, &rows[num_rows]) == 1) {
+      num_rows++;
+    }
+    done = num_rows < IMPORT_RUN_ROWS;
+    qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+
+    if (done && num_runs == 0) {
+      break;
+    }
+
+    runs = realloc(runs, (num_runs + 1) * sizeof(ImportRun));
+    ImportRun *run = &runs[num_runs++];
+    run->file = tmpfile();
+    if (run->file == NULL ||
+        fwrite(rows, sizeof(Row), num_rows, run->file) != num_rows) {
+      printf("Error writing import run: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    rewind(run->file);
+  }
+
+  if (num_runs == 0) {
+    for (uint32_t i = 0; i < num_rows; i++) {
+      import_sink_add(sink, &rows[i]);
+    }
+    free(rows);
+    return;
+  }
+  free(rows);
+
+  uint32_t *heap = malloc(num_runs * sizeof(uint32_t));
+  uint32_t heap_size = 0;
+  for (uint32_t i = 0; i < num_runs; i++) {
+    runs[i].rows = malloc(IMPORT_MERGE_BUFFER_ROWS * sizeof(Row));
+    runs[i].num_rows = 0;
+    runs[i].next = 0;
+    if (import_run_fill(&runs[i])) {
+      heap[heap_size++] = i;
+    }
+  }
+  for (int64_t i = heap_size / 2 - 1; i >= 0; i--) {
+    import_heap_sift_down(runs, heap, heap_size, i);
+  }
+
+  while (heap_size > 0) {
+    ImportRun *run = &runs[heap[0]];
+    import_sink_add(sink, &run->rows[run->next++]);
+
+    if (!import_run_fill(run)) {
+      heap[0] = heap[--heap_size];
+    }
+    import_heap_sift_down(runs, heap, heap_size, 0);
+  }
+
+  for (uint32_t i = 0; i < num_runs; i++) {
+    fclose(runs[i].file);
+    free(runs[i].rows);
+  }
+  free(heap);
+  free(runs);
+}
+
+/*
+ * Load a CSV/TSV file of id,username,email rows. A first pass validates
+ * every line and checks whether ids already ascend; sorted input is then
+ * streamed straight into the tree, anything else goes through import_sort.
+ * Into an empty table the tree is built bottom-up with leaves filled to
+ * fill_percent, bypassing the WAL, and checkpointed once at the end.
+ */
+void import_file(Table *table, const char *path, uint32_t fill_percent) {
+  ImportReader reader;
+  Row row;
+  int status;
+  bool sorted = true;
+  bool has_previous = false;
+  uint32_t previous_id = 0;
+
+  if (!import_reader_open(&reader, path)) {
+    printf("Unable to open '%s' for import.\n", path);
+    return;
+  }
+  while ((status = import_reader_next(&reader, &row)) == 1) {
+    sorted = sorted && (!has_previous || row.id >= previous_id);
+    has_previous = true;
+    previous_id = row.id;
+  }
+  if (status == -1) {
+    printf("Import failed: cannot parse line %lu of '%s'.\n",
+           (unsigned long)reader.line_num, path);
+    import_reader_close(&reader);
+    return;
+  }
+  import_reader_close(&reader);
+  import_reader_open(&reader, path);
+
+  pthread_mutex_lock(&table->writer);
+  ImportSink sink;
+  sink.table = table;
+  sink.has_last_id = false;
+  sink.imported = 0;
+  sink.duplicates = 0;
+
+  void *root = get_page(table->pager, table->root_page_num);
+  sink.bulk =
+      get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+  pager_unpin(table->pager, table->root_page_num);
+
+  if (sink.bulk) {
+    tree_builder_init(&sink.builder, table, fill_percent);
+  }
+
+  if (sorted) {
+    while (import_reader_next(&reader, &row) == 1) {
+      import_sink_add(&sink, &row);
+    }
+  } else {
+    import_sort(&reader, &sink);
+  }
+  import_reader_close(&reader);
+
+  // Bulk-built pages never went through the WAL; checkpointing makes them
+  // durable. Until then, recovery rolls the table back to empty.
+  if (sink.bulk) {
+    tree_builder_finish(&sink.builder);
+    table_add_rows(table, sink.imported);
+    for (uint32_t i = 0; i < table->num_indexes; i++) {
+      index_fill(table, &table->indexes[i]);
+    }
+    if (table->pager->wal != NULL) {
+      db_checkpoint(table);
+    }
+  }
+  pthread_mutex_unlock(&table->writer);
+
+  printf("Imported %lu rows", (unsigned long)sink.imported);
+  if (sink.duplicates > 0) {
+    printf(", skipped %lu duplicate ids", (unsigned long)sink.duplicates);
+  }
+  printf(".\n");
+}
+
+// Prepare the input as a statement, or tell output why it cannot be run.
+bool prepare_input(InputBuffer *input_buffer, Statement *statement,
+                   StatementCache *cache, FILE *output) {
+  switch (prepare_statement_cached(input_buffer, statement, cache)) {
+  case (PREPARE_SUCCESS):
+    return true;
+  case (PREPARE_STRING_TOO_LONG):
+    fprintf(output, "String is too log. \n");
+    return false;
+  case (PREPARE_NEGATIVE_ID):
+    fprintf(output, "ID must be positive.\n");
+    return false;
+
+  case (PREPARE_SYNTAX_ERROR):
+    fprintf(output, "Syntax error bih cannot parse 🧙🏻‍♀️");
+  case (PREPARE_UNRECOGNISED_STATEMENT):
+    fprintf(output, "Unrecognised keyword at start of '%s' . \n",
+            input_buffer->buffer);
+    return false;
+  }
+  return false;
+}
+
+void report_execute_result(ExecuteResult result, FILE *output) {
+  switch (result) {
+  case (EXECUTE_SUCCESS):
+    fprintf(output, "Executed. \n");
+    break;
+  case (EXECUTE_TABLE_FULL):
+    fprintf(output, "Error: Table full.\n");
+    break;
+  case (EXECUTE_DUPLICATE_KEY):
+    fprintf(output, "Error: Duplicate key.\n");
+    break;
+  case (EXECUTE_INDEX_EXISTS):
+    fprintf(output, "Error: Index already exists.\n");
+    break;
+  case (EXECUTE_TRANSACTION_OPEN):
+    fprintf(output, "Error: A transaction is already open.\n");
+    break;
+  case (EXECUTE_NO_TRANSACTION):
+    fprintf(output, "Error: No transaction is open.\n");
+    break;
+  case (EXECUTE_TRANSACTIONS_UNSUPPORTED):
+    fprintf(output, "Error: Transactions need the buffer pool, not --mmap.\n");
+    break;
+  }
+}
+
+/*
+ * Run the statement after "explain analyze " and report how: the access
+ * path, pages touched at each level of the tree, rows examined and
+ * returned, and time spent parsing, executing, and writing out the rows.
+ * Rows are formatted into a buffer while the statement executes, so output
+ * is the time to hand that buffer to stdout.
+ */
+void explain_analyze(InputBuffer *input_buffer, Table *table,
+                     StatementCache *cache) {
+  InputBuffer statement_input = *input_buffer;
+  statement_input.buffer += strlen("explain analyze ");
+  statement_input.input_length -= strlen("explain analyze ");
+
+  Profile profile;
+  memset(&profile, 0, sizeof(profile));
+  strcpy(profile.access_path, "none");
+  Snapshot start, parsed, executed, end;
+  Statement statement;
+
+  snapshot_take(&start);
+  if (!prepare_input(&statement_input, &statement, cache, stdout)) {
+    return;
+  }
+  snapshot_take(&parsed);
+  char *rows;
+  size_t rows_length;
+  FILE *output = open_memstream(&rows, &rows_length);
+  table->profile = &profile;
+  ExecuteResult result = execute_statement_to(&statement, table, output);
+  table->profile = NULL;
+  fclose(output);
+  snapshot_take(&executed);
+  fwrite(rows, 1, rows_length, stdout);
+  fflush(stdout);
+  snapshot_take(&end);
+  free(rows);
+  report_execute_result(result, stdout);
+
+  Stats *before = &parsed.stats;
+  Stats *after = &executed.stats;
+  printf("Access path: %s\n", profile.access_path);
+  printf("Pages touched:");
+  for (uint32_t level = 0; level < TREE_MAX_DEPTH; level++) {
+    if (profile.pages_per_level[level] > 0) {
+      printf(" level %d: %lu,", level,
+             (unsigned long)profile.pages_per_level[level]);
+    }
+  }
+  printf(" index: %lu\n", (unsigned long)profile.index_pages);
+  printf("Page reads: %lu\n", (unsigned long)snapshot_page_reads(&parsed,
+                                                                  &executed));
+  printf("Rows examined: %lu, returned: %lu\n",
+         (unsigned long)(after->counters[STAT_ROWS_SCANNED] -
+                         before->counters[STAT_ROWS_SCANNED]),
+         (unsigned long)(after->counters[STAT_ROWS_RETURNED] -
+                         before->counters[STAT_ROWS_RETURNED]));
+  printf("Time: parse %.6f, execute %.6f, output %.6f\n",
+         snapshot_seconds(&start, &parsed),
+         snapshot_seconds(&parsed, &executed),
+         snapshot_seconds(&executed, &end));
+}
+
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
+  if (strcmp(input_buffer->buffer, ".exit") == 0) {
+    db_close(table);
+    exit(EXIT_SUCCESS);
+  } else if (strcmp(input_buffer->buffer, ".help") == 0) {
+    printf("None Yet!\n");
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".check") == 0) {
+    if (table->pager->mode == PAGER_MODE_MMAP) {
+      printf("Checksums are only kept up to date by the buffer pool.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    db_check(table);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".stats", 6) == 0) {
+    strtok(input_buffer->buffer, " ");
+    char *option = strtok(NULL, " ");
+    if (option == NULL || strcmp(option, "json") == 0) {
+      stats_print(table, option != NULL);
+    } else if (strcmp(option, "reset") == 0) {
+      stats_reset();
+    } else {
+      printf("Usage: .stats [json|reset]\n");
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".timer", 6) == 0) {
+    strtok(input_buffer->buffer, " ");
+    char *setting = strtok(NULL, " ");
+    if (setting != NULL && strcmp(setting, "on") == 0) {
+      table->timer = true;
+    } else if (setting != NULL && strcmp(setting, "off") == 0) {
+      table->timer = false;
+    } else {
+      printf("Usage: .timer on|off\n");
+    }
     return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
     printf("Tree\n");
-    print_leaf_node(get_page(table->pager, 0));
+    print_tree(table->pager, table->root_page_num, 0);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+    strtok(input_buffer->buffer, " ");
+    char *path = strtok(NULL, " ");
+    char *fill = strtok(NULL, " ");
+    uint32_t fill_percent = fill ? atoi(fill) : IMPORT_DEFAULT_FILL_PERCENT;
+
+    if (path == NULL || fill_percent < 1 || fill_percent > 100) {
+      printf("Usage: .import FILE [FILL_PERCENT]\n");
+      return META_COMMAND_SUCCESS;
+    }
+    if (table->pager->transaction != NULL) {
+      printf("Error: A transaction is already open.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    import_file(table, path, fill_percent);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".mode", 5) == 0) {
+    strtok(input_buffer->buffer, " ");
+    char *name = strtok(NULL, " ");
+    if (name == NULL) {
+      printf("%s\n", OUTPUT_FORMAT_NAMES[table->output_format]);
+    } else if (!parse_output_format(name, &table->output_format)) {
+      printf("Usage: .mode tuple|csv|tsv|json|binary\n");
+    }
     return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
     printf("Constants\n");
@@ -362,179 +7281,586 @@ MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
   }
 }
 
-InputBuffer *new_input_buffer() {
-  InputBuffer *input_buffer = malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
+/*
+ * Server Protocol
+ *
+ * With --serve, clients send one statement per request over a Unix-domain
+ * socket and get back the text the REPL would have printed for it. Both
+ * directions frame a message as a 4-byte big-endian length and then that
+ * many bytes.
+ */
+const uint32_t SERVER_FRAME_HEADER_SIZE = sizeof(uint32_t);
+const uint32_t SERVER_MAX_REQUEST_SIZE = 64 * 1024;
 
-  return input_buffer;
-};
+typedef struct Connection {
+  int fd;
+  uint8_t *in; // received bytes not yet handed to a worker
+  uint32_t in_used;
+  char *request; // the statement a worker is running, NUL-terminated
+  char *out;     // the response frame being sent
+  size_t out_length;
+  size_t out_sent;
+  bool busy;      // a worker has its request
+  bool hung_up;   // the peer left while a worker had its request
+  uint32_t watch; // the epoll events the loop waits for
+  struct Connection *next;      // in the server's work or done queue
+  struct Connection *next_open; // in the list of open connections
+  struct Connection *previous_open;
+} Connection;
 
-PrepareResult prepare_statement(InputBuffer *input_buffer,
-                                Statement *statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    statement->type = STATEMENT_INSERT;
+/*
+ * One thread runs the event loop, reading requests and writing responses;
+ * a pool of workers runs the statements. Each connection has at most one
+ * request with the workers at a time, so its responses come back in order.
+ */
+typedef struct {
+  Table *table;
+  const char *path;
+  int listen_fd;
+  int epoll_fd;
+  int wake_fd;   // an eventfd the workers bump when a response is ready
+  int signal_fd; // SIGINT and SIGTERM, which stop the server
+  uint32_t num_workers;
+  pthread_t workers[SERVER_MAX_WORKERS];
+  Connection *open;
+  // Guards the queues and stopping.
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  Connection *work_head;
+  Connection *work_tail;
+  Connection *done;
+  bool stopping;
+  // Held while a statement that writes runs, so that a transaction stays
+  // with the connection that began it.
+  pthread_mutex_t session;
+  Connection *transaction_owner;
+} Server;
+
+void server_watch(Server *server, int fd, void *data) {
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = data;
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    printf("Error watching socket: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
 
-    int args_assigned = sscanf(
-        input_buffer->buffer, "insert %d %s %s", &(statement->row_to_insert.id),
-        statement->row_to_insert.username, statement->row_to_insert.email);
+bool server_stopping(Server *server) {
+  pthread_mutex_lock(&server->lock);
+  bool stopping = server->stopping;
+  pthread_mutex_unlock(&server->lock);
+  return stopping;
+}
+
+/*
+ * Run one request, writing the response frame into the connection. Selects
+ * run side by side; statements that write take the session lock, and are
+ * turned away while another connection has a transaction open.
+ */
+void server_execute(Server *server, Connection *connection,
+                    StatementCache *cache) {
+  char *response;
+  size_t length;
+  FILE *output = open_memstream(&response, &length);
+  uint8_t header[SERVER_FRAME_HEADER_SIZE];
+  fwrite(header, 1, SERVER_FRAME_HEADER_SIZE, output);
 
-    if (args_assigned < 3) {
-      return PREPARE_SYNTAX_ERROR;
+  InputBuffer input_buffer;
+  input_buffer.buffer = connection->request;
+  input_buffer.input_length = strlen(connection->request);
+  input_buffer.buffer_length = input_buffer.input_length + 1;
+
+  Statement statement;
+  if (input_buffer.buffer[0] == '.') {
+    // Meta commands act on the REPL's own process, so they stay there.
+    fprintf(output, "Unrecognised command '%s' .\n", input_buffer.buffer);
+  } else if (prepare_input(&input_buffer, &statement, cache, output)) {
+    ExecuteResult result;
+    if (statement.program.type == STATMENT_SELECT) {
+      result = execute_statement_to(&statement, server->table, output);
+    } else {
+      pthread_mutex_lock(&server->session);
+      if (server->transaction_owner != NULL &&
+          server->transaction_owner != connection) {
+        result = EXECUTE_TRANSACTION_OPEN;
+      } else {
+        result = execute_statement_to(&statement, server->table, output);
+        server->transaction_owner =
+            server->table->pager->transaction != NULL ? connection : NULL;
+      }
+      pthread_mutex_unlock(&server->session);
     }
-    return PREPARE_SUCCESS;
+    report_execute_result(result, output);
   }
+  fclose(output);
+
+  uint32_t body_length = htonl(length - SERVER_FRAME_HEADER_SIZE);
+  memcpy(response, &body_length, SERVER_FRAME_HEADER_SIZE);
+  connection->out = response;
+  connection->out_length = length;
+  connection->out_sent = 0;
+  free(connection->request);
+  connection->request = NULL;
+}
+
+void *server_worker(void *argument) {
+  Server *server = argument;
+  StatementCache *cache = calloc(1, sizeof(StatementCache));
+
+  for (;;) {
+    pthread_mutex_lock(&server->lock);
+    while (!server->stopping && server->work_head == NULL) {
+      pthread_cond_wait(&server->work_ready, &server->lock);
+    }
+    Connection *connection = server->work_head;
+    if (connection == NULL) {
+      pthread_mutex_unlock(&server->lock);
+      break;
+    }
+    server->work_head = connection->next;
+    pthread_mutex_unlock(&server->lock);
+
+    server_execute(server, connection, cache);
 
-  if (strncmp(input_buffer->buffer, "select", 6) == 0) {
-    statement->type = STATMENT_SELECT;
-    return PREPARE_SUCCESS;
+    pthread_mutex_lock(&server->lock);
+    connection->next = server->done;
+    server->done = connection;
+    pthread_mutex_unlock(&server->lock);
+    uint64_t one = 1;
+    if (write(server->wake_fd, &one, sizeof(one)) == -1) {
+      printf("Error waking server: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
   }
 
-  return PREPARE_UNRECOGNISED_STATEMENT;
+  free(cache);
+  return NULL;
 }
 
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement) {
-  statement->type = STATEMENT_INSERT;
+Server *server_open(Table *table, const char *path) {
+  Server *server = calloc(1, sizeof(Server));
+  server->table = table;
+  server->path = path;
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->work_ready, NULL);
+  pthread_mutex_init(&server->session, NULL);
 
-  char *keyword = strtok(input_buffer->buffer, " ");
-  char *id_string = strtok(NULL, " ");
-  char *username = strtok(NULL, " ");
-  char *email = strtok(NULL, " ");
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Socket path '%s' is too long.\n", path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(address.sun_path, path);
 
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+  // A socket file left behind by an earlier server would make bind fail.
+  unlink(path);
+  server->listen_fd =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server->listen_fd == -1 ||
+      bind(server->listen_fd, (struct sockaddr *)&address,
+           sizeof(address)) == -1 ||
+      listen(server->listen_fd, SERVER_LISTEN_BACKLOG) == -1) {
+    printf("Unable to listen on '%s': %d\n", path, errno);
+    exit(EXIT_FAILURE);
   }
 
-  int id = atoi(id_string);
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  // Block the stop signals before starting the workers, so that they
+  // inherit the mask and only the event loop hears them.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  server->signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (server->epoll_fd == -1 || server->wake_fd == -1 ||
+      server->signal_fd == -1) {
+    printf("Error setting up the event loop: %d\n", errno);
+    exit(EXIT_FAILURE);
   }
+  server_watch(server, server->listen_fd, &server->listen_fd);
+  server_watch(server, server->wake_fd, &server->wake_fd);
+  server_watch(server, server->signal_fd, &server->signal_fd);
 
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  server->num_workers =
+      num_cpus < 1 ? 1
+                   : (num_cpus > SERVER_MAX_WORKERS ? SERVER_MAX_WORKERS
+                                                    : num_cpus);
+  for (uint32_t i = 0; i < server->num_workers; i++) {
+    pthread_create(&server->workers[i], NULL, server_worker, server);
   }
+  return server;
+}
 
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
+// Let go of a connection for good. A transaction it left open is rolled
+// back.
+void server_release(Server *server, Connection *connection) {
+  pthread_mutex_lock(&server->session);
+  if (server->transaction_owner == connection) {
+    db_rollback(server->table);
+    server->transaction_owner = NULL;
+  }
+  pthread_mutex_unlock(&server->session);
 
-  return PREPARE_SUCCESS;
+  if (connection->previous_open != NULL) {
+    connection->previous_open->next_open = connection->next_open;
+  } else {
+    server->open = connection->next_open;
+  }
+  if (connection->next_open != NULL) {
+    connection->next_open->previous_open = connection->previous_open;
+  }
+  free(connection->in);
+  free(connection->request);
+  free(connection->out);
+  free(connection);
 }
 
-void print_start_screen() {
-  printf("   ____   ____   _      \n");
-  printf("  / ___| / __ \\ | |     \n");
-  printf(" | (___ | |  | || |     \n");
-  printf("  \\___ \\| |  | || |     \n");
-  printf("  ____) | |__| || |____ \n");
-  printf(" |_____/ \\____/ |______|\n");
-  printf("             |          \n");
-  printf("             Q          \n");
-  printf("       OurSQL-BIH REPL ENGINE\n");
-  printf("       Respectfully... run your queries\n");
-  printf("       Version 0.1.0-dev\n\n");
-
-  printf("Type '.help' for options.\n");
-  printf("Type '.exit' to leave this madness.\n");
+// Close the socket. The connection itself waits for its request, if a
+// worker has one.
+void server_drop(Server *server, Connection *connection) {
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  if (connection->busy) {
+    connection->hung_up = true;
+  } else {
+    server_release(server, connection);
+  }
 }
 
-void print_prompt() { printf("f_yeah_db 🤞🏾> "); }
+void server_accept(Server *server) {
+  for (;;) {
+    int fd = accept4(server->listen_fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      return;
+    }
 
-void read_input(InputBuffer *input_buffer) {
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+    Connection *connection = calloc(1, sizeof(Connection));
+    connection->fd = fd;
+    connection->in =
+        malloc(SERVER_FRAME_HEADER_SIZE + SERVER_MAX_REQUEST_SIZE);
+    connection->watch = EPOLLIN;
+    connection->next_open = server->open;
+    if (server->open != NULL) {
+      server->open->previous_open = connection;
+    }
+    server->open = connection;
+    server_watch(server, fd, connection);
+  }
+}
 
-  if (bytes_read <= 0) {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+/*
+ * Hand the next buffered request to the workers when the connection is
+ * free, then wait on the socket for whatever the connection needs next:
+ * nothing while a worker has it, room to send a response, or a request.
+ */
+void server_update(Server *server, Connection *connection) {
+  uint32_t length = 0;
+  if (connection->in_used >= SERVER_FRAME_HEADER_SIZE) {
+    memcpy(&length, connection->in, SERVER_FRAME_HEADER_SIZE);
+    length = ntohl(length);
   }
 
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
-};
+  if (!connection->busy && connection->out == NULL &&
+      connection->in_used >= SERVER_FRAME_HEADER_SIZE + length &&
+      connection->in_used >= SERVER_FRAME_HEADER_SIZE &&
+      !server_stopping(server)) {
+    connection->request = malloc(length + 1);
+    memcpy(connection->request, connection->in + SERVER_FRAME_HEADER_SIZE,
+           length);
+    connection->request[length] = '\0';
+    connection->in_used -= SERVER_FRAME_HEADER_SIZE + length;
+    memmove(connection->in, connection->in + SERVER_FRAME_HEADER_SIZE + length,
+            connection->in_used);
+    connection->busy = true;
 
-Cursor *table_start(Table *table) {
-  Cursor *cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
+    pthread_mutex_lock(&server->lock);
+    connection->next = NULL;
+    if (server->work_head == NULL) {
+      server->work_head = connection;
+    } else {
+      server->work_tail->next = connection;
+    }
+    server->work_tail = connection;
+    pthread_cond_signal(&server->work_ready);
+    pthread_mutex_unlock(&server->lock);
+  }
 
-  cursor->page_num = table->root_page_num;
-  cursor->cell_num = 0;
+  uint32_t watch = connection->busy ? 0
+                   : connection->out != NULL ? EPOLLOUT
+                                             : EPOLLIN;
+  if (watch != connection->watch) {
+    struct epoll_event event;
+    event.events = watch;
+    event.data.ptr = connection;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->watch = watch;
+  }
+}
 
-  void *root_node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = *leaf_node_num_cells(root_node);
-  cursor->end_of_table = num_cells == 0;
+// Read what has arrived. Returns false if the connection was dropped.
+bool server_receive(Server *server, Connection *connection) {
+  uint32_t capacity = SERVER_FRAME_HEADER_SIZE + SERVER_MAX_REQUEST_SIZE;
 
-  return cursor;
+  while (connection->in_used < capacity) {
+    ssize_t bytes_read = read(connection->fd, connection->in + connection->in_used,
+                              capacity - connection->in_used);
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EINTR)) {
+      break;
+    }
+    if (bytes_read <= 0) {
+      server_drop(server, connection);
+      return false;
+    }
+    connection->in_used += bytes_read;
+  }
+
+  uint32_t length;
+  memcpy(&length, connection->in, SERVER_FRAME_HEADER_SIZE);
+  if (connection->in_used >= SERVER_FRAME_HEADER_SIZE &&
+      ntohl(length) > SERVER_MAX_REQUEST_SIZE) {
+    server_drop(server, connection);
+    return false;
+  }
+  return true;
 }
 
-Cursor *table_end(Table *table) {
-  Cursor *cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
+// Send what the socket will take. Returns false if the connection was
+// dropped.
+bool server_send(Server *server, Connection *connection) {
+  while (connection->out_sent < connection->out_length) {
+    ssize_t bytes_sent =
+        send(connection->fd, connection->out + connection->out_sent,
+             connection->out_length - connection->out_sent, MSG_NOSIGNAL);
+    if (bytes_sent == -1 && (errno == EAGAIN || errno == EINTR)) {
+      return true;
+    }
+    if (bytes_sent == -1) {
+      server_drop(server, connection);
+      return false;
+    }
+    connection->out_sent += bytes_sent;
+  }
 
-  cursor->page_num = table->root_page_num;
+  free(connection->out);
+  connection->out = NULL;
+  return true;
+}
 
-  void *root_node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = *leaf_node_num_cells(root_node);
-  cursor->cell_num = num_cells;
-  cursor->end_of_table = true;
+// Pick up the responses the workers have finished.
+void server_collect(Server *server) {
+  uint64_t count;
+  if (read(server->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+    printf("Error reading eventfd: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
 
-  return cursor;
+  pthread_mutex_lock(&server->lock);
+  Connection *connection = server->done;
+  server->done = NULL;
+  pthread_mutex_unlock(&server->lock);
+
+  while (connection != NULL) {
+    Connection *next = connection->next;
+    connection->busy = false;
+    if (connection->hung_up) {
+      server_release(server, connection);
+    } else if (server_send(server, connection)) {
+      server_update(server, connection);
+    }
+    connection = next;
+  }
 }
 
-void *cursor_value(Cursor *cursor) {
-  uint32_t page_num = cursor->page_num;
+void server_stop(Server *server) {
+  pthread_mutex_lock(&server->lock);
+  server->stopping = true;
+  pthread_mutex_unlock(&server->lock);
 
-  void *page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
+  uint64_t one = 1;
+  if (write(server->wake_fd, &one, sizeof(one)) == -1) {
+    printf("Error waking server: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
 }
 
-void cursor_advance(Cursor *cursor) {
-  uint32_t page_num = cursor->page_num;
-  void *node = get_page(cursor->table->pager, page_num);
+// The event loop. Returns once server_stop is called or a stop signal
+// arrives.
+void server_run(Server *server) {
+  struct epoll_event events[SERVER_MAX_EVENTS];
 
-  cursor->cell_num += 1;
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    cursor->end_of_table = true;
+  while (!server_stopping(server)) {
+    int num_events =
+        epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, -1);
+    if (num_events == -1 && errno == EINTR) {
+      continue;
+    }
+    if (num_events == -1) {
+      printf("Error waiting for events: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      void *data = events[i].data.ptr;
+      if (data == &server->listen_fd) {
+        server_accept(server);
+      } else if (data == &server->wake_fd) {
+        server_collect(server);
+      } else if (data == &server->signal_fd) {
+        struct signalfd_siginfo signal_info;
+        if (read(server->signal_fd, &signal_info, sizeof(signal_info)) > 0) {
+          server_stop(server);
+        }
+      } else {
+        Connection *connection = data;
+        uint32_t happened = events[i].events;
+        if (happened & EPOLLIN) {
+          if (!server_receive(server, connection)) {
+            continue;
+          }
+        } else if (happened & (EPOLLHUP | EPOLLERR)) {
+          server_drop(server, connection);
+          continue;
+        }
+        if ((happened & EPOLLOUT) && !server_send(server, connection)) {
+          continue;
+        }
+        server_update(server, connection);
+      }
+    }
   }
 }
 
-ExecuteResult execute_insert(Statement *statement, Table *table) {
-  void *node = get_page(table->pager, table->root_page_num);
-  if (*(leaf_node_num_cells(node)) >= LEAF_NODE_MAX_CELLS) {
-    return EXECUTE_TABLE_FULL;
+// Finish the requests the workers have, then close every connection,
+// rolling back a transaction one left open. The table stays open.
+void server_close(Server *server) {
+  server_stop(server);
+  pthread_mutex_lock(&server->lock);
+  pthread_cond_broadcast(&server->work_ready);
+  pthread_mutex_unlock(&server->lock);
+  for (uint32_t i = 0; i < server->num_workers; i++) {
+    pthread_join(server->workers[i], NULL);
+  }
+
+  server_collect(server);
+  while (server->open != NULL) {
+    server_drop(server, server->open);
   }
 
-  Row *row_to_insert = &(statement->row_to_insert);
-  Cursor *cursor = table_end(table);
+  close(server->listen_fd);
+  close(server->epoll_fd);
+  close(server->wake_fd);
+  close(server->signal_fd);
+  unlink(server->path);
+  pthread_mutex_destroy(&server->lock);
+  pthread_cond_destroy(&server->work_ready);
+  pthread_mutex_destroy(&server->session);
+  free(server);
+}
 
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+int client_connect(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
 
-  free(cursor);
-  return EXECUTE_SUCCESS;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 ||
+      connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    printf("Unable to connect to '%s': %d\n", path, errno);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
 }
 
-ExecuteResult execute_select(Statement *statement, Table *table) {
-  Cursor *cursor = table_start(table);
+bool read_all(int fd, void *data, size_t length) {
+  while (length > 0) {
+    ssize_t bytes_read = read(fd, data, length);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      return false;
+    }
+    data += bytes_read;
+    length -= bytes_read;
+  }
+  return true;
+}
 
-  Row row;
+bool write_all(int fd, const void *data, size_t length) {
+  while (length > 0) {
+    ssize_t bytes_written = send(fd, data, length, MSG_NOSIGNAL);
+    if (bytes_written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_written == -1) {
+      return false;
+    }
+    data += bytes_written;
+    length -= bytes_written;
+  }
+  return true;
+}
+
+/*
+ * Send one statement and wait for the response, which is returned
+ * NUL-terminated in a malloc'd buffer. NULL if the server went away.
+ */
+char *client_request(int fd, const char *text, uint32_t *length) {
+  uint32_t header = htonl(strlen(text));
+  if (!write_all(fd, &header, SERVER_FRAME_HEADER_SIZE) ||
+      !write_all(fd, text, strlen(text)) ||
+      !read_all(fd, &header, SERVER_FRAME_HEADER_SIZE)) {
+    return NULL;
+  }
 
-  while (!(cursor->end_of_table)) {
-    uint32_t *c_value = cursor_value(cursor);
-    deserialize_row(c_value, &row);
-    print_row(&row);
-    cursor_advance(cursor);
+  *length = ntohl(header);
+  char *response = malloc(*length + 1);
+  if (!read_all(fd, response, *length)) {
+    free(response);
+    return NULL;
   }
-  return EXECUTE_SUCCESS;
+  response[*length] = '\0';
+  return response;
 }
 
-ExecuteResult execute_statement(Statement *statement, Table *table) {
-  switch (statement->type) {
-  case (STATEMENT_INSERT):
-    return execute_insert(statement, table);
-  case (STATMENT_SELECT):
-    return execute_select(statement, table);
+// The REPL, with statements run by the server at path.
+void client_run(const char *path) {
+  int fd = client_connect(path);
+  InputBuffer *input_buffer = new_input_buffer();
+
+  while (true) {
+    print_prompt();
+    read_input(input_buffer);
+    if (strcmp(input_buffer->buffer, ".exit") == 0 ||
+        strcmp(input_buffer->buffer, "exit") == 0) {
+      break;
+    }
+    if (input_buffer->input_length > SERVER_MAX_REQUEST_SIZE) {
+      printf("Error: Statement too long to send.\n");
+      continue;
+    }
+
+    uint32_t length;
+    char *response = client_request(fd, input_buffer->buffer, &length);
+    if (response == NULL) {
+      printf("Error: Lost the connection to the server.\n");
+      exit(EXIT_FAILURE);
+    }
+    fwrite(response, 1, length, stdout);
+    free(response);
   }
+
+  close(fd);
+  close_input_buffer(input_buffer);
 }
 
 // Basic REPL-CLI (Sometimes you've got to learn to run before you can walk --
@@ -542,15 +7868,77 @@ ExecuteResult execute_statement(Statement *statement, Table *table) {
 int main(int argc, char *argv[]) {
   print_start_screen();
 
-  if (argc < 2) {
+  DbOptions options = default_db_options();
+  char *filename = NULL;
+  char *import_path = NULL;
+  char *serve_path = NULL;
+  OutputFormat output_format = OUTPUT_TUPLE;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc) {
+      options.cache_pages = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.pager_mode = PAGER_MODE_MMAP;
+    } else if (strcmp(argv[i], "--import") == 0 && i + 1 < argc) {
+      import_path = argv[++i];
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      serve_path = argv[++i];
+    } else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+      client_run(argv[++i]);
+      exit(EXIT_SUCCESS);
+    } else if (strcmp(argv[i], "--direct-io") == 0) {
+      options.direct_io = true;
+    } else if (strcmp(argv[i], "--compress-keys") == 0) {
+      options.compress_keys = true;
+    } else if (strcmp(argv[i], "--pax") == 0) {
+      options.leaf_layout = LEAF_LAYOUT_PAX;
+    } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+      if (!parse_output_format(argv[++i], &output_format)) {
+        printf("Unrecognised output mode '%s'.\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc) {
+      options.scan_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--scrub") == 0 && i + 1 < argc) {
+      options.scrub_pages_per_second = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--no-wal") == 0) {
+      options.wal_enabled = false;
+    } else if (strcmp(argv[i], "--wal-sync-statements") == 0 && i + 1 < argc) {
+      options.wal_sync_statements = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--wal-sync-ms") == 0 && i + 1 < argc) {
+      options.wal_sync_interval_ms = atoi(argv[++i]);
+    } else if (argv[i][0] == '-') {
+      printf("Unrecognised option '%s'.\n", argv[i]);
+      exit(EXIT_FAILURE);
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  if (filename == NULL) {
     printf("DB filname is required");
     exit(EXIT_FAILURE);
   }
 
-  char *filename = argv[1];
-  Table *table = db_open(filename);
+  Table *table = db_open_with_options(filename, &options);
+  table->output_format = output_format;
+
+  if (import_path != NULL) {
+    import_file(table, import_path, IMPORT_DEFAULT_FILL_PERCENT);
+  }
+
+  if (serve_path != NULL) {
+    Server *server = server_open(table, serve_path);
+    printf("Serving on %s.\n", serve_path);
+    fflush(stdout);
+    server_run(server);
+    server_close(server);
+    db_close(table);
+    exit(EXIT_SUCCESS);
+  }
 
   InputBuffer *input_buffer = new_input_buffer();
+  StatementCache *statement_cache = calloc(1, sizeof(StatementCache));
 
   while (true) {
     print_prompt();
@@ -558,6 +7946,7 @@ int main(int argc, char *argv[]) {
 
     if (strcmp(input_buffer->buffer, "exit") == 0) {
       close_input_buffer(input_buffer);
+      db_close(table);
       exit(EXIT_SUCCESS);
     } else {
       if (input_buffer->buffer[0] == '.') {
@@ -570,25 +7959,15 @@ int main(int argc, char *argv[]) {
         }
       }
 
-      Statement statement;
-
-      switch (prepare_statement(input_buffer, &statement)) {
-      case (PREPARE_SUCCESS):
-        break;
-      case (PREPARE_STRING_TOO_LONG):
-        printf("String is too log. \n");
-        continue;
-
-      case (PREPARE_SYNTAX_ERROR):
-        printf("Syntax error bih cannot parse 🧙🏻‍♀️");
-      case (PREPARE_UNRECOGNISED_STATEMENT):
-        printf("Unrecognised keyword at start of '%s' . \n",
-               input_buffer->buffer);
+      if (strncmp(input_buffer->buffer, "explain analyze ", 16) == 0) {
+        explain_analyze(input_buffer, table, statement_cache);
         continue;
       }
 
-      execute_statement(&statement, table);
-      printf("Executed. \n");
+      Statement statement;
+      if (prepare_input(input_buffer, &statement, statement_cache, stdout)) {
+        report_execute_result(execute_statement(&statement, table), stdout);
+      }
     }
   }
 }
@@ -32,13 +32,14 @@ describe 'database' do
     ])
   end
 
-  it 'prints error message when table is full' do
+  it 'keeps inserting once the table outgrows the buffer pool' do
     script = (1..1401).map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
     end
+    script << "select where id = 1401"
     script << ".exit"
     result = run_script(script)
-    expect(result[-2]).to eq('f_yeah_db 🤞🏾> Error: Table full.')
+    expect(result[-3]).to eq('f_yeah_db 🤞🏾> (1401, user1401, person1401@example.com)')
   end
 
   it 'allows inserting strings that are the maximum length' do
@@ -108,6 +109,75 @@ describe 'database' do
   ])
   end
 
+  it 'prints an error message if there is a duplicate id' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 1 user1 person1@example.com",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "f_yeah_db 🤞🏾> Executed. ",
+      "f_yeah_db 🤞🏾> Error: Duplicate key.",
+      "f_yeah_db 🤞🏾> (1, user1, person1@example.com)",
+      "Executed. ",
+      "f_yeah_db 🤞🏾> ",
+    ])
+  end
+
+  it 'looks up a single row by id' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select where id = 17"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-3]).to eq("f_yeah_db 🤞🏾> (17, user17, person17@example.com)")
+  end
+
+  it 'filters a select with where predicates' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select id, email where id > 9 and id in (3, 12, 25) and username like user1%"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-3]).to eq("f_yeah_db 🤞🏾> (12, person12@example.com)")
+    expect(result[-2]).to eq("Executed. ")
+  end
+
+  it 'keeps a secondary index up to date and answers lookups from it' do
+    script = ["insert 1 alice shared@example.com", "create index on email"]
+    script << "insert 2 bob shared@example.com"
+    script << "create index on email"
+    script << "select id where email = shared@example.com"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[-5]).to eq("f_yeah_db 🤞🏾> Error: Index already exists.")
+    expect(result[-4]).to eq("f_yeah_db 🤞🏾> (1)")
+    expect(result[-3]).to eq("(2)")
+    expect(result[-2]).to eq("Executed. ")
+  end
+
+  it 'rolls back a transaction and keeps a committed one' do
+    script = [
+      "begin",
+      "insert 1 user1 person1@example.com",
+      "commit",
+      "begin",
+      "insert 2 user2 person2@example.com",
+      "rollback",
+      "rollback",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[-4]).to eq("f_yeah_db 🤞🏾> Error: No transaction is open.")
+    expect(result[-3]).to eq("f_yeah_db 🤞🏾> (1, user1, person1@example.com)")
+    expect(result[-2]).to eq("Executed. ")
+  end
+
   it 'it allows printing structure of root node btree' do
     script = [3,1,2].map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -120,13 +190,49 @@ describe 'database' do
       "f_yeah_db 🤞🏾> executed.",
       "f_yeah_db 🤞🏾> executed.",
       "f_yeah_db 🤞🏾> executed.",
-      "leaf (size 3)",
-      " -0 : 3",
-      " -1 : 1",
-      " -2 : 2",
-      "db > "
+      "f_yeah_db 🤞🏾> Tree",
+      "- leaf (size 3)",
+      "  - 1",
+      "  - 2",
+      "  - 3",
+      "f_yeah_db 🤞🏾> "
     ])
 
+    it 'allows printing structure of a multi-level btree' do
+      long_email = "a"*255
+      script = (1..16).map do |i|
+        "insert #{i} user#{i} #{long_email}"
+      end
+      script << ".btree"
+      script << ".exit"
+      result = run_script(script)
+
+      expect(result[16...(result.length)]).to match_array([
+        "f_yeah_db 🤞🏾> Tree",
+        "- internal (size 1)",
+        "  - leaf (size 8)",
+        "    - 1",
+        "    - 2",
+        "    - 3",
+        "    - 4",
+        "    - 5",
+        "    - 6",
+        "    - 7",
+        "    - 8",
+        "  - key 8",
+        "  - leaf (size 8)",
+        "    - 9",
+        "    - 10",
+        "    - 11",
+        "    - 12",
+        "    - 13",
+        "    - 14",
+        "    - 15",
+        "    - 16",
+        "f_yeah_db 🤞🏾> ",
+      ])
+    end
+
     it 'prints constants' do
     script = [
       ".constants",
@@ -136,12 +242,12 @@ describe 'database' do
 
     expect(result).to match_array([
      "db > Constants:",
-     "ROW_SIZE: 293",
-      "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 10",
-      "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4086",
-      "LEAF_NODE_MAX_CELLS: 13",
+     "ROW_MAX_SIZE: 293",
+      "COMMON_NODE_HEADER_SIZE: 7",
+      "LEAF_NODE_HEADER_SIZE: 20",
+      "LEAF_NODE_SLOT_SIZE: 2",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4072",
+      "LEAF_NODE_MAX_CELLS: 509",
       "db > ",
     ])
   end